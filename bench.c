@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "xtmpl.h"
+
+/* Measures the time of a render for a few templates, both
+ * through xt_render_str_to_cb, which compiles the template
+ * every time, and through a template compiled once. Each
+ * measure is the best of many short runs, in microseconds,
+ * since short runs are less likely to be interrupted. 
+ * Build it with optimizations, as build.sh does.
+ */
+
+#define RUNS 200
+
+static long written = 0;
+
+static void sink(const char *str, long len, void *userp)
+{
+    (void) str;
+    (void) userp;
+    written += len;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Returns the time of a render of [src] in microseconds */
+static double measure(const char *src, long reps, bool precompiled)
+{
+    double best = -1;
+    for(int run = 0; run < RUNS; run += 1) {
+        XT_Error err;
+        XT_Template *tmpl = NULL;
+        if(precompiled && (tmpl = xt_compile(src, -1, &err)) == NULL) {
+            fprintf(stderr, "Couldn't compile the template: %s\n", err.message);
+            return -1;
+        }
+        double start = now();
+        for(long r = 0; r < reps; r += 1) {
+            bool ok;
+            if(precompiled)
+                ok = xt_render_to_cb(tmpl, NULL, sink, NULL, &err);
+            else
+                ok = xt_render_str_to_cb(src, -1, NULL, sink, NULL, &err);
+            if(!ok) {
+                fprintf(stderr, "Couldn't render the template: %s\n", err.message);
+                xt_free(tmpl);
+                return -1;
+            }
+        }
+        double elapsed = (now() - start) * 1e6 / reps;
+        xt_free(tmpl);
+        if(best < 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+int main(void)
+{
+    static char list[4096], loop[8192], nested[8192];
+
+    int used = snprintf(list, sizeof(list), "[");
+    for(int i = 0; i < 200; i += 1)
+        used += snprintf(list + used, sizeof(list) - used, "%s%d", i ? ", " : "", i);
+    snprintf(list + used, sizeof(list) - used, "]");
+
+    snprintf(loop, sizeof(loop), 
+        "{%% for i, v in %s %%}<li>{{i}}: {{v*2+1}}</li>{%% if v %%}x{%% else %%}y{%% endif %%}{%% endfor %%}", list);
+    snprintf(nested, sizeof(nested), 
+        "{%% for i, v in [1,2,3,4,5,6,7,8,9,10] %%}{%% for j, w in %s %%}{{v*w}} {%% endfor %%}{%% endfor %%}", list);
+
+    struct {
+        const char *name;
+        const char *src;
+        long        reps;
+    } cases[] = {
+        { "200-item loop + if", loop,   50    },
+        { "10x200 nested loops", nested, 5     },
+        { "short text + if", "<html><body>{% if 1 %}Hello, {{1+2}}{% else %}no{% endif %}</body></html>", 10000 },
+    };
+
+    printf("%-22s %12s %12s\n", "us per render", "from source", "precompiled");
+    for(unsigned int k = 0; k < sizeof(cases)/sizeof(cases[0]); k += 1) {
+        double src  = measure(cases[k].src, cases[k].reps, false);
+        double comp = measure(cases[k].src, cases[k].reps, true);
+        if(src < 0 || comp < 0)
+            return 1;
+        printf("%-22s %12.2f %12.2f\n", cases[k].name, src, comp);
+    }
+    return written == 0;
+}
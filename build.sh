@@ -1,2 +1,7 @@
 gcc cli.c xtmpl.c -o xtmpl -Wall -Wextra -g
-gcc test.c -o test -Wall -Wextra -g
\ No newline at end of file
+gcc test.c -o test -Wall -Wextra -g
+./test --emit-c > test_emitted.c
+gcc test.c -o test -Wall -Wextra -g -DTEST_EMITTED
+gcc -c xtmpl.c -o xtmpl.o -Wall -Wextra -g
+g++ -std=c++20 test.cpp xtmpl.o -o test-cpp -Wall -Wextra -g
+gcc bench.c xtmpl.c -o bench -O2 -Wall -Wextra
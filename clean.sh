@@ -1 +1 @@
-rm test test-cov xtmpl *.gcda *.gcno *.gcov vgcore.*
\ No newline at end of file
+rm bench test test-cov test-cpp test_emitted.c xtmpl xtmpl.o *.gcda *.gcno *.gcov vgcore.*
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <stdio.h>
 #include "xtmpl.h"
@@ -55,8 +56,41 @@ static char *load_from_stream(FILE *fp, long *out_size, const char **err)
     return data;
 }
 
-int main()
+static void write_to_stdout(const char *str, long len, void *userp)
 {
+    (void) userp;
+    fwrite(str, 1, len, stdout);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [--emit-c <function name>] [--escape html|url] [--minify] < template\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    // When a function name is specified, the template
+    // is translated to C instead of being rendered.
+    const char *emit_c = NULL;
+    XT_Escape escape = XT_ESCAPE_NONE;
+    int flags = 0;
+    for(int i = 1; i < argc; i += 1) {
+        if(!strcmp(argv[i], "--emit-c") && i+1 < argc)
+            emit_c = argv[++i];
+        else if(!strcmp(argv[i], "--escape") && i+1 < argc && !strcmp(argv[i+1], "html")) {
+            escape = XT_ESCAPE_HTML;
+            i += 1;
+        } else if(!strcmp(argv[i], "--escape") && i+1 < argc && !strcmp(argv[i+1], "url")) {
+            escape = XT_ESCAPE_URL;
+            i += 1;
+        } else if(!strcmp(argv[i], "--minify"))
+            flags |= XT_MINIFY;
+        else {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
     const char *errmsg;
     char  *tmpl_str;
     long   tmpl_len;
@@ -67,9 +101,36 @@ int main()
         return -1;
     }
 
-    long len;
     XT_Error err;
-    char *str = xt_render_str_to_str(tmpl_str, tmpl_len, NULL, &len, &err);
+
+    if(emit_c) {
+        XT_Template *tmpl = xt_compile_flags(tmpl_str, tmpl_len, flags, &err);
+        if(tmpl != NULL)
+            xt_set_escape(tmpl, escape);
+        if(tmpl == NULL || !xt_emit_c(tmpl, emit_c, write_to_stdout, NULL, &err)) {
+            assert(err.occurred);
+            fprintf(stderr, "Error: %s\n", err.message);
+            xt_free(tmpl);
+            free(tmpl_str);
+            return -1;
+        }
+        xt_free(tmpl);
+        free(tmpl_str);
+        return 0;
+    }
+
+    XT_Template *tmpl = xt_compile_flags(tmpl_str, tmpl_len, flags, &err);
+    if(tmpl == NULL) {
+        assert(err.occurred);
+        fprintf(stderr, "Error: %s\n", err.message);
+        free(tmpl_str);
+        return -1;
+    }
+    xt_set_escape(tmpl, escape);
+
+    long len;
+    char *str = xt_render_to_str(tmpl, NULL, &len, &err);
+    xt_free(tmpl);
     if(str == NULL) {
         assert(err.occurred);
         fprintf(stderr, "Error: %s\n", err.message);
@@ -86,19 +86,310 @@ static void free_override(void *p)
 
 #include "xtmpl.c"
 
-struct {
+/* Variables available to every test case. Arrays
+ * provided by the host are borrowed, so they must
+ * never be freed (or counted as allocations).
+ */
+static Value host_items[] = {
+    { VK_INT, .as_int = 1 },
+    { VK_INT, .as_int = 2 },
+    { VK_INT, .as_int = 3 },
+};
+static ArrayValue host_array = { .refs = 0, .count = 3, .capacity = 3, .items = host_items };
+static long long host_ints[] = { 4, 5 };
+static ArrayValue host_packed = { .refs = 0, .count = 2, .capacity = 2, .type = AT_INT, .ints = host_ints };
+static double host_floats[] = { 1.45, 0.285, 2.675, 0.125, 0.5, 2.5 }; // Mostly not exact
+static ArrayValue host_fpacked = { .refs = 0, .count = 6, .capacity = 6, .type = AT_FLOAT, .floats = host_floats };
+static struct { int id; double score; } host_rows[] = {
+    { 1, 0.5 }, { 2, 1.5 }, { 3, 2.5 },
+};
+static ArrayValue host_scores; // Filled by [main]
+static MapValue host_map, host_inner;
+static MapEntry host_map_table[8], host_inner_table[2];
+static bool host_add(Value *args, int argc, Value *out, const char **err)
+{
+    long long sum = 0;
+    for(int i = 0; i < argc; i += 1) {
+        if(args[i].kind != VK_INT) {
+            *err = "Arguments must be integers";
+            return false;
+        }
+        sum += args[i].as_int;
+    }
+    *out = (Value) { VK_INT, .as_int = sum };
+    return true;
+}
+static bool host_first(Value *args, int argc, Value *out, const char **err)
+{
+    (void) err;
+    if(argc == 0)
+        return false;
+    *out = args[0];
+    return true;
+}
+static int tick_count, render_step; // Reset by [render]
+static bool host_tick(Value *args, int argc, Value *out, const char **err)
+{
+    (void) args; (void) argc; (void) err;
+    *out = (Value) { VK_INT, .as_int = ++tick_count };
+    return true;
+}
+static Variable var_list[] = {
+    { "harr", 4, { VK_ARRAY, .as_array = &host_array } },
+    { "hints", 5, { VK_ARRAY, .as_array = &host_packed } },
+    { "hfloats", 7, { VK_ARRAY, .as_array = &host_fpacked } },
+    { "hscores", 7, { VK_ARRAY, .as_array = &host_scores } },
+    { "hstr", 4, { VK_STRING, 5, .as_str = "hello" } },
+    { "hmap", 4, { VK_MAP, .as_map = &host_map } },
+    { "add", 3, { VK_FUNC, .as_func = host_add } },
+    { "first", 5, { VK_FUNC, .as_func = host_first } },
+    { "tick", 4, { VK_FUNC, .as_func = host_tick } },
+    { NULL, 0, { VK_INT, .as_int = 0 } },
+};
+static Value lazy_resolve(const char *name, long len, void *userp)
+{
+    (void) userp;
+    if(len == 4 && !strncmp(name, "lazy", len))
+        return (Value) { VK_INT, .as_int = 7 };
+    if(len == 6 && !strncmp(name, "lazyfn", len))
+        return (Value) { VK_FUNC, .as_func = host_add };
+    if(len == 4 && !strncmp(name, "harr", len))
+        return (Value) { VK_INT, .as_int = 0 };
+    if(len == 4 && !strncmp(name, "step", len))
+        return (Value) { VK_INT, .as_int = render_step };
+    return (Value) { VK_ERROR };
+}
+static Variables lazy_vars = { NULL, NULL, lazy_resolve, NULL };
+static Variables vars = { &lazy_vars, var_list, NULL, NULL };
+
+/* Variables known when specializing templates. They're
+ * defined when rendering too, on top of [vars].
+ */
+static Variable known_list[] = {
+    { "k", 1, { VK_INT, .as_int = 0 } },
+    { "kname", 5, { VK_STRING, 5, .as_str = "<Ann>" } },
+    { "kmap", 4, { VK_MAP, .as_map = &host_map } },
+    { NULL, 0, { VK_INT, .as_int = 0 } },
+};
+static Variables known_vars = { NULL, known_list, NULL, NULL };
+
+/* Variables decoded from JSON. The scope keeps what it
+ * decodes until it's closed, so it's opened again for
+ * every render.
+ */
+static const char json_doc[] = 
+    "{\"user\": {\"name\": \"Ann\", \"age\": 31, \"admin\": true, \"tags\": [\"a\", \"b\"],"
+    " \"esc\": \"q\\\"\\u00e9\\ud83d\\ude00\\n\"},"
+    " \"nums\": [1, 2, -3], \"floats\": [0.5, 1e2], \"mixed\": [1, 2.5, \"x\", null, false, {\"k\": []}],"
+    " \"empty\": {}, \"dup\": 1, \"dup\": 2}";
+
+/* Returns [res], the output of a specialized template,
+ * if it's the same as [exp], the one of the original,
+ * or if both failed the same way. Allocations failing
+ * in either render make it fail with that error. 
+ */
+static char *same_render(char *res, XT_Error *err, char *exp, XT_Error *exp_err)
+{
+    bool same;
+    if(res && exp)
+        same = !strcmp(res, exp);
+    else
+        same = !res && !exp && !strcmp(err->message, exp_err->message) && err->off == exp_err->off;
+    free(exp);
+
+    if(same)
+        return res;
+    free(res);
+    if(res && !exp && !strcmp(exp_err->message, "Out of memory"))
+        *err = *exp_err;
+    else if(res || strcmp(err->message, "Out of memory")) {
+        memset(err, 0, sizeof(XT_Error));
+        report(err, -1, "The specialized template renders differently");
+    }
+    return NULL;
+}
+
+/* How a template changes before it's rendered again */
+enum {
+    ONCE,
+    TWICE,
+    INVALIDATE, // With xt_invalidate
+    ESCAPE, // With xt_set_escape(XT_ESCAPE_HTML)
+    BIND, // By binding [tick] to [host_add]
+};
+
+/* A row of [tcases]. Rows expect either the output [exp]
+ * or the error [err]. The other fields are options of 
+ * the render, which are all off in rows that leave them
+ * out (see [render]).
+ */
+typedef struct {
     long line;
     const char *src;
     const char *exp;
     const char *err;
-} tcases[] = {
-    {__LINE__, .src = NULL, .exp = "", NULL},
-    {__LINE__, "", "", NULL},
-    {__LINE__, "Hello, world!", "Hello, world!", NULL},
-    {__LINE__, "{{1}}", "1", NULL},
-    {__LINE__, "{{10}}", "10", NULL},
-    {__LINE__, "{{1.1}}", "1.100000", NULL},
-    {__LINE__, "{{10.10}}", "10.100000", NULL},
+    int flags; // Passed to xt_compile_flags
+    long cache; // Budget of the fragment cache, if any
+    bool memo; // Renders are memoized in the cache
+    int again; // See [render_again]
+    const char *changed; // See [render_changed]
+    bool rope; // See [render_rope]
+    XT_Escape escape; // Passed to xt_set_escape
+    bool specialize; // See [render_specialized]
+    const char *bind; // Calls of this name are bound to [host_tick]
+} TestCase;
+
+/* Rows rendered with xt_render_str_to_str, except for
+ * their escaping mode.
+ */
+static bool is_plain(const TestCase *t)
+{
+    return t->flags == 0 && t->cache == 0 && !t->memo 
+        && t->again == ONCE && t->changed == NULL && !t->rope 
+        && !t->specialize && t->bind == NULL;
+}
+
+/* Renders [tmpl] to a rope that's appended to one holding
+ * "[", followed by "]".
+ */
+static char *render_rope(XT_Template *tmpl, XT_Error *err)
+{
+    char *res = NULL;
+    XT_Rope *outer = xt_rope_create();
+    XT_Rope *inner = xt_rope_create();
+    if(outer && inner && xt_rope_append(outer, "[", 1, true)) {
+        if(xt_render_to_rope(tmpl, &vars, inner, err)) {
+            xt_rope_concat(outer, inner);
+            buff_t buff = { .failed = !xt_rope_append(outer, "]", 1, false) };
+            xt_rope_write(outer, callback, &buff);
+            res = buff_to_str(&buff, NULL, err);
+        }
+    } else
+        report(err, -1, "Out of memory");
+    xt_rope_free(inner);
+    xt_rope_free(outer);
+    return res;
+}
+
+/* Specializes [tmpl] on [known_vars] and renders both
+ * templates, failing unless they render the same way.
+ */
+static char *render_specialized(XT_Template *tmpl, XT_Error *err)
+{
+    XT_Template *spec = xt_specialize(tmpl, &known_vars, err);
+    if(spec == NULL)
+        return NULL;
+
+    Variables all = { &vars, known_list, NULL, NULL };
+    XT_Error exp_err;
+    char *exp = xt_render_to_str(tmpl, &all, NULL, &exp_err);
+    char *res = xt_render_to_str(spec, &all, NULL, err);
+    xt_free(spec);
+    return same_render(res, err, exp, &exp_err);
+}
+
+/* Renders [tmpl] to segments, changes [step] and renders
+ * again the segments that read [changed].
+ */
+static char *render_changed(XT_Template *tmpl, const char *changed, XT_Error *err)
+{
+    char *res = NULL;
+    XT_Segments *segs = xt_render_segments(tmpl, &vars, err);
+    render_step += 1;
+    const char *names[] = { changed, NULL };
+    if(segs && xt_rerender(segs, &vars, names, err))
+        res = xt_segments_to_str(segs, NULL, err);
+    xt_segments_free(segs);
+    return res;
+}
+
+/* Renders [tmpl] and, unless [again] is ONCE, changes
+ * [step] and the template as [again] says and returns
+ * the output of a second render.
+ */
+static char *render_again(XT_Template *tmpl, int again, XT_Error *err)
+{
+    char *res = xt_render_to_str(tmpl, &vars, NULL, err);
+    if(res != NULL && again != ONCE) {
+        free(res);
+        render_step += 1;
+        if(again == INVALIDATE)
+            xt_invalidate(tmpl);
+        if(again == ESCAPE)
+            xt_set_escape(tmpl, XT_ESCAPE_HTML);
+        if(again == BIND)
+            xt_bind(tmpl, "tick", host_add);
+        res = xt_render_to_str(tmpl, &vars, NULL, err);
+    }
+    return res;
+}
+
+/* Renders the row [t] with its options. [step] and the
+ * counter of [tick] start from 0, and the JSON scope is
+ * opened again for every render.
+ */
+static char *render(const TestCase *t, XT_Error *err)
+{
+    tick_count = 0;
+    render_step = 0;
+    XT_Json *json = xt_json_open(json_doc, -1, NULL);
+    if(json == NULL) {
+        memset(err, 0, sizeof(XT_Error));
+        err->occurred = true;
+        strcpy(err->message, "Out of memory");
+        return NULL;
+    }
+    lazy_vars.parent = xt_json_scope(json);
+
+    char *res = NULL;
+    if(is_plain(t) && t->escape == XT_ESCAPE_NONE)
+        res = xt_render_str_to_str(t->src, -1, &vars, NULL, err);
+    else {
+        // A cache that can't be created is like no cache
+        XT_Cache *frags = (t->cache > 0) ? xt_cache_create(t->cache, 0) : NULL;
+        XT_Template *tmpl = xt_compile_flags(t->src, -1, t->flags, err);
+        if(tmpl != NULL && t->bind != NULL && !xt_bind(tmpl, t->bind, host_tick)) {
+            report(err, -1, "Nothing to bind");
+            xt_free(tmpl);
+            tmpl = NULL;
+        }
+        if(tmpl != NULL) {
+            if(t->escape != XT_ESCAPE_NONE)
+                xt_set_escape(tmpl, t->escape);
+            xt_set_cache(tmpl, frags);
+            if(t->rope)
+                res = render_rope(tmpl, err);
+            else if(t->specialize)
+                res = render_specialized(tmpl, err);
+            else if(t->changed)
+                res = render_changed(tmpl, t->changed, err);
+            else {
+                // A memo that can't be set is like no memo
+                if(t->memo)
+                    xt_set_memo(tmpl, frags);
+                res = render_again(tmpl, t->again, err);
+            }
+            xt_free(tmpl);
+        }
+        xt_cache_free(frags);
+    }
+    xt_json_close(json);
+    return res;
+}
+
+#define TIMES_10(s) s s s s s s s s s s
+
+static TestCase tcases[] = {
+    {__LINE__, .src = NULL, .exp = ""},
+    {__LINE__, .src = "", .exp = ""},
+    {__LINE__, .src = "Hello, world!", .exp = "Hello, world!"},
+    {__LINE__, .src = "{{1}}", .exp = "1"},
+    {__LINE__, .src = "{{10}}", .exp = "10"},
+    {__LINE__, .src = "{{1.1}}", .exp = "1.100000"},
+    {__LINE__, .src = "{{10.10}}", .exp = "10.100000"},
+    {__LINE__, .src = "{{0}}.{{1}}.{{2}}.{{3}}.{{4}}.{{5}}.{{6}}.{{7}}.{{8}}.{{9}}."
+                      "{{0}}.{{1}}.{{2}}.{{3}}.{{4}}.{{5}}.{{6}}.{{7}}.{{8}}.{{9}}.",
+                      .exp = "0.1.2.3.4.5.6.7.8.9.0.1.2.3.4.5.6.7.8.9."},
 
     {__LINE__, .src = "{{[]}}",  .exp = "[]"},
     {__LINE__, .src = "{{[1]}}", .exp = "[1]"},
@@ -238,7 +529,7 @@ struct {
     {__LINE__, .src = "{% for x, y in %}", .err = "Expression ended where a primary expression was expected"},
     {__LINE__, .src = "{% for x, y iv %}", .err = "Missing [in] keyword after iteration variable name"},
 
-    {__LINE__, .src = "{% for x in 3 %}", .err = "Iteration subject isn't an array"},
+    {__LINE__, .src = "{% for x in 3 %}", .err = "Iteration subject isn't an array or an iterator"},
     {__LINE__, .src = "{% for x in [0, 0, 0] %}{{x}}", .exp = "012"},
     {__LINE__, .src = "{% for x in [0] %}{% if %}", .err = "Expression ended where a primary expression was expected"},
 
@@ -247,6 +538,190 @@ struct {
     {__LINE__, .src = "{% if 1 %}{% for %}", .err = "For statement ended unexpectedly"},
     {__LINE__, .src = "{% if 0 %}{% else %}{% for %}", .err = "For statement ended unexpectedly"},
     {__LINE__, .src = "{% if 0 %}x{% for x in [0] %}y{% if 0 %}z", .exp = ""},
+    {__LINE__, .src = "{% if 1 %}a{% else %}b{% endif %}c", .exp = "ac"},
+    {__LINE__, .src = "{% if 0 %}a{% else %}b{% endif %}c", .exp = "bc"},
+    {__LINE__, .src = "{% for i, v in [1, 2] %}{% for j, w in [3, 4] %}{{v*w}} {% endfor %}{% endfor %}", .exp = "3 4 6 8 "},
+    {__LINE__, .src = "{% for x in [5, 6] %}{% for x in [7] %}{{x}}{% endfor %}{{x}}{% endfor %}", .exp = "0001"},
+    {__LINE__, .src = "{% for i, v in [1, 2] %}{% for j, w in [10, 20] %}{{v*2+w}} {% endfor %}{% endfor %}", .exp = "12 22 14 24 "},
+    {__LINE__, .src = "{% for i, v in [1, 2] %}{% for j in [0, 0] %}{% if v-1 %}a{% else %}b{% endif %}{% for k, w in [v*3] %}{{w+j}}{% endfor %}{% endfor %}{% endfor %}", .exp = "b3b4a6a7"},
+
+    {__LINE__, .src = "{{harr}}{% for i, v in harr %}{{v}}{% endfor %}{{harr}}", .exp = "[1, 2, 3]123[1, 2, 3]"},
+    {__LINE__, .src = "{% for i in harr %}{% for j, v in harr %}{{v}}{% endfor %}{% endfor %}", .exp = "123123123"},
+    {__LINE__, .src = "{{[harr, [harr]]}}", .exp = "[[1, 2, 3], [[1, 2, 3]]]"},
+    {__LINE__, .src = "{% for i, row in [[1, 2], [3]] %}{{row}}{{[row, row]}}{% for j, v in row %}{{v}}{% endfor %}{% endfor %}", .exp = "[1, 2][[1, 2], [1, 2]]12[3][[3], [3]]3"},
+    {__LINE__, .src = "{{[1, 2.5, [3], 4]}}{{[1.5, 2]}}{{[[1], 2]}}", .exp = "[1, 2.500000, [3], 4][1.500000, 2][[1], 2]"},
+    {__LINE__, .src = "{% for i, v in [1.5, 2.5] %}{{v*2}} {% endfor %}{% for i, v in hints %}{{v+i}}{% endfor %}{{hints}}{{[hints, 1]}}", .exp = "3.000000 5.000000 46[4, 5][[4, 5], 1]"},
+    {__LINE__, .src = "{{\"abc\"}}{{'it\"s'}}{{\"it's\"}}{{''}}", .exp = "abcit\"sit's"},
+    {__LINE__, .src = "{{\"}}\"}}{% if \"%}\" %}x{% endif %}", .exp = "}}x"},
+    {__LINE__, .src = "{{hstr}}, {{[hstr, 'x', 1]}}{% for i, s in ['a', 'b'] %}{{s}}{{hstr}}{% endfor %}", .exp = "hello, [hello, x, 1]ahellobhello"},
+    {__LINE__, .src = "{{\"abc}}", .err = "Expression ended inside of a string"},
+    {__LINE__, .src = "{{'a' + 1}}", .err = "Bad \"+\" operand"},
+    {__LINE__, .src = "{{hmap.name}} {{hmap['age']}} {{hmap.tags}} {{hmap.inner.x}} {{hmap . inner}}", .exp = "Bob 42 [1, 2, 3] 1 {x: 1}"},
+    {__LINE__, .src = "{% for i, k in ['name', 'age'] %}{{hmap[k]}}{{hmap.age * i}} {% endfor %}{% for i, v in hmap.tags %}{{v}}{% endfor %}", .exp = "Bob0 4242 123"},
+    {__LINE__, .src = "{{hmap.nope}}", .err = "Undefined field [nope]"},
+    {__LINE__, .src = "{{hmap['a']}}", .err = "Undefined field [a]"},
+    {__LINE__, .src = "{{harr.x}}", .err = "Not a map, can't access field [x]"},
+    {__LINE__, .src = "{% for i, k in ['a'] %}{{hmap[k]}}{% endfor %}", .err = "Undefined key"},
+    {__LINE__, .src = "{{hmap[1]}}", .err = "Map keys must be strings"},
+    {__LINE__, .src = "{{1['a' + 1]}}", .err = "Bad \"+\" operand"},
+    {__LINE__, .src = "{{harr[hstr]}}", .err = "Array indexes must be integers"},
+    {__LINE__, .src = "{{hmap.}}", .err = "Expected a field name after [.]"},
+    {__LINE__, .src = "{{hmap[1}}", .err = "Expression ended inside of an index"},
+    {__LINE__, .src = "{{hmap[1 2]}}", .err = "Unexpected character [2] inside of an index"},
+    {__LINE__, .src = "{{harr[0]}}{{harr[2]}} {{hints[1]}} {{[1, [2, 3]][1][0]}} {{hscores[1]}} {% for i, v in harr %}{{harr[i]}}{% endfor %}", .exp = "13 5 2 1.500000 123"},
+    {__LINE__, .src = "{{harr[1:]}}{{harr[:2]}}{{harr[:]}}{{harr[2:1]}}{{harr[1:5]}}{{harr[1:3][1:]}}{{[1, 'a', [2]][1:]}}", .exp = "[2, 3][1, 2][1, 2, 3][][2, 3][3][a, [2]]"},
+    {__LINE__, .src = "{% for i in [0, 1] %}{{harr[i:i+2]}}{% endfor %}{% for i, v in hscores[1:] %}{{v}} {% endfor %}{{hints[1:][0]}}", .exp = "[1, 2][2, 3]1.500000 2.500000 5"},
+    {__LINE__, .src = "{{1 < 2}}{{2 < 1}}{{1 <= 1}}{{2 >= 3}}{{3 > 2.5}}{{1 == 1.0}}{{1 != 1}}{{'ab' < 'b'}}{{'a' == 'a'}}{{'a' == 1}}{{harr == harr}}{{[] != hmap}}", .exp = "101011011011"},
+    {__LINE__, .src = "{{1 + 1 == 2 and 2 * 3 > 5}}{{0 or 'x'}}{{'' or 0}}{{1 and 'y'}}{{not 1 == 2}}{{not 0 and 0}}{{0 or 1 and 0}}{{not not 3}}{{[0 or harr][0]}}", .exp = "1x0y1001[1, 2, 3]"},
+    {__LINE__, .src = "{{0 and nope}}{{1 or nope.x}}{{'' and nofn(1)}}{% for i, v in harr %}{{v > 1 or first(harr[i:])}}{% endfor %}", .exp = "01[1, 2, 3]11"},
+    {__LINE__, .src = "{% for i, v in harr %}{% if v >= 2 and v != 3 %}a{% else %}b{% endif %}{% endfor %}{% if [] %}x{% endif %}{% if '' or hmap %}y{% endif %}{% if not harr %}z{% endif %}", .exp = "baby"},
+    {__LINE__, .src = "{{0 or nope}}", .err = "Undefined variable [nope]"},
+    {__LINE__, .src = "{{1 < 'a'}}", .err = "Bad \"<\" operand"},
+    {__LINE__, .src = "{{hmap >= 1}}", .err = "Bad \">=\" operand"},
+    {__LINE__, .src = "{{not}}", .err = "Expression ended where a primary expression was expected"},
+    {__LINE__, .src = "{{harr[3]}}", .err = "Index out of bounds"},
+    {__LINE__, .src = "{{hmap[1:2]}}", .err = "Can't slice something other than an array"},
+    {__LINE__, .src = "{{harr['a':]}}", .err = "Slice bounds must be integers"},
+    {__LINE__, .src = "{{harr[1:}}", .err = "Expression ended inside of a slice"},
+    {__LINE__, .src = "{{harr[1:2 3]}}", .err = "Unexpected character [3] inside of a slice"},
+    {__LINE__, .src = "{% set x = 1 + 2 %}{{x}}{% set x = x * 2 %}{{x}}{% set s = harr[1:] %}{{s}}{{s[0]}}", .exp = "36[2, 3]2"},
+    {__LINE__, .src = "{% set x = 1 %}{% for i, v in harr %}{% set x = x + v %}{{x}}{% set x = x * 10 %}{{x}} {% endfor %}{{x}}", .exp = "220 330 440 1"},
+    {__LINE__, .src = "{% set x = 'a' %}{% if 1 %}{% set x = 'b' %}{{x}}{% else %}{% set y = 0 %}{% endif %}{{x}}{% for i in [0] %}{% set v = [harr, x] %}{% for j in [0] %}{{v}}{% endfor %}{% endfor %}", .exp = "ba[[1, 2, 3], a]"},
+    {__LINE__, .src = "{% set harr = 5 %}{{harr}}{% set hstr = hstr %}{{hstr}}{% set r = range(2) %}{% for i, v in r %}{{v}}{% endfor %}", .exp = "5hello01"},
+    {__LINE__, .src = "{% if 1 %}{% set y = 1 %}{% endif %}{{y}}", .err = "Undefined variable [y]"},
+    {__LINE__, .src = "{% set x = nope %}", .err = "Undefined variable [nope]"},
+    {__LINE__, .src = "{% set %}", .err = "Set statement ended unexpectedly"},
+    {__LINE__, .src = "{% set 1 = 2 %}", .err = "Missing variable name after [set] keyword"},
+    {__LINE__, .src = "{% set for = 2 %}", .err = "Unexpected keyword [for] where a variable name was expected"},
+    {__LINE__, .src = "{% set x 2 %}", .err = "Missing [=] after variable name"},
+    {__LINE__, .src = "{{harr | sum}} {{hints | sum}} {{hscores | sum}} {{[1.5, 2, 3] | sum}} {{[] | sum}} {{[1, 2, 3, 4, 5] | sum * 2}} {{1 + hints | sum}}", .exp = "6 9 4.500000 6.500000 0 30 10"},
+    {__LINE__, .src = "{{harr | min}}{{harr | max}} {{hints | max}} {{hscores | min}} {{[2.5, 1] | min}} {{['b', 'a', 'c'] | max}} {{[3, 1, 2, 0, 5] | min}}", .exp = "13 5 0.500000 1 c 0"},
+    {__LINE__, .src = "{{harr | length}}{{hstr | length}}{{hmap | length}}{{harr[1:] | length}} {{harr | first}}{{harr | last}}{{[[1], [2]] | last}} {{first(harr, 1)}}", .exp = "3542 13[2] [1, 2, 3]"},
+    {__LINE__, .src = "{{harr | join}} {{hscores | join(', ')}} {{[1, 'a', [2, 3]] | join(' ')}} {% for i, v in [[1, 2], []] %}({{v | join('-')}}){% endfor %}", .exp = "123 0.500000, 1.500000, 2.500000 1 a [2, 3] (1-2)()"},
+    {__LINE__, .src = "{% for i, v in harr %}{{harr[i:] | sum}}{{[v, i] | add}}{% endfor %}{{harr | add}}", .err = "Arguments must be integers [add]"},
+    {__LINE__, .src = "{{[] | min}}", .err = "Empty array [min]"},
+    {__LINE__, .src = "{{3 | sum}}", .err = "Expected an array [sum]"},
+    {__LINE__, .src = "{{[1, 'a'] | sum}}", .err = "Items must be numbers [sum]"},
+    {__LINE__, .src = "{{harr | length(1)}}", .err = "Expected no arguments [length]"},
+    {__LINE__, .src = "{{[harr | join]}}", .err = "Can only be printed [join]"},
+    {__LINE__, .src = "{{harr | join(1)}}", .err = "Separator must be a string [join]"},
+    {__LINE__, .src = "{{harr | nope}}", .err = "Undefined function [nope]"},
+    {__LINE__, .src = "{{harr | }}", .err = "Expected a filter name after [|]"},
+    {__LINE__, .src = "{{3.14159 | fmt('.2f')}}|{{1234567 | fmt(',')}}|{{1234567.891 | fmt(',.2f')}}|{{0.256 | fmt('.1%')}}|{{2 | fmt('.3f')}}|{{1.5 | fmt}}|{{0.125 | fmt('.2f')}}", .exp = "3.14|1,234,567|1,234,567.89|25.6%|2.000|1.500000|0.12"},
+    {__LINE__, .src = "{{0.5 | fmt('.0f')}}|{{1.5 | fmt('.0f')}}|{{1234567.125 | fmt(',.2f')}}|{% set m = 0 - 0.125 %}{{m | fmt('.2f')}}", .exp = "0|2|1,234,567.12|-0.12"},
+    {__LINE__, .src = "{% for i, v in hfloats %}{{v | fmt('.1f')}} {{v | fmt('.2f')}} {{v | fmt('.0f')}}|{% endfor %}", .exp = "1.4 1.45 1|0.3 0.28 0|2.7 2.67 3|0.1 0.12 0|0.5 0.50 0|2.5 2.50 2|"},
+    {__LINE__, .src = "{% for i, v in hscores %}{{v | fmt('.0f')}}{% endfor %}", .exp = "022"},
+    {__LINE__, .src = "{% set m = 0 - 42 %}{{42 | fmt('5')}}|{{42 | fmt('<5')}}|{{42 | fmt('*^6')}}|{{m | fmt('06')}}|{{42 | fmt('+')}}|{{m | fmt('<+5')}}|{{hstr | fmt('>7')}}|{{hstr | fmt('.2')}}", .exp = "   42|42   |**42**|-00042|+42|-42  |  hello|he"},
+    {__LINE__, .src = "{% for i, v in hscores %}[{{v | fmt('>6.1f')}}]{% endfor %}{{harr | sum | fmt('03')}}", .exp = "[   0.5][   1.5][   2.5]006"},
+    {__LINE__, .src = "{{1 | fmt('q')}}", .err = "Invalid format [q]"},
+    {__LINE__, .src = "{{1 | fmt(hstr)}}", .err = "Expected a format string literal after [fmt]"},
+    {__LINE__, .src = "{{1.5 | fmt('d')}}", .err = "Expected an integer [fmt]"},
+    {__LINE__, .src = "{{harr | fmt}}", .err = "Expected a number or a string [fmt]"},
+    {__LINE__, .src = "{% if 1 | fmt %}{% endif %}", .err = "Can only be printed [fmt]"},
+    {__LINE__, .src = "{{'<a href=\"x?y=1&z=2\">' | escape}}|{{\"it's\" | escape}}|{{'<b>' | safe}}|{{'<b>'}}|{{['<', 1] | escape}}", .exp = "&lt;a href=&quot;x?y=1&amp;z=2&quot;&gt;|it&#39;s|<b>|<b>|[&lt;, 1]"},
+    {__LINE__, .src = "{{'0123456789abcdef0123<>&\"' | escape}}|{{['a', '<'] | join('&') | escape}}|{{'<' | fmt('>3') | escape}}|{{2.5 | escape}}", .exp = "0123456789abcdef0123&lt;&gt;&amp;&quot;|a&amp;&lt;|  &lt;|2.500000"},
+    {__LINE__, .src = "{{'a b&c=d/\xc3\xa9' | urlencode}}|{{user.esc | urlencode}}|{{'A-z.0_9~' | urlencode}}|{{42 | urlencode}}", .exp = "a%20b%26c%3Dd%2F%C3%A9|q%22%C3%A9%F0%9F%98%80%0A|A-z.0_9~|42"},
+    {__LINE__, .src = "{% if 'a' | escape %}{% endif %}", .err = "Can only be printed [escape]"},
+    {__LINE__, .src = "{{1 | escape | safe}}", .err = "Can only be printed [escape]"},
+    {__LINE__, .src = "{{'<' | urlencode + 'x'}}", .err = "Can only be printed [urlencode]"},
+    {__LINE__, .src = "{{hstr | safe(1)}}", .err = "Filter [safe] takes no arguments"},
+    {__LINE__, .src = "<p>{{'<a & b>'}}</p>{{\"it's\"}}{{hmap.tags}}", .exp = "<p>&lt;a &amp; b&gt;</p>it&#39;s[1, 2, 3]", .escape = XT_ESCAPE_HTML},
+    {__LINE__, .src = "{{'<b>' | safe}}|{{'a b' | urlencode}}|{{'<' | escape}}|{{['<', 1]}}|{{'<' | fmt('>3')}}|{{['a', '<'] | join('&')}}", .exp = "<b>|a%20b|&lt;|[&lt;, 1]|  &lt;|a&amp;&lt;", .escape = XT_ESCAPE_HTML},
+    {__LINE__, .src = "?q={{user.esc}}&n={{42}}&s={{'<b>' | safe}}&h={{'<b>' | escape}}", .exp = "?q=q%22%C3%A9%F0%9F%98%80%0A&n=42&s=<b>&h=&lt;b&gt;", .escape = XT_ESCAPE_URL},
+    {__LINE__, .src = "{% for k, v in ['<', '&'] %}{{v}}{% endfor %}{% set x = '\"' %}{{x}}", .exp = "&lt;&amp;&quot;", .escape = XT_ESCAPE_HTML, .flags = XT_MINIFY},
+    {__LINE__, .src = "<ul>\n  {%- for i, v in harr %}\n  <li>{{- v -}} </li>\n  {%- endfor %}\n</ul>", .exp = "<ul>\n  <li>1</li>\n  <li>2</li>\n  <li>3</li>\n</ul>"},
+    {__LINE__, .src = "a  {%- if 1 -%}  \n b \n {%- else -%} c {%- endif -%}\n\t d{{ 'x' -}}   {{- 'y' }} {{-1-}} {{- hstr | fmt('>6') -}} !", .exp = "abdxy1 hello!"},
+    {__LINE__, .src = "{% set x = 5 -%}\n{{x}} {%- for i in [1] -%} , {% endfor -%} .", .exp = "5, ."},
+    {__LINE__, .src = "{{- -}}", .err = "Expression ended where a primary expression was expected"},
+    {__LINE__, .src = "<p>\n    {% for i, v in harr %}\n        <b>  {{v}}  </b>\n    {% endfor %}\n</p>  x \t y", .exp = "<p>\n\n<b> 1 </b>\n\n<b> 2 </b>\n\n<b> 3 </b>\n\n</p> x y", .flags = XT_MINIFY},
+    {__LINE__, .src = "  {{'a  b'}}  {%- if 0 %}{{x}}{% endif %}", .exp = " a  b", .flags = XT_MINIFY},
+    {__LINE__, .src = "\n\n  {{x}}", .err = "Undefined variable [x]", .flags = XT_MINIFY},
+    {__LINE__, .src = "{% for i, v in ['a', 'b', 'a', 'b'] %}{% cache v %}{{v}}{{i}} {% endcache %}{% endfor %}", .exp = "a0 b1 a0 b1 ", .cache = 4096},
+    {__LINE__, .src = "{% for i, v in ['a', 'b', 'a', 'b'] %}{% cache v %}{{v}}{{i}} {% endcache %}{% endfor %}", .exp = "a0 b1 a2 b3 "},
+    {__LINE__, .src = "{% for i, v in ['a', 'b', 'a'] %}{% cache v %}{{v}}{{i}} {% endcache %}{% endfor %}", .exp = "a0 b1 a2 ", .cache = 100},
+    {__LINE__, .src = "{% for k, i in [1, 2, 3] %}<{% cache 'out' %}{{i}}{% for j in [0, 1] %}{% cache i > 1 %}({{i}}{{j}}){% endcache %}{% endfor %}{% endcache %}>{% endfor %}", .exp = "<1(10)(10)><1(10)(10)><1(10)(10)>", .cache = 4096},
+    {__LINE__, .src = "{% for k, i in [1, 2, 3] %}{% cache i > 1 %}{% if i == 1 %}one{% else %}{{i}}{% endif %}{% endcache %} {% endfor %}{% cache 0 %}x{% endcache %}", .exp = "one 2 2 x", .cache = 4096},
+    {__LINE__, .src = "{% cache 1 %}{% set x = 2 %}{{x}}{% endcache %}{{x}}", .err = "Undefined variable [x]", .cache = 4096},
+    {__LINE__, .src = "{% cache nope %}a{% endcache %}", .err = "Undefined variable [nope]", .cache = 4096},
+    {__LINE__, .src = "{% for k, v in [hmap, 1] %}{% cache k %}<{{v.name}}>{% endcache %}{% endfor %}", .err = "Not a map, can't access field [name]", .cache = 4096},
+    {__LINE__, .src = "{% for i, k in [1, '1', 1.0] %}{% cache k %}{{i}}{% endcache %}{% endfor %}", .exp = "012", .cache = 4096},
+    {__LINE__, .src = "{% for i, k in [['a, b'], ['a', 'b'], ['a', 'b']] %}{% cache k %}{{i}}{% endcache %}{% endfor %}", .exp = "011", .cache = 4096},
+    {__LINE__, .src = "{% for i in [0, 1] %}{% cache range(2) %}{{tick(i)}}{% endcache %}{% endfor %}", .exp = "12", .cache = 4096},
+    {__LINE__, .src = "{% cache 1 %}a{% endfor %}", .err = "{% endfor %} has no matching {% for .. %}"},
+    {__LINE__, .src = "{% if 1 %}{% endcache %}", .err = "{% endcache %} has no matching {% cache .. %}"},
+    {__LINE__, .src = "{% for k, i in [1, 2] %}{% cache 1 %}{{i}}", .exp = "11", .cache = 4096},
+    {__LINE__, .src = "{% cache 1 %}{{user.esc}}{% endcache %}", .exp = "q&quot;\xc3\xa9\xf0\x9f\x98\x80\n", .cache = 4096, .again = ESCAPE},
+    {__LINE__, .src = "{% cache 1 %}{{tick()}}{% endcache %}", .exp = "1", .cache = 4096, .again = TWICE},
+    {__LINE__, .src = "{{tick()}}", .exp = "1", .cache = 4096, .memo = true, .again = TWICE},
+    {__LINE__, .src = "{{tick()}}", .exp = "2", .cache = 4096, .memo = true, .again = INVALIDATE},
+    {__LINE__, .src = "{{tick()}}", .exp = "2", .cache = 1, .memo = true, .again = TWICE},
+    {__LINE__, .src = "{{tick()}} {{step}}", .exp = "2 1", .cache = 4096, .memo = true, .again = TWICE},
+    {__LINE__, .src = "{{tick()}} {% if 0 %}{{step}}{% endif %}", .exp = "2 ", .cache = 4096, .memo = true, .again = TWICE},
+    {__LINE__, .src = "{{hmap}} {{tick()}} {{hstr}} {{harr[0] + add(lazy, 1)}} {{user.name}}", .exp = "{tags: [1, 2, 3], age: 42, name: Bob, inner: {x: 1}} 1 hello 9 Ann", .cache = 4096, .memo = true, .again = TWICE},
+    {__LINE__, .src = "{% cache 1 %}{{tick()}}{% endcache %}", .exp = "2", .cache = 4096, .memo = true, .again = INVALIDATE},
+    {__LINE__, .src = "{{tick()}}{{nope}}", .err = "Undefined variable [nope]", .cache = 4096, .memo = true, .again = TWICE},
+    {__LINE__, .src = "{{user.esc}}", .exp = "q&quot;\xc3\xa9\xf0\x9f\x98\x80\n", .cache = 4096, .memo = true, .again = ESCAPE},
+    {__LINE__, .src = "{{tick()}}", .exp = "0", .cache = 4096, .memo = true, .again = BIND},
+    {__LINE__, .src = "{{tick()}}", .exp = "0", .cache = 4096, .memo = true, .again = BIND, .bind = "tick"},
+    {__LINE__, .src = "{{later()}} {% for k, v in [1, 2] %}{{later(v)}}{% endfor %}", .exp = "1 23", .bind = "later"},
+    {__LINE__, .src = "{{add(1, 2)}} {{add}}", .exp = "1 function", .bind = "add"},
+    {__LINE__, .src = "{{later}}", .err = "Nothing to bind", .bind = "later"},
+    {__LINE__, .src = "{{1 + 2 * 3}} {{k + 1}} {{[1, k]}} {{k == 0}} {{hstr}} {{k + hints[0]}}", .exp = "7 1 [1, 0] 1 hello 4", .specialize = true},
+    {__LINE__, .src = "{% if k %}{{10 / k}}{% endif %}done", .exp = "done", .specialize = true},
+    {__LINE__, .src = "a\n{{10 / k}}", .err = "Division by zero", .specialize = true},
+    {__LINE__, .src = "{% set a = 0 - 9223372036854775807 - 1 %}{% set b = 0 - 1 %}{{a / b}}", .err = "Overflow"},
+    {__LINE__, .src = "{% set a = 0 - 9223372036854775807 - 1 %}{% set b = k - 1 %}{{a / b}}", .err = "Overflow", .specialize = true},
+    {__LINE__, .src = "a{% if k %}x{% for i in [1] %}y{% endfor %}{% else %}b{% if k + 1 %}c{% else %}d{% endif %}{% endif %}e{% for j, v in kmap.tags %}{{v}}{% endfor %}", .exp = "abce123", .specialize = true},
+    {__LINE__, .src = "{{kmap.name}} {{kmap.inner.x}} {% if kmap.age > 40 %}old{% endif %}{{kmap.nope}}", .err = "Undefined field [nope]", .specialize = true},
+    {__LINE__, .src = "{{kmap.name}} {{kmap.inner.x}} {% if kmap.age > 40 %}old{% endif %}", .exp = "Bob 1 old", .specialize = true},
+    {__LINE__, .src = "{{k}}{% set k = 5 %}{{k}}{% for i, v in [1] %}{% set k = v %}{{k}}{% endfor %}{{k}}", .exp = "0515", .specialize = true},
+    {__LINE__, .src = "a{{'b'}}c{{k}}d{% if 1 %}e{% endif %}f{% for i in [1, 2] %}g{{i}}{% endfor %}", .exp = "abc0defg0g1", .specialize = true},
+    {__LINE__, .src = "{{kname}}|{{kname | safe}}|{{kname | urlencode}}|{{[kname, k]}}", .exp = "&lt;Ann&gt;|<Ann>|%3CAnn%3E|[&lt;Ann&gt;, 0]", .escape = XT_ESCAPE_HTML, .specialize = true},
+    {__LINE__, .src = "{{k}}{% if k %}a{% else %}b{% endif %}{{hstr}}{% set x = k %}{{x}}", .exp = "0bhello0", .flags = XT_SEGMENTS, .specialize = true},
+    {__LINE__, .src = "  {{ k }}   x  {% if k %} y {% else %} z {% endif %}  ", .exp = " 0 x  z  ", .flags = XT_MINIFY, .specialize = true},
+    {__LINE__, .src = "{% cache k %}{{kname}}{% endcache %}{% cache k %}{{kname}}{% endcache %}", .exp = "<Ann><Ann>", .cache = 4096, .specialize = true},
+    {__LINE__, .src = "{{1 | later}}", .exp = "1", .bind = "later"},
+    {__LINE__, .src = "a{{tick()}}b{% if 1 %}{{step}}{% endif %}{% for i in [1, 2] %}{{i}}{% endfor %}{% set x = 3 %}{{x}}", .exp = "a1b0013", .flags = XT_SEGMENTS},
+    {__LINE__, .src = "{{tick()}} {{step}} {{tick()}}", .exp = "1 1 2", .flags = XT_SEGMENTS, .changed = "step"},
+    {__LINE__, .src = "{{tick()}} {{step}} {{tick()}}", .exp = "3 0 4", .flags = XT_SEGMENTS, .changed = "tick"},
+    {__LINE__, .src = "{{tick()}} {{step}} {{tick()}}", .exp = "1 0 2", .flags = XT_SEGMENTS, .changed = "nope"},
+    {__LINE__, .src = "{{tick()}} {{step}} {{tick()}}", .exp = "3 1 4", .changed = "nope"},
+    {__LINE__, .src = "{% for k, i in [1, 2] %}{{tick()}}{% if step %}{{i}}{% endif %}{% endfor %}|{{tick()}}", .exp = "3132|2", .flags = XT_SEGMENTS, .changed = "step"},
+    {__LINE__, .src = "{% set x = 2 %}{{x}} {{step + x}} {% set y = step %}{{y}}{{tick()}}", .exp = "2 3 12", .flags = XT_SEGMENTS, .changed = "step"},
+    {__LINE__, .src = "{{tick()}}{% cache 1 %}{{step}}{% endcache %}{{tick()}}", .exp = "102", .flags = XT_SEGMENTS, .cache = 4096, .changed = "step"},
+    {__LINE__, .src = "{{tick()}} {{step}}{% if step %}{{nope}}{% endif %}", .err = "Undefined variable [nope]", .flags = XT_SEGMENTS, .changed = "step"},
+    {__LINE__, .src = "", .exp = "[]", .rope = true},
+    {__LINE__, .src = "Some text that is long enough to be referred to. {{hstr}}{{1}}, {{hmap.name}}! {% for k, v in harr %}{{v}} and more text that's referred to{% endfor %}.", .exp = "[Some text that is long enough to be referred to. hello1, Bob! 1 and more text that's referred to2 and more text that's referred to3 and more text that's referred to.]", .rope = true},
+    {__LINE__, .src = "{% for i in range(1000) %}0123456789{% endfor %}", .exp = "[" TIMES_10(TIMES_10(TIMES_10("0123456789"))) "]", .rope = true},
+    {__LINE__, .src = "Minified   text\n\n is   copied {{ 1 }}", .exp = "[Minified text\nis copied 1]", .flags = XT_MINIFY, .rope = true},
+    {__LINE__, .src = "{% cache 1 %}cached text that is long enough to be referred to{% endcache %}", .exp = "[cached text that is long enough to be referred to]", .cache = 4096, .rope = true},
+    {__LINE__, .src = "Text before the error {{nope}}", .err = "Undefined variable [nope]", .rope = true},
+    {__LINE__, .src = "{{add()}} {{add(1)}} {{add(1, 2, 3)}} {{add ( hmap.age , 1 )}} {{add(add(1, 2), 3) * 2}}", .exp = "0 1 6 43 12"},
+    {__LINE__, .src = "{% for i, v in harr %}{{add(v, 10)}}{{first([v], i)}}{{add(1, 1)}} {% endfor %}{{first([[1], 2])}}{{first(hstr)}}", .exp = "11[1]2 12[2]2 13[3]2 [[1], 2]hello"},
+    {__LINE__, .src = "{% for i, v in first(harr, 1) %}{{v}}{% endfor %}{% for i, v in first([4, 5]) %}{{v}}{% endfor %}{{add}}", .exp = "12345function"},
+    {__LINE__, .src = "{{add(1, 'x')}}", .err = "Arguments must be integers [add]"},
+    {__LINE__, .src = "{{first()}}", .err = "Call failed [first]"},
+    {__LINE__, .src = "{{nope(1)}}", .err = "Undefined function [nope]"},
+    {__LINE__, .src = "{{hstr(1)}}", .err = "Not a function [hstr]"},
+    {__LINE__, .src = "{{add(1, x)}}", .err = "Undefined variable [x]"},
+    {__LINE__, .src = "{{add(1, 2, 3, 4, 5, 6, 7, 8, 9)}}", .err = "Too many arguments (the maximum is 8)"},
+    {__LINE__, .src = "{{add(1 2)}}", .err = "Unexpected character [2] inside of an argument list"},
+    {__LINE__, .src = "{{add(1,}}", .err = "Expression ended where a primary expression was expected"},
+    {__LINE__, .src = "{{add(1}}", .err = "Expression ended inside of an argument list"},
+    {__LINE__, .src = "{% for i, v in range(3) %}{{v}}{% endfor %}|{% for i, v in range(2, 5) %}{{v}}{% endfor %}|{% for i, v in range(5, 0, 0-2) %}{{i}}{{v}} {% endfor %}{% for x in range(3, 3) %}x{% endfor %}", .exp = "012|234|05 13 21 "},
+    {__LINE__, .src = "{% for i in range(2) %}{% for j, v in range(3) %}{{v}}{% endfor %}{% endfor %}{% for i, v in first(range(2)) %}{{v}}{% endfor %}{{range(1)}}", .exp = "01201201iterator"},
+    {__LINE__, .src = "{% for i, v in range(9223372036854775806, 9223372036854775807, 5) %}{{v}}{% endfor %}{% for i in range(100000) %}{% endfor %}", .exp = "9223372036854775806"},
+    {__LINE__, .src = "{{range()}}", .err = "Expected 1 to 3 arguments [range]"},
+    {__LINE__, .src = "{{range(1, 'a')}}", .err = "Arguments must be integers [range]"},
+    {__LINE__, .src = "{% for i in range(1, 2, 0) %}{% endfor %}", .err = "Step can't be 0 [range]"},
+    {__LINE__, .src = "{{lazy}}{% for i, v in range(3) %}{{lazy + v}}{% endfor %}{{lazyfn(lazy, 2)}}{{harr}}", .exp = "77899[1, 2, 3]"},
+    {__LINE__, .src = "{% if 0 %}{{lazyx}}{% endif %}{{lazyx}}", .err = "Undefined variable [lazyx]"},
+    {__LINE__, .src = "{{user.name}} {{user.age + 1}} {{user.tags}} {{user['admin']}} {{nums}} {% for i, v in nums %}{{v*2}}{% endfor %} {{floats}} {{mixed}} {{empty}} {{dup}}", .exp = "Ann 32 [a, b] 1 [1, 2, -3] 24-6 [0.500000, 100.000000] [1, 2.500000, x, 0, 0, {k: []}] {} 2"},
+    {__LINE__, .src = "{{user.esc}}{{user.name}}{{user.nope}}", .err = "Undefined field [nope]"},
+    {__LINE__, .src = "{% if 0 %}{{nope}}{% endif %}{{user.esc}}", .exp = "q\"\xc3\xa9\xf0\x9f\x98\x80\n"},
+    {__LINE__, .src = "{{hscores}}{% for i, v in hscores %}{{v*2}} {% endfor %}{{[hscores, 1]}}", .exp = "[0.500000, 1.500000, 2.500000]1.000000 3.000000 5.000000 [[0.500000, 1.500000, 2.500000], 1]"},
+    {__LINE__, .src = "{{[1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18]}}", .exp = "[1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18]"},
+    {__LINE__, .src = "{% for i in [0, 0] %}{% for j, v in [[i], harr] %}{{v}}{% endfor %}{% endfor %}", .exp = "[0][1, 2, 3][1][1, 2, 3]"},
 
     {
         __LINE__, 
@@ -278,22 +753,27 @@ struct {
                 "010101010101"
     },
 
-    {__LINE__, "{%%}",    NULL, "block {% .. %} doesn't start with a keyword"},
-    {__LINE__, "{% %}",   NULL, "block {% .. %} doesn't start with a keyword"},
-    {__LINE__, "{%@%}",   NULL, "block {% .. %} doesn't start with a keyword"},
-    {__LINE__, "{% @ %}", NULL, "block {% .. %} doesn't start with a keyword"},
+    {__LINE__, .src = "{%%}",    .err = "block {% .. %} doesn't start with a keyword"},
+    {__LINE__, .src = "{% %}",   .err = "block {% .. %} doesn't start with a keyword"},
+    {__LINE__, .src = "{%@%}",   .err = "block {% .. %} doesn't start with a keyword"},
+    {__LINE__, .src = "{% @ %}", .err = "block {% .. %} doesn't start with a keyword"},
    
     {__LINE__, 
         .src = "{% if %}{% if %}{% if %}{% if %}"
                "{% if %}{% if %}{% if %}{% if %}"
                "{% if %}{% if %}{% if %}{% if %}", 
-        .err = "Too many nested {% if .. %} and {% for .. %} blocks"},
+        .err = "Too many nested {% if .. %}, {% for .. %} and {% cache .. %} blocks"},
    
     {__LINE__, 
         .src = "{% for %}{% for %}{% for %}{% for %}"
                "{% for %}{% for %}{% for %}{% for %}"
                "{% for %}{% for %}{% for %}{% for %}", 
-        .err = "Too many nested {% if .. %} and {% for .. %} blocks"},
+        .err = "Too many nested {% if .. %}, {% for .. %} and {% cache .. %} blocks"},
+   
+    {__LINE__, 
+        .src = "{% cache 1 %}{% cache 1 %}{% cache 1 %}{% cache 1 %}"
+               "{% cache 1 %}{% cache 1 %}{% cache 1 %}{% cache 1 %}{% if 1 %}", 
+        .err = "Too many nested {% if .. %}, {% for .. %} and {% cache .. %} blocks"},
    
     {__LINE__, .src = "{% else %}", .err = "{% else %} has no matching {% if .. %}"},
     {__LINE__, .src = "{% endif %}", .err = "{% endif %} has no matching {% if .. %}"},
@@ -316,12 +796,132 @@ struct {
     {__LINE__, .src = "{% if 0 %}{% else %}{% else %}", .err = "Can't have multiple {% else %} blocks relative to only one {% if .. %}"},
 };
 
-int main()
+/* Rows rendered by [render] with no option other than
+ * [escape] are also checked against the C code that
+ * xt_emit_c generates for them. Running the test as
+ * "./test --emit-c" prints a file with the function 
+ * of each row, which is then built into the test with
+ * TEST_EMITTED defined (see build.sh).
+ */
+typedef bool emitted_fn(const char *str, long len, Variables *vars, 
+                        xt_callback callback, void *userp, XT_Error *err);
+
+static void write_to_stdout(const char *str, long len, void *userp)
+{
+    (void) userp;
+    fwrite(str, 1, len, stdout);
+}
+
+/* Prints the functions generated for the plain rows
+ * that compile, followed by the table of them.
+ */
+static int emit_rows(void)
+{
+    long rows = sizeof(tcases)/sizeof(tcases[0]);
+    bool *emitted = malloc(rows);
+    if(emitted == NULL)
+        return 1;
+    for(int i = 0; i < rows; i += 1) {
+        emitted[i] = false;
+        if(!is_plain(&tcases[i]))
+            continue;
+
+        XT_Error err;
+        XT_Template *tmpl = xt_compile_flags(tcases[i].src, -1, 0, &err);
+        if(tmpl == NULL)
+            continue;
+        if(tcases[i].escape != XT_ESCAPE_NONE)
+            xt_set_escape(tmpl, tcases[i].escape);
+
+        char name[32];
+        snprintf(name, sizeof(name), "row_%d", i);
+        emitted[i] = xt_emit_c(tmpl, name, write_to_stdout, NULL, &err);
+        xt_free(tmpl);
+        if(!emitted[i]) {
+            fprintf(stderr, "Couldn't emit the row at line %ld: %s\n", tcases[i].line, err.message);
+            free(emitted);
+            return 1;
+        }
+        fprintf(stdout, "\n");
+    }
+
+    fprintf(stdout, "static const struct { int row; emitted_fn *func; } emitted_rows[] = {\n");
+    for(int i = 0; i < rows; i += 1)
+        if(emitted[i])
+            fprintf(stdout, "    { %d, row_%d },\n", i, i);
+    fprintf(stdout, "};\n");
+    free(emitted);
+    return 0;
+}
+
+#ifdef TEST_EMITTED
+#include "test_emitted.c"
+
+/* Renders the row with the interpreter and with its
+ * generated function, which must produce the same bytes
+ * and fail with the same error at the same location.
+ */
+static bool check_emitted(int row, emitted_fn *func, XT_Error *err)
+{
+    buff_t exp = {0}, res = {0};
+    XT_Error exp_err;
+    bool same = false;
+
+    XT_Json *json = xt_json_open(json_doc, -1, NULL);
+    if(json == NULL) {
+        report(err, -1, "Out of memory");
+        return false;
+    }
+    XT_Template *tmpl = xt_compile_flags(tcases[row].src, -1, 0, err);
+    if(tmpl != NULL) {
+        lazy_vars.parent = xt_json_scope(json);
+        if(tcases[row].escape != XT_ESCAPE_NONE)
+            xt_set_escape(tmpl, tcases[row].escape);
+
+        tick_count = 0;
+        render_step = 0;
+        xt_render_to_cb(tmpl, &vars, callback, &exp, &exp_err);
+        tick_count = 0;
+        func(tcases[row].src, -1, &vars, callback, &res, err);
+
+        if(exp.failed || res.failed)
+            report(err, -1, "Out of memory");
+        else if(exp.used != res.used || (exp.used > 0 && memcmp(exp.data, res.data, exp.used)))
+            report(err, -1, "The generated code renders differently");
+        else if(exp_err.occurred != err->occurred || strcmp(exp_err.message, err->message) 
+             || exp_err.row != err->row || exp_err.col != err->col) {
+            char message[XT_ERRMSG_MAX];
+            snprintf(message, sizeof(message), "%s", err->occurred ? err->message : "no error");
+            report(err, -1, "The generated code fails differently (%s)", message);
+        } else
+            same = true;
+    }
+    free(exp.data);
+    free(res.data);
+    xt_free(tmpl);
+    xt_json_close(json);
+    return same;
+}
+#endif
+
+int main(int argc, char **argv)
 {
     long total = 0;
     long passed = 0;
     long tcases_num = sizeof(tcases)/sizeof(tcases[0]);
 
+    xt_array_view(&host_scores, &host_rows[0].score, 3, AT_FLOAT, sizeof(host_rows[0]));
+
+    xt_map_view(&host_map, host_map_table, 8);
+    xt_map_put(&host_map, "name", -1, xt_string("Bob", -1));
+    xt_map_put(&host_map, "age",  -1, (Value) { VK_INT, .as_int = 42 });
+    xt_map_put(&host_map, "tags", -1, (Value) { VK_ARRAY, .as_array = &host_array });
+    xt_map_put(&host_map, "inner", -1, xt_map_view(&host_inner, host_inner_table, 2));
+    xt_map_put(&host_inner, "x", -1, (Value) { VK_INT, .as_int = 1 });
+
+    if(argc > 1 && !strcmp(argv[1], "--emit-c"))
+        return emit_rows();
+
     realloc_behaviour = NORMAL;
 
     for(int i = 0; i < tcases_num; i += 1) {
@@ -338,7 +938,7 @@ int main()
         free_count = 0;
 
         XT_Error err;
-        char *res = xt_render_str_to_str(src, -1, NULL, NULL, &err);
+        char *res = render(&tcases[i], &err);
 
         long expected_free_count = alloc_count;
         if(res != NULL) expected_free_count -= 1;
@@ -422,20 +1022,47 @@ int main()
         }
     }
 
+#ifdef TEST_EMITTED
+    for(unsigned int i = 0; i < sizeof(emitted_rows)/sizeof(emitted_rows[0]); i += 1) {
+
+        total += 1;
+        int row = emitted_rows[i].row;
+#ifdef PRINT_TEST_LINES
+        fprintf(stderr, "(Line: %ld, generated) ", tcases[row].line);
+#endif
+        alloc_count = 0;
+        free_count = 0;
+
+        XT_Error err;
+        bool same = check_emitted(row, emitted_rows[i].func, &err);
+
+        if(free_count != alloc_count)
+            fprintf(stderr, "Test %ld: Failed\n"
+                            "\t%ld memory leaks detected\n", 
+                    total, alloc_count - free_count);
+        else if(!same)
+            fprintf(stderr, "Test %ld: Failed\n"
+                            "\tTemplate:\n"
+                            "\t\t%s\n"
+                            "\t%s\n", total, tcases[row].src, err.message);
+        else {
+            fprintf(stderr, "Test %ld: Passed\n", total);
+            passed += 1;
+        }
+    }
+#endif
+
     /* Now trace all of the allocation lines */
 
     realloc_behaviour = TRACE_ALLOC_LINES;
     traced_lines_count = 0;
 
     for(int i = 0; i < tcases_num; i += 1) {
-        
-        const char *src = tcases[i].src;
-
         alloc_count = 0;
         free_count = 0;
 
         XT_Error err;
-        char *res = xt_render_str_to_str(src, -1, NULL, NULL, &err);
+        char *res = render(&tcases[i], &err);
 
         if(res != NULL)
             free(res);
@@ -451,7 +1078,6 @@ int main()
         for(int i = 0; i < tcases_num; i += 1) {
             
             total += 1;
-            const char *src = tcases[i].src;
             const char *exp_err = tcases[i].err;
 
 #ifdef PRINT_TEST_LINES
@@ -461,7 +1087,7 @@ int main()
             free_count = 0;
 
             XT_Error err;
-            char *res = xt_render_str_to_str(src, -1, NULL, NULL, &err);
+            char *res = render(&tcases[i], &err);
 
 
             long expected_free_count = alloc_count;
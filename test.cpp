@@ -0,0 +1,131 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include "xtmpl.hpp"
+
+/* Tests of the C++ interface. Each template is rendered
+ * through xt::tmpl and through xt_render_str_to_str,
+ * which must give the same output, or fail with the
+ * same error at the same row and column.
+ *
+ * Malformed templates can't be instantiated at all, so
+ * they're checked with [valid] at compile time.
+ */
+
+template<xt::fixed_string Src>
+concept valid = requires {
+    typename std::integral_constant<std::size_t, xt::detail::slice_up(Src.view(), nullptr)>;
+};
+
+static_assert(valid<"Hello, {{name}}!">);
+static_assert(valid<"{% if 1 %}{% for i in [1] %}{% endfor %}{% else %}{% endif %}">);
+static_assert(!valid<"{% if 1 %}{% endfor %}">);
+static_assert(!valid<"{% else %}">);
+static_assert(!valid<"{% endcache %}">);
+static_assert(!valid<"{% x %}">);
+static_assert(!valid<"{% for 1 in x %}{% endfor %}">);
+static_assert(!valid<"{% if %}{% if %}{% if %}{% if %}{% if %}{% if %}{% if %}{% if %}{% if %}">);
+
+static Value host_items[] = {
+    { VK_INT, 0, { .as_int = 1 } },
+    { VK_INT, 0, { .as_int = 2 } },
+    { VK_INT, 0, { .as_int = 3 } },
+};
+static ArrayValue host_array;
+static Variable var_list[] = {
+    { "n",    1, { VK_INT, 0, { .as_int = 7 } } },
+    { "name", 4, { VK_STRING, 3, { .as_str = "Ann" } } },
+    { "harr", 4, { VK_INT, 0, { .as_int = 0 } } }, // Set by [main]
+    { nullptr, 0, { VK_INT, 0, { .as_int = 0 } } },
+};
+// Resolves [z], counting the calls
+static int resolve_count = 0;
+static Value resolve_z(const char *name, long len, void *userp)
+{
+    (void) userp;
+    if(len == 1 && name[0] == 'z') {
+        resolve_count += 1;
+        return Value { VK_INT, 0, { .as_int = 5 } };
+    }
+    return Value { VK_ERROR, 0, { .as_str = nullptr } };
+}
+static Variables lazy_vars = { nullptr, nullptr, resolve_z, nullptr };
+static Variables vars = { &lazy_vars, var_list, nullptr, nullptr };
+
+static long total = 0;
+static long passed = 0;
+
+/* With [once], the name [z] must also be resolved a
+ * single time by the render through xt::tmpl.
+ */
+template<class T>
+static void check(int line, bool once = false)
+{
+    total += 1;
+    fprintf(stderr, "(Line: %d) ", line);
+
+    std::string out;
+    XT_Error err;
+    resolve_count = 0;
+    bool ok = T::render(&vars, [&](std::string_view s) { out += s; }, err);
+    int resolves = resolve_count;
+
+    XT_Error exp_err;
+    char *exp = xt_render_str_to_str(T::source.data(), T::source.size(), &vars, nullptr, &exp_err);
+
+    if(once && resolves != 1) {
+        fprintf(stderr,
+            "Test %ld: Failed\n"
+            "\tTemplate:\n"
+            "\t\t%s\n"
+            "\tresolved [z] %d times\n", total, T::source.data(), resolves);
+    } else if(exp != nullptr && ok && out == exp) {
+        fprintf(stderr, "Test %ld: Passed\n", total);
+        passed += 1;
+    } else if(exp == nullptr && !ok && !strcmp(err.message, exp_err.message)
+                               && err.row == exp_err.row && err.col == exp_err.col) {
+        fprintf(stderr, "Test %ld: Passed\n", total);
+        passed += 1;
+    } else {
+        fprintf(stderr,
+            "Test %ld: Failed\n"
+            "\tTemplate:\n"
+            "\t\t%s\n"
+            "\tRendered by xt::tmpl:\n"
+            "\t\t%s (%s at %ld:%ld)\n"
+            "\tRendered by the C library:\n"
+            "\t\t%s (%s at %ld:%ld)\n", total, T::source.data(),
+            ok ? out.c_str() : "", ok ? "no error" : err.message, err.row, err.col,
+            exp ? exp : "", exp ? "no error" : exp_err.message, exp_err.row, exp_err.col);
+    }
+    free(exp);
+}
+
+int main()
+{
+    host_array.count = 3;
+    host_array.capacity = 3;
+    host_array.items = host_items;
+    var_list[2].value = Value { VK_ARRAY, 0, { .as_array = &host_array } };
+
+    check<xt::tmpl<"">>(__LINE__);
+    check<xt::tmpl<"Hello, {{name}}!">>(__LINE__);
+    check<xt::tmpl<"{{n + 1}} {{n / 2}} {{n * 0.5}} {{[n, name]}} {{'x'}}">>(__LINE__);
+    check<xt::tmpl<"{% if n > 5 %}big{% else %}small{% endif %}{% if 0 %}x{% endif %}">>(__LINE__);
+    check<xt::tmpl<"{% for i, v in harr %}{{i}}:{{v}} {% endfor %}{% for i, v in [] %}x{% endfor %}">>(__LINE__);
+    check<xt::tmpl<"{% for i, v in [1, 2.5] %}{% for j, w in harr %}{% if j %}{{v * w}}{% endif %}{% endfor %}\n{% endfor %}">>(__LINE__);
+    check<xt::tmpl<"{% set x = n %}{{x}}{% if 1 %}{% set x = 2 %}{{x}}{% endif %}{{x}}">>(__LINE__);
+    check<xt::tmpl<"{% cache name %}{{name}}{% endcache %}|{{n}}">>(__LINE__);
+    check<xt::tmpl<"{{harr | join(', ')}} {{name | upper}}">>(__LINE__);
+    check<xt::tmpl<"ok\n  {{nope}}">>(__LINE__);
+    check<xt::tmpl<"{{1 + []}}">>(__LINE__);
+    check<xt::tmpl<"{% if n %}\n{% for i, v in n %}{% endfor %}{% endif %}">>(__LINE__);
+    check<xt::tmpl<"a\n{{n +}}">>(__LINE__);
+    check<xt::tmpl<"{{z}}{% for i, v in harr %}{{z + v}}{% if z %}{{[z] | join}}{% endif %}{% endfor %}{% set y = z %}{{y}}">>(__LINE__, true);
+
+    fprintf(stdout, "\nTotal: %ld, Passed: %ld, Failed: %ld\n",
+            total, passed, total-passed);
+    return 0;
+}
@@ -1,12 +1,19 @@
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <ctype.h>
 #include <stdio.h>
-#include "xtmpl.h"
+#include <time.h>
+#include "xtmpl_rt.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /*                      OVERVIEW
  * The templates this engine is able to evaluate are
@@ -21,27 +28,29 @@
  *
  *   {% for <var>, <var> in <expr> %} {% endfor %}
  *
+ *   {% set <var> = <expr> %}
+ *
  *   {{<expr>}}
  *
  * where <expr> represents any expression and 
  * <var> represents a variable name.
  *
- * This templating engine has no concept of precompiling
- * templates before their evaluation, therefore it
- * tries to have the lowest possible start-up time.
- * This is done by evaluating things very lazily so
- * that only the strinctily necessary things are 
- * computed. 
+ * Templates are compiled once into a flat program
+ * which can then be rendered any number of times.
+ * The compilation is a single pass over the source,
+ * so rendering a template string directly (compiling
+ * and throwing the program away) still has a low
+ * start-up time.
  *
- * The source is mainly divided in 3 portions:
+ * The source is mainly divided in 4 portions:
  *   1. A "Slicer"
- *   2. Expression Evaluator
- *   3. Rendering Routine
+ *   2. A "Compiler"
+ *   3. Expression Evaluator
+ *   4. An "Interpreter"
  *
  * The "Slicer" is implemented by the [slice_up] routine.
  * Here the template string is scanned and the offsets
- * of each block are extracted from it. This is the only
- * preparation phase before the rendering. The output of
+ * of each block are extracted from it. The output of
  * the Slicer is an array of slices (an offset-length pair). 
  * Each slice can have one of the following kinds:
  */
@@ -50,9 +59,12 @@ typedef enum {
     SK_EXPR,
     SK_IF,
     SK_FOR,
+    SK_SET,
+    SK_CACHE,
     SK_ELSE,
     SK_ENDIF,
     SK_ENDFOR,
+    SK_ENDCACHE,
     SK_END,
 } SliceKind;
 /* SK_TEXT slice refers to basic text that can be
@@ -67,32 +79,39 @@ typedef enum {
  * the substring that comes after the keyword until 
  * the ending %}.
  *
+ * A block opened by "{%-" or "{{-" trims the whitespace
+ * at the end of the text slice before it, and one 
+ * closed by "-%}" or "-}}" the whitespace at the start
+ * of the one after it. The markers aren't part of the
+ * slices.
+ *
  * While slicing up the template, checks to ensure
  * the validity of the blocks structure are done, like
  * ensured that each {% if .. %} has an {% endif %} 
  * and optionally an {% else %}, each {% for .. %}
  * has an {% endfor %} etc.
  *
- * Once the slice array is computed, the "Rendering
- * Routine" implemented by [render] can be called 
- * on it to start the rendering.
- * 
- * The [render] routine basically loops over the 
- * slices and renders to the ouput any text or 
- * expression print blocks, evaluates the expressions 
- * inside {% if .. %} and {% for .. %} blocks and 
- * jumps around based on their result, always 
- * rendering to the output.
+ * Once the slice array is computed, the "Compiler"
+ * implemented by [compile] turns it into a flat
+ * instruction stream. Text slices become OP_TEXT,
+ * expressions are parsed into trees of [Expr] nodes
+ * and {% if .. %} and {% for .. %} blocks become
+ * conditional jumps and loop instructions whose
+ * targets are resolved at compile time.
  *
- * Whenever the rendering routine needs to evaluate 
- * an expression, it calls the "Expression Evaluator" 
- * implemented by [eval].
+ * The "Interpreter" implemented by [run] executes
+ * the instruction stream. It's a direct-threaded
+ * loop (computed goto where the compiler supports
+ * it, a switch otherwise) so that each opcode gets
+ * its own indirect branch.
  *
- * The [eval] function parses and evaluates expressions
- * on the fly, returning the result to the caller.
+ * Whenever the interpreter needs the value of an
+ * expression, it calls the "Expression Evaluator" 
+ * implemented by [eval], which walks the nodes
+ * built by the compiler.
  *
- * When all of the slices are traversed, the rendering
- * is complete.
+ * When the OP_HALT instruction is reached, the
+ * rendering is complete.
  */
 
 typedef struct {
@@ -106,44 +125,311 @@ typedef struct {
     Slice list[];
 } Slices;
 
-typedef struct {
-    XT_Error    *err;
-    
-    const char  *str;
-    long         len;
-
-    long   slice_idx;
-    Slices   *slices;
-    Variables  *vars;
-    void      *userp;
-    xt_callback callback;
-} RenderContext;
+#define MAX_DEPTH  8
+#define MAX_ARGS   8 // Arguments are passed in an array on the stack
+#define MAX_LOCALS 32 // Variables of {% set .. %} visible at once
 
-#define MAX_DEPTH 8
+// Values are copied around a lot by the evaluator,
+// so they should stay as small as two words.
+_Static_assert(sizeof(Value) <= 16, "Value should fit in 16 bytes");
 
 typedef enum {
     OID_ADD,
     OID_SUB,
     OID_MUL,
     OID_DIV,
+    OID_EQL,
+    OID_NQL,
+    OID_LSS,
+    OID_LEQ,
+    OID_GRT,
+    OID_GEQ,
+    OID_AND,
+    OID_OR,
 } OperatID;
 
+/* Expressions are compiled to trees of [Expr] nodes 
+ * stored in a single array of the template. Nodes
+ * refer to each other by index. The items of an 
+ * array literal are chained through [next].
+ *
+ * Field accesses (a.b and a["b"]) have their name
+ * hashed at compile time (EK_FIELD), only subscripts
+ * with a computed key are hashed when evaluated
+ * (EK_INDEX). EK_INDEX also indexes arrays, and 
+ * EK_SLICE (a[i:j]) takes a range of an array. The
+ * bounds of a slice are -1 when omitted.
+ *
+ * Calls (f(a, b)) only take a name, never the value 
+ * of an expression, and their arguments are chained
+ * through [next] like the items of an array. The 
+ * function can be bound to the node after compiling
+ * (see [xt_bind]), otherwise it's looked up in the 
+ * variable scopes when the call is evaluated.
+ *
+ * A filter ([a | f(b)]) is a call with the filtered
+ * value as first argument, except for [fmt] (EK_FMT),
+ * whose format string is parsed into a spec when
+ * compiling. It and [join] write their result to the
+ * output, so they can only be the whole expression of
+ * a {{ .. }} block. The same goes for [escape], 
+ * [urlencode] and [safe] (EK_ESCAPE), which choose how
+ * the printed value is escaped, overriding the mode
+ * of the template (see [xt_set_escape]).
+ *
+ * The right operand of [and] and [or] (EK_BINARY) is
+ * only evaluated when the left one doesn't decide the
+ * result. Both evaluate to the last operand evaluated,
+ * like in Python, while [not] (EK_NOT) evaluates to 0
+ * or 1.
+ *
+ * Identifiers that name an iteration variable of an
+ * enclosing {% for .. %} or a variable of a previous
+ * {% set .. %} of an enclosing block are resolved at
+ * compile time to a slot (EK_LOCAL), every other 
+ * identifier is looked up in the variable scopes when
+ * evaluated (EK_VAR). Slots below 2*MAX_DEPTH hold
+ * the iteration variables, the others hold the
+ * variables of {% set .. %}.
+ *
+ * The [level] of a node is the number of enclosing
+ * loops its value depends on, that is one more than
+ * the nesting level of the innermost loop whose slots
+ * it reads, or 0 when it reads none. Variables of
+ * {% set .. %} count as slots of the innermost loop
+ * around the assignment. A node evaluated inside more
+ * loops than its level is invariant with respect to
+ * the inner ones, so the compiler gives it a [cache]
+ * slot and the value is computed once per entry of
+ * loop number [level] (see [eval]).
+ */
+typedef enum {
+    EK_INT,
+    EK_FLOAT,
+    EK_STRING,
+    EK_ARRAY,
+    EK_VAR,
+    EK_LOCAL,
+    EK_BINARY,
+    EK_NOT,
+    EK_FMT,
+    EK_ESCAPE,
+    EK_FIELD,
+    EK_INDEX,
+    EK_SLICE,
+    EK_CALL,
+} ExprKind;
+
+typedef struct {
+    ExprKind kind;
+    long     off; // Offset in the source, used for error reporting.
+    int     next;
+    int    level;
+    int    cache; // Cache slot, or -1 if the node isn't cached.
+    union {
+        long long as_int;
+        double    as_float;
+        struct { int head, count; } array;
+        struct { long len; } var; // The name starts at [off]
+        struct { int  len; } str; // The quoted text starts at [off+1]
+        int slot;
+        struct { OperatID op; int lhs, rhs; } binary;
+        int operand; // EK_NOT
+        struct { int obj; XT_FmtSpec spec; } fmt; // The name starts at [off]
+        struct { int obj; XT_Escape mode; int len; } escape; // The name starts at [off]
+        struct { int obj, len; unsigned int hash; } field; // The name starts at [off]
+        struct { int obj, key; } index;
+        struct { int obj, start, stop; } slice;
+        struct { int head, count, len; bool filter; FuncValue func; } call; // The name starts at [off]
+    };
+} Expr;
+
+typedef enum {
+    OP_TEXT,
+    OP_PRINT,
+    OP_BRANCH,
+    OP_JUMP,
+    OP_FOR,
+    OP_NEXT,
+    OP_SET,
+    OP_CACHE,
+    OP_ENDCACHE,
+    OP_SEGMENT,
+    OP_HALT,
+} Opcode;
+/* OP_TEXT copies [off, len] of the source to the output.
+ *
+ * OP_PRINT evaluates [expr] and prints it.
+ *
+ * OP_BRANCH evaluates [expr] and jumps to [target] if
+ * it evaluated to something false (see [is_truthy]),
+ * OP_JUMP jumps to [target] unconditionally.
+ *
+ * OP_FOR evaluates the collection [expr] and starts
+ * the loop at nesting level [depth], or jumps to 
+ * [target] if the collection is empty. OP_NEXT moves
+ * the loop at level [depth] to the next item and 
+ * jumps back to [target] (the first instruction of 
+ * the body), or falls through when there are no 
+ * items left.
+ *
+ * OP_SET evaluates [expr] and stores the value in 
+ * slot [depth].
+ *
+ * OP_CACHE evaluates the key [expr] of the {% cache %}
+ * block number [depth] and looks up the output of the
+ * block in the cache of the template. If it's there,
+ * it's written and the body is skipped by jumping to
+ * [target], after the OP_ENDCACHE of the block. If it
+ * isn't, the output of the body is captured until the
+ * OP_ENDCACHE, which stores it.
+ *
+ * OP_SEGMENT starts segment number [depth], which ends
+ * at [target]. Templates compiled with XT_SEGMENTS have
+ * one before each top-level block (see [xt_rerender]),
+ * other templates have none.
+ */
+
+typedef struct {
+    Opcode op;
+    int  expr;
+    int depth;
+    long target;
+    long off, len;
+} Instr;
+
+/* The variables read by a segment are the nodes in
+ * [reads, reads + read_count) of the [seg_reads] of
+ * the template.
+ */
+typedef struct {
+    int reads, read_count;
+    bool sets; // Whether it has {% set .. %} blocks
+} Segment;
+
+struct XT_Template {
+    Instr *code;
+    long   code_count,
+           code_max_count;
+
+    Expr *nodes;
+    int   node_count,
+          node_max_count;
+    int   cache_count;
+    int   local_count; // Slots used by {% set .. %}
+
+    XT_Escape escape; // Mode of the {{ .. }} blocks
+
+    XT_Cache *frags; // Output of the {% cache %} blocks
+    XT_Cache *renders; // Output of whole renders
+    unsigned long id; // Identifies the template in [frags] and [renders]
+
+    int *reads; // Nodes naming the variables read by the template
+    int  read_count;
+
+    Segment *segs; // Only with XT_SEGMENTS
+    int     *seg_reads;
+    int      seg_count;
+
+    long len;
+    long pool_len; // Bytes of text after the null byte of [src]
+    char src[]; // Copy of the source, null terminated.
+};
+
+typedef struct {
+    Value coll;
+    long   idx;
+    long entry; // Stamp of the entry that started the loop
+} LoopFrame;
+
+typedef struct {
+    long stamp; // Loop entry the value was computed for
+    Value  val;
+} CacheSlot;
+
+/* Values returned by the resolvers of the scopes during 
+ * a render. Undefined names are remembered too, with a
+ * value of kind VK_ERROR. The [name] refers to the 
+ * source of the template.
+ */
+typedef struct {
+    Variables  *scope;
+    const char *name;
+    long         len;
+    Value      value;
+} Resolved;
+
+typedef struct {
+    Resolved *list;
+    int      count,
+         max_count;
+} ResolveMemo;
+
+/* A memo shared by several renders or evaluations */
+struct XT_Resolved {
+    ResolveMemo memo;
+};
+
+/* Output of a {% cache %} block being rendered. It's
+ * passed to the callback that was active when the block
+ * started and appended to [data], after the key.
+ */
+typedef struct {
+    xt_callback callback;
+    void       *userp;
+    bool failed; // Out of memory, so nothing is stored
+    long keylen;
+    char  *data;
+    long   used,
+           size;
+} Capture;
+
+typedef struct {
+    XT_Error    *err;
+    XT_Template *tmpl;
+    Variables   *vars;
+    void       *userp;
+    xt_callback callback;
+    ResolveMemo *memo; // Of this render, or shared with others
+
+    int   capture_count;
+    Capture captures[MAX_DEPTH];
+
+    Capture   *segments; // Output of each segment, if it's captured
+    const bool *dirty; // Segments to render, or NULL for all of them
+
+    int       depth; // Number of active loops in [frames]
+    LoopFrame frames[MAX_DEPTH];
+    Value     slots[2 * MAX_DEPTH + MAX_LOCALS];
+
+    long     entries; // Number of loop entries so far
+    CacheSlot *cache;
+} RenderContext;
+
+typedef struct {
+    const char *name;
+    long         len;
+    int         slot;
+    int        level; // Level of the nodes reading the slot
+} Binding;
+
 typedef struct {
     XT_Error *err;
+    XT_Template *tmpl;
     const char *str;
-    long   prev_i, i, len;
-    Variables *vars;
-} EvalContext;
+    long   i, len;
+
+    int   binding_count;
+    Binding bindings[2 * MAX_DEPTH + MAX_LOCALS];
+    int   local_count; // Slots of {% set .. %} in use
+} CompileContext;
 
 /* Reports an error by filling the fields of XT_Error. */
-static void report(XT_Error *err, long off, 
-                   const char *fmt, ...)
+static void report_va(XT_Error *err, long off, 
+                      const char *fmt, va_list va)
 {
     if(err) {
-        va_list va;
-        va_start(va, fmt);
         int p = vsnprintf(err->message, sizeof(err->message), fmt, va);
-        va_end(va);
         assert(p >= 0);
         
         err->off = off;
@@ -161,119 +447,854 @@ static void report(XT_Error *err, long off,
     }
 }
 
+static void report(XT_Error *err, long off, 
+                   const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    report_va(err, off, fmt, va);
+    va_end(va);
+}
+
+/* Returns item [idx] of [array]. Items of packed 
+ * arrays are boxed on the fly, items of the others 
+ * are returned as they are: the array still owns 
+ * them.
+ */
+static inline Value array_get(const ArrayValue *array, long idx)
+{
+    if(array->stride == 0)
+        switch(array->type) {
+            case AT_INT  : return (Value) { VK_INT,   .as_int   = array->ints[idx]   };
+            case AT_FLOAT: return (Value) { VK_FLOAT, .as_float = array->floats[idx] };
+            case AT_VALUE: return array->items[idx];
+        }
+
+    // Elements of a view may not be aligned
+    const char *elem = (const char*) array->items + idx * array->stride;
+    Value item = {0};
+    switch(array->type) {
+        case AT_INT  : item.kind = VK_INT;   memcpy(&item.as_int,   elem, sizeof(long long)); break;
+        case AT_FLOAT: item.kind = VK_FLOAT; memcpy(&item.as_float, elem, sizeof(double));    break;
+        case AT_VALUE: memcpy(&item, elem, sizeof(Value)); break;
+    }
+    return item;
+}
+
+static size_t array_type_size(ArrayType type)
+{
+    switch(type) {
+        case AT_INT  : return sizeof(long long);
+        case AT_FLOAT: return sizeof(double);
+        default:break;
+    }
+    return sizeof(Value);
+}
+
+/* Looks up variable [name] in the innermost scope 
+ * defining it and returns its value through [out], or
+ * returns false if no scope does. When a resolver 
+ * fails, the value is its VK_ERROR result. When [memo]
+ * isn't NULL, the results of resolvers are memoized 
+ * in it.
+ */
+static bool find_var(Variables *vars, const char *name, long len, Value *out, ResolveMemo *memo)
+{
+    for(; vars != NULL; vars = vars->parent) {
+
+        if(vars->list)
+            for(long j = 0; vars->list[j].len > 0; j += 1)
+                if(vars->list[j].len == len && !strncmp(vars->list[j].name, name, len)) {
+                    *out = vars->list[j].value;
+                    return 1;
+                }
+
+        if(vars->resolve == NULL)
+            continue;
+
+        Resolved *found = NULL;
+        if(memo)
+            for(int k = 0; found == NULL && k < memo->count; k += 1) {
+                Resolved *r = &memo->list[k];
+                if(r->scope == vars && r->len == len && !strncmp(r->name, name, len))
+                    found = r;
+            }
+
+        Value val;
+        if(found)
+            val = found->value;
+        else {
+            val = vars->resolve(name, len, vars->userp);
+
+            // The memo is only an optimization, so if it 
+            // can't grow the name is resolved again later.
+            // Failures aren't remembered either.
+            if(val.kind == VK_ERROR && val.as_str)
+                memo = NULL;
+            if(memo && memo->count == memo->max_count) {
+                int new_max_count = memo->max_count ? 2 * memo->max_count : 8;
+                void *temp = realloc(memo->list, new_max_count * sizeof(Resolved));
+                if(temp) {
+                    memo->list = temp;
+                    memo->max_count = new_max_count;
+                }
+            }
+            if(memo && memo->count < memo->max_count)
+                memo->list[memo->count++] = (Resolved) { vars, name, len, val };
+        }
+
+        if(val.kind != VK_ERROR || val.as_str) {
+            *out = val;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Values are owned by whoever evaluated them, but
+ * owning an array only means holding a reference to
+ * it. [value_retain] gets a new reference and 
+ * [value_free] drops one, freeing the array when it
+ * was the last. Both do nothing on borrowed arrays.
+ */
+static Value value_retain(Value val)
+{
+    if(val.kind == VK_ARRAY && val.as_array->refs > 0)
+        val.as_array->refs += 1;
+    if(val.kind == VK_MAP && val.as_map->refs > 0)
+        val.as_map->refs += 1;
+    if(val.kind == VK_ITER && val.as_iter->refs > 0)
+        val.as_iter->refs += 1;
+    return val;
+}
+
 static void value_free(Value *val)
 {
     switch(val->kind) {
         default:break;
-        case VK_ARRAY: free(val->as_array.items); break;
+        case VK_ARRAY:
+        {
+            ArrayValue *array = val->as_array;
+            if(array->refs > 0 && --array->refs == 0) {
+                if(array->base) {
+                    // The items belong to the base
+                    Value base = { VK_ARRAY, .as_array = array->base };
+                    value_free(&base);
+                } else if(array->type == AT_VALUE)
+                    for(int i = 0; i < array->count; i += 1)
+                        value_free(&array->items[i]);
+                free(array);
+            }
+            break;
+        }
+        case VK_MAP:
+        {
+            // Owned maps store their entries right after
+            // the header, like arrays.
+            MapValue *map = val->as_map;
+            if(map->refs > 0 && --map->refs == 0) {
+                for(int i = 0; i < map->capacity; i += 1)
+                    if(map->entries[i].key)
+                        value_free(&map->entries[i].value);
+                free(map);
+            }
+            break;
+        }
+        case VK_ITER:
+        {
+            IterValue *iter = val->as_iter;
+            if(iter->refs > 0 && --iter->refs == 0 && iter->close)
+                iter->close(iter);
+            break;
+        }
     }
 }
 
-static void value_print(Value val, xt_callback callback, void *userp)
+/* Whether [a] and [b] refer to the same array, map or
+ * iterator.
+ */
+static bool same_object(Value a, Value b)
+{
+    if(a.kind != b.kind)
+        return 0;
+    switch(a.kind) {
+        case VK_ARRAY: return a.as_array == b.as_array;
+        case VK_MAP  : return a.as_map   == b.as_map;
+        case VK_ITER : return a.as_iter  == b.as_iter;
+        default:break;
+    }
+    return 0;
+}
+
+/* Tells whether [val] counts as true in a condition. 
+ * Zero and empty strings, arrays and maps are false, 
+ * everything else is true.
+ */
+static bool is_truthy(Value val)
+{
+    switch(val.kind) {
+        case VK_ERROR : return 0;
+        case VK_INT   : return val.as_int != 0;
+        case VK_FLOAT : return val.as_float != 0;
+        case VK_STRING: return val.str_len > 0;
+        case VK_ARRAY : return val.as_array->count > 0;
+        case VK_MAP   : return val.as_map->count > 0;
+        case VK_FUNC  : 
+        case VK_ITER  : return 1;
+    }
+    return 0;
+}
+
+/* Output goes through a buffer, so that printing an
+ * array or a map calls the callback once per chunk 
+ * instead of once per item and separator. Writes that
+ * don't fit in the buffer are passed through. When
+ * [escape] is set, the bytes written through [emit]
+ * are escaped.
+ */
+typedef struct {
+    xt_callback callback;
+    void *userp;
+    XT_Escape escape;
+    int   used;
+    char  buf[512];
+} Emitter;
+
+static void emit_init(Emitter *e, xt_callback callback, void *userp, XT_Escape escape)
+{
+    e->callback = callback;
+    e->userp = userp;
+    e->escape = escape;
+    e->used = 0;
+}
+
+static void emit_flush(Emitter *e)
+{
+    if(e->used > 0)
+        e->callback(e->buf, e->used, e->userp);
+    e->used = 0;
+}
+
+static void emit_raw(Emitter *e, const char *str, long len)
+{
+    if(len > (long) sizeof(e->buf) - e->used) {
+        emit_flush(e);
+        if(len >= (long) sizeof(e->buf)) {
+            e->callback(str, len, e->userp);
+            return;
+        }
+    }
+    memcpy(e->buf + e->used, str, len);
+    e->used += len;
+}
+
+/* Bytes that must be escaped in HTML */
+static const bool html_special[256] = {
+    ['&'] = 1, ['<'] = 1, ['>'] = 1, ['"'] = 1, ['\''] = 1,
+};
+
+/* Tells whether [c] can be left as it is in a URL. The
+ * test doesn't depend on the locale, unlike [isalnum].
+ */
+static bool url_safe(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+        || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/* Returns the offset of the first byte of [str] that must
+ * be escaped in HTML, or [len] if there's none. With SSE2
+ * the bytes are compared 16 at a time, so the clean runs
+ * that make up most text are skipped quickly.
+ */
+static long html_scan(const char *str, long len)
+{
+    long i = 0;
+#if defined(__SSE2__)
+    const __m128i amp  = _mm_set1_epi8('&');
+    const __m128i lt   = _mm_set1_epi8('<');
+    const __m128i gt   = _mm_set1_epi8('>');
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i apos = _mm_set1_epi8('\'');
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (str + i));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+                    _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, quot)),
+                                 _mm_cmpeq_epi8(v, apos)));
+        int mask = _mm_movemask_epi8(m);
+        if(mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    while(i < len && !html_special[(unsigned char) str[i]])
+        i += 1;
+    return i;
+}
+
+static void emit(Emitter *e, const char *str, long len)
+{
+    if(e->escape == XT_ESCAPE_NONE) {
+        emit_raw(e, str, len);
+        return;
+    }
+
+    // Clean runs are copied as they are, the bytes 
+    // after them are replaced.
+    while(len > 0) {
+
+        long n;
+        if(e->escape == XT_ESCAPE_HTML)
+            n = html_scan(str, len);
+        else {
+            n = 0;
+            while(n < len && url_safe(str[n]))
+                n += 1;
+        }
+        emit_raw(e, str, n);
+        if(n == len)
+            break;
+
+        unsigned char c = str[n];
+        if(e->escape == XT_ESCAPE_HTML) {
+            switch(c) {
+                case '&' : emit_raw(e, "&amp;",  5); break;
+                case '<' : emit_raw(e, "&lt;",   4); break;
+                case '>' : emit_raw(e, "&gt;",   4); break;
+                case '"' : emit_raw(e, "&quot;", 6); break;
+                case '\'': emit_raw(e, "&#39;",  5); break;
+            }
+        } else {
+            static const char hex[] = "0123456789ABCDEF";
+            char code[3] = { '%', hex[c >> 4], hex[c & 15] };
+            emit_raw(e, code, 3);
+        }
+        str += n + 1;
+        len -= n + 1;
+    }
+}
+
+static void emit_value(Emitter *e, Value val)
 {
     switch(val.kind) {
 
         case VK_ERROR:
-        callback("error", 5, userp);
+        emit(e, "error", 5);
         break;
 
         case VK_INT:
+        case VK_FLOAT:
         {
-            char buf[32];
-            long len = snprintf(buf, sizeof(buf), 
-                                "%lld", val.as_int);
+            // Numbers are formatted in place. Their bytes
+            // never need escaping.
+            if(sizeof(e->buf) - e->used < 32)
+                emit_flush(e);
+            char *dst = e->buf + e->used;
+            long len;
+            if(val.kind == VK_INT)
+                len = snprintf(dst, 32, "%lld", val.as_int);
+            else
+                len = snprintf(dst, 32, "%lf", val.as_float);
             assert(len >= 0);
-            callback(buf, len, userp);
+            if(len < 32)
+                e->used += len;
+            else {
+                // Huge floats don't fit
+                char big[512];
+                len = snprintf(big, sizeof(big), "%lf", val.as_float);
+                emit(e, big, len);
+            }
             break;
         }
 
-        case VK_FLOAT:
+        case VK_STRING:
+        emit(e, val.as_str, val.str_len);
+        break;
+
+        case VK_FUNC:
+        emit(e, "function", 8);
+        break;
+
+        case VK_ITER:
+        emit(e, "iterator", 8);
+        break;
+
+        case VK_MAP:
         {
-            char buf[32];
-            long len = snprintf(buf, sizeof(buf), 
-                               "%lf", val.as_float);
-            assert(len >= 0);
-            callback(buf, len, userp);
+            const MapValue *map = val.as_map;
+            bool first = true;
+            emit(e, "{", 1);
+            for(int i = 0; i < map->capacity; i += 1) {
+                const MapEntry *entry = &map->entries[i];
+                if(entry->key == NULL)
+                    continue;
+                if(!first)
+                    emit(e, ", ", 2);
+                emit(e, entry->key, entry->key_len);
+                emit(e, ": ", 2);
+                emit_value(e, entry->value);
+                first = false;
+            }
+            emit(e, "}", 1);
             break;
         }
 
         case VK_ARRAY:
         {
-            callback("[", 1, userp);
-            for(int i = 0; i < val.as_array.count; i += 1) {
-
-                value_print(val.as_array.items[i], callback, userp);
-                if(i+1 < val.as_array.count)
-                    callback(", ", 2, userp);
+            const ArrayValue *array = val.as_array;
+            emit(e, "[", 1);
+            for(int i = 0; i < array->count; i += 1) {
+                emit_value(e, array_get(array, i));
+                if(i+1 < array->count)
+                    emit(e, ", ", 2);
             }
-            callback("]", 1, userp);
+            emit(e, "]", 1);
             break;
         }
     }
 }
 
-static Value array_new() {
-    Value array;
-    array.kind = VK_ARRAY;
-    array.as_array.capacity = 0;
-    array.as_array.count = 0;
-    array.as_array.items = NULL;
-    return array;
+static void value_print(Value val, xt_callback callback, void *userp)
+{
+    // Strings are already one chunk
+    if(val.kind == VK_STRING) {
+        callback(val.as_str, val.str_len, userp);
+        return;
+    }
+
+    Emitter e;
+    emit_init(&e, callback, userp, XT_ESCAPE_NONE);
+    emit_value(&e, val);
+    emit_flush(&e);
 }
 
-static bool array_append(Value *array, Value item, const char **err)
+/* FNV-1a */
+static unsigned int hash_key(const char *key, long len)
 {
-    if(array->kind == VK_ERROR || 
-         item.kind == VK_ERROR)
+    unsigned int hash = 2166136261u;
+    for(long i = 0; i < len; i += 1) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Returns the entry of [map] with the given key, or
+ * the free slot where it would be inserted. Tables 
+ * always have at least one free slot.
+ */
+static MapEntry *map_slot(const MapValue *map, const char *key, long len, unsigned int hash)
+{
+    unsigned int mask = map->capacity - 1;
+    for(unsigned int i = hash & mask; ; i = (i + 1) & mask) {
+        MapEntry *entry = &map->entries[i];
+        if(entry->key == NULL || (entry->hash == hash && entry->key_len == len && !memcmp(entry->key, key, len)))
+            return entry;
+    }
+}
+
+/* Returns through [out] the value of field [key] of 
+ * [obj]. The value is borrowed from the map.
+ */
+static bool map_lookup(Value obj, const char *key, long len, unsigned int hash, Value *out, const char **err)
+{
+    if(obj.kind != VK_MAP) {
+        *err = "Not a map, can't access field";
         return 0;
+    }
 
-    if(array->kind != VK_ARRAY) {
-        if(err) 
-            *err = "Can't append to something "
-                   "other than an array";
+    const MapValue *map = obj.as_map;
+    MapEntry *entry = (map->capacity > 0) ? map_slot(map, key, len, hash) : NULL;
+    if(entry == NULL || entry->key == NULL) {
+        *err = "Undefined field";
         return 0;
     }
+    *out = entry->value;
+    return 1;
+}
 
-    if(array->as_array.count == array->as_array.capacity) {
-        int capacity2;
-        if(array->as_array.capacity == 0)
-            capacity2 = 32;
-        else
-            capacity2 = 2 * array->as_array.capacity;
+/* Like [map_lookup], but the key is a value computed
+ * while rendering, so it's hashed now. Arrays are 
+ * indexed by integer keys instead. The value is 
+ * borrowed from the map or array.
+ */
+static bool index_value(Value obj, Value key, Value *out, const char **err)
+{
+    if(obj.kind == VK_ARRAY) {
 
-        void *addr = realloc(array->as_array.items, capacity2 * sizeof(Value));
-        if(addr == NULL) {
-            if(err)
-                *err = "Out of memory";
+        if(key.kind != VK_INT) {
+            *err = "Array indexes must be integers";
             return 0;
         }
-        array->as_array.capacity = capacity2;
-        array->as_array.items = addr;
+
+        if(key.as_int < 0 || key.as_int >= obj.as_array->count) {
+            *err = "Index out of bounds";
+            return 0;
+        }
+
+        *out = array_get(obj.as_array, key.as_int);
+        return 1;
+    }
+
+    if(obj.kind != VK_MAP) {
+        *err = "Can't index something other than a map or an array";
+        return 0;
+    }
+
+    if(key.kind != VK_STRING) {
+        *err = "Map keys must be strings";
+        return 0;
     }
 
-    array->as_array.items[array->as_array.count++] = item;
+    if(!map_lookup(obj, key.as_str, key.str_len, hash_key(key.as_str, key.str_len), out, err)) {
+        *err = "Undefined key";
+        return 0;
+    }
     return 1;
 }
 
-/* Evaluates a binary operation [operat] using as operands
- * [lhs] and [rhs]. If something went wrong then a value
- * with type [VK_ERROR] is returned and a description of 
- * the error is returned through [err].
- * If either one of [lhs] and [rhs] is of type [VK_ERROR]
- * then it's returned immediately and no error is reported
- * through [err].
+static Value array_new();
+
+/* Returns through [out] the items of array [obj] from
+ * index [start] up to [stop] excluded, clamping both 
+ * to the bounds of the array. The items aren't copied:
+ * the result refers to them in place and holds a 
+ * reference to the array that owns them, so a slice
+ * costs one header regardless of its length. The 
+ * result belongs to the caller.
  */
-static Value apply(OperatID operat, Value lhs, Value rhs, const char **err)
+static bool array_slice(Value obj, Value start, Value stop, Value *out, const char **err)
 {
-    if(lhs.kind == VK_ERROR) return lhs;
-    if(rhs.kind == VK_ERROR) return rhs;
+    if(obj.kind != VK_ARRAY) {
+        *err = "Can't slice something other than an array";
+        return 0;
+    }
 
-    #define PACK(X, Y, Z)                  \
-        (((unsigned long long) X) <<  0) | \
-        (((unsigned long long) Y) << 16) | \
-        (((unsigned long long) Z) << 32)
+    if(start.kind != VK_INT || stop.kind != VK_INT) {
+        *err = "Slice bounds must be integers";
+        return 0;
+    }
 
-    switch(PACK(operat, lhs.kind, rhs.kind)) {
+    ArrayValue *array = obj.as_array;
+    long long lo = start.as_int;
+    long long hi = stop.as_int;
+    if(lo < 0) lo = 0;
+    if(hi > array->count) hi = array->count;
+
+    if(lo >= hi) {
+        *out = array_new();
+        return 1;
+    }
+
+    if(lo == 0 && hi == array->count) {
+        *out = value_retain(obj);
+        return 1;
+    }
+
+    ArrayValue *slice = malloc(sizeof(ArrayValue));
+    if(slice == NULL) {
+        *err = "Out of memory";
+        return 0;
+    }
+
+    long size = array->stride ? array->stride : (long) array_type_size(array->type);
+
+    // Slices of slices refer to the original array
+    Value base = { VK_ARRAY, .as_array = array->base ? array->base : array };
+
+    *slice = *array;
+    slice->refs = 1;
+    slice->count = hi - lo;
+    slice->capacity = slice->count;
+    slice->items = (Value*) ((char*) array->items + lo * size);
+    slice->base = value_retain(base).as_array;
+
+    *out = (Value) { VK_ARRAY, .as_array = slice };
+    return 1;
+}
+
+/* Returns item [idx] of the collection of a loop. The
+ * items of iterators are produced in order, so [idx] 
+ * is only used for arrays.
+ */
+static inline bool coll_next(Value coll, long idx, Value *item)
+{
+    if(coll.kind == VK_ARRAY) {
+        if(idx >= coll.as_array->count)
+            return 0;
+        *item = array_get(coll.as_array, idx);
+        return 1;
+    }
+    assert(coll.kind == VK_ITER);
+    return coll.as_iter->next(coll.as_iter, item);
+}
+
+/* The iterator returned by [range(start, stop, step)]. 
+ * Only its bounds are stored, so the memory used by a
+ * loop over it doesn't depend on the number of items.
+ */
+typedef struct {
+    IterValue base;
+    long long cur, stop, step;
+} RangeIter;
+
+static bool range_next(IterValue *iter, Value *item)
+{
+    RangeIter *range = (RangeIter*) iter;
+    if(range->step > 0 ? range->cur >= range->stop : range->cur <= range->stop)
+        return 0;
+    *item = (Value) { VK_INT, .as_int = range->cur };
+
+    // Stop at the bound instead of overflowing
+    unsigned long long left, jump;
+    if(range->step > 0) {
+        left = (unsigned long long) range->stop - range->cur;
+        jump = range->step;
+    } else {
+        left = (unsigned long long) range->cur - range->stop;
+        jump = 0ull - (unsigned long long) range->step;
+    }
+    range->cur = (left <= jump) ? range->stop : range->cur + range->step;
+    return 1;
+}
+
+static void range_close(IterValue *iter)
+{
+    free(iter);
+}
+
+static bool builtin_range(Value *args, int argc, Value *out, const char **err)
+{
+    if(argc < 1 || argc > 3) {
+        *err = "Expected 1 to 3 arguments";
+        return 0;
+    }
+
+    for(int k = 0; k < argc; k += 1)
+        if(args[k].kind != VK_INT) {
+            *err = "Arguments must be integers";
+            return 0;
+        }
+
+    long long start = 0, stop, step = 1;
+    if(argc == 1)
+        stop = args[0].as_int;
+    else {
+        start = args[0].as_int;
+        stop  = args[1].as_int;
+        if(argc == 3)
+            step = args[2].as_int;
+    }
+
+    if(step == 0) {
+        *err = "Step can't be 0";
+        return 0;
+    }
+
+    RangeIter *range = malloc(sizeof(RangeIter));
+    if(range == NULL) {
+        *err = "Out of memory";
+        return 0;
+    }
+    range->base = (IterValue) { 1, range_next, range_close, NULL };
+    range->cur  = start;
+    range->stop = stop;
+    range->step = step;
+    *out = (Value) { VK_ITER, .as_iter = &range->base };
+    return 1;
+}
+
+/* Functions every template can call. Calls to them are
+ * bound when compiling.
+ */
+static const struct {
+    const char *name;
+    FuncValue   func;
+} builtins[] = {
+    { "range", builtin_range },
+};
+
+static FuncValue find_builtin(const char *name, long len)
+{
+    for(size_t k = 0; k < sizeof(builtins) / sizeof(builtins[0]); k += 1)
+        if((long) strlen(builtins[k].name) == len && !strncmp(builtins[k].name, name, len))
+            return builtins[k].func;
+    return NULL;
+}
+
+/* Every empty array is this one, so that building 
+ * an array doesn't allocate until the first item is
+ * appended.
+ */
+static ArrayValue empty_array;
+
+static Value array_new() {
+    return (Value) { VK_ARRAY, .as_array = &empty_array };
+}
+
+/* Appends [item] to [array], taking ownership of it.
+ * Arrays are only modified while they're built, so
+ * if [array] is shared or borrowed it's copied first.
+ * The items of an array built here are stored right
+ * after its header, in the same allocation.
+ *
+ * Arrays start out packed when the first item is a
+ * number, and are converted to arrays of [Value]s as
+ * soon as an item of a different kind is appended.
+ */
+static bool array_append(Value *array, Value item, const char **err)
+{
+    if(array->kind == VK_ERROR || 
+         item.kind == VK_ERROR)
+        return 0;
+
+    if(array->kind != VK_ARRAY) {
+        if(err) 
+            *err = "Can't append to something "
+                   "other than an array";
+        return 0;
+    }
+
+    ArrayValue *old = array->as_array;
+
+    ArrayType item_type = AT_VALUE;
+    if(item.kind == VK_INT)   item_type = AT_INT;
+    if(item.kind == VK_FLOAT) item_type = AT_FLOAT;
+
+    ArrayType type = old->type;
+    if(old->count == 0)
+        type = item_type;
+    else if(type != item_type)
+        type = AT_VALUE;
+
+    bool in_place = (old->refs == 1 && old->type == type && old->base == NULL);
+    if(!in_place || old->count == old->capacity) {
+
+        int capacity2;
+        if(old->count < 16)
+            capacity2 = 16;
+        else
+            capacity2 = 2 * old->count;
+
+        size_t size = sizeof(ArrayValue) + capacity2 * array_type_size(type);
+
+        ArrayValue *new;
+        if(in_place)
+            new = realloc(old, size);
+        else
+            new = malloc(size);
+        if(new == NULL) {
+            if(err)
+                *err = "Out of memory";
+            return 0;
+        }
+        new->capacity = capacity2;
+        new->items = (Value*) (new + 1);
+
+        if(!in_place) {
+            new->refs = 1;
+            new->type = type;
+            new->stride = 0;
+            new->base = NULL;
+            new->count = old->count;
+            for(int i = 0; i < old->count; i += 1) {
+                Value prev = array_get(old, i);
+                switch(type) {
+                    case AT_INT  : new->ints[i]   = prev.as_int;   break;
+                    case AT_FLOAT: new->floats[i] = prev.as_float; break;
+                    case AT_VALUE: new->items[i]  = value_retain(prev); break;
+                }
+            }
+            value_free(array);
+        }
+        array->as_array = new;
+    }
+
+    ArrayValue *arr = array->as_array;
+    switch(arr->type) {
+        case AT_INT  : arr->ints[arr->count++]   = item.as_int;   break;
+        case AT_FLOAT: arr->floats[arr->count++] = item.as_float; break;
+        case AT_VALUE: arr->items[arr->count++]  = item; break;
+    }
+    return 1;
+}
+
+/* Evaluates comparison [operat] between [lhs] and [rhs]
+ * to 0 or 1. Numbers compare by value and strings by
+ * their bytes. Values of other kinds can only be tested
+ * for equality, and are equal when they're the same
+ * object.
+ */
+static Value compare(OperatID operat, Value lhs, Value rhs, const char **err)
+{
+    bool lt, gt;
+    if(lhs.kind == VK_INT && rhs.kind == VK_INT) {
+        lt = lhs.as_int < rhs.as_int;
+        gt = lhs.as_int > rhs.as_int;
+    } else if((lhs.kind == VK_INT || lhs.kind == VK_FLOAT) && (rhs.kind == VK_INT || rhs.kind == VK_FLOAT)) {
+        double l = (lhs.kind == VK_INT) ? lhs.as_int : lhs.as_float;
+        double r = (rhs.kind == VK_INT) ? rhs.as_int : rhs.as_float;
+        if(l != l || r != r) {
+            // NaN is unordered and different from everything
+            return (Value) { VK_INT, .as_int = (operat == OID_NQL) };
+        }
+        lt = l < r;
+        gt = l > r;
+    } else if(lhs.kind == VK_STRING && rhs.kind == VK_STRING) {
+        int n = (lhs.str_len < rhs.str_len) ? lhs.str_len : rhs.str_len;
+        int c = memcmp(lhs.as_str, rhs.as_str, n);
+        if(c == 0)
+            c = (lhs.str_len > rhs.str_len) - (lhs.str_len < rhs.str_len);
+        lt = c < 0;
+        gt = c > 0;
+    } else if(operat == OID_EQL || operat == OID_NQL) {
+        bool eq = same_object(lhs, rhs) || (lhs.kind == VK_FUNC && rhs.kind == VK_FUNC && lhs.as_func == rhs.as_func);
+        return (Value) { VK_INT, .as_int = (eq == (operat == OID_EQL)) };
+    } else {
+        switch(operat) {
+            case OID_LSS: *err = "Bad \"<\" operand";  break;
+            case OID_LEQ: *err = "Bad \"<=\" operand"; break;
+            case OID_GRT: *err = "Bad \">\" operand";  break;
+            case OID_GEQ: *err = "Bad \">=\" operand"; break;
+            default:break;
+        }
+        return (Value) { VK_ERROR };
+    }
+
+    bool res = 0;
+    switch(operat) {
+        case OID_EQL: res = !lt && !gt; break;
+        case OID_NQL: res =  lt ||  gt; break;
+        case OID_LSS: res =  lt; break;
+        case OID_LEQ: res = !gt; break;
+        case OID_GRT: res =  gt; break;
+        case OID_GEQ: res = !lt; break;
+        default:break;
+    }
+    return (Value) { VK_INT, .as_int = res };
+}
+
+/* Evaluates a binary operation [operat] using as operands
+ * [lhs] and [rhs]. If something went wrong then a value
+ * with type [VK_ERROR] is returned and a description of 
+ * the error is returned through [err].
+ * If either one of [lhs] and [rhs] is of type [VK_ERROR]
+ * then it's returned immediately and no error is reported
+ * through [err].
+ */
+static Value apply(OperatID operat, Value lhs, Value rhs, const char **err)
+{
+    if(lhs.kind == VK_ERROR) return lhs;
+    if(rhs.kind == VK_ERROR) return rhs;
+
+    if(operat >= OID_EQL && operat <= OID_GEQ)
+        return compare(operat, lhs, rhs, err);
+
+    #define PACK(X, Y, Z)                  \
+        (((unsigned long long) X) <<  0) | \
+        (((unsigned long long) Y) << 16) | \
+        (((unsigned long long) Z) << 32)
+
+    switch(PACK(operat, lhs.kind, rhs.kind)) {
         // TODO: Check overflow.
         case PACK(OID_ADD, VK_INT,   VK_INT):   return (Value) { VK_INT,   .as_int   = lhs.as_int   + rhs.as_int   };
         case PACK(OID_ADD, VK_INT,   VK_FLOAT): return (Value) { VK_FLOAT, .as_float = lhs.as_int   + rhs.as_float };
@@ -290,7 +1311,17 @@ static Value apply(OperatID operat, Value lhs, Value rhs, const char **err)
         case PACK(OID_MUL, VK_FLOAT, VK_INT):   return (Value) { VK_FLOAT, .as_float = lhs.as_float * rhs.as_int   };
         case PACK(OID_MUL, VK_FLOAT, VK_FLOAT): return (Value) { VK_FLOAT, .as_float = lhs.as_float * rhs.as_float };
 
-        case PACK(OID_DIV, VK_INT,   VK_INT):   return (Value) { VK_INT,   .as_int   = lhs.as_int   / rhs.as_int   };
+        case PACK(OID_DIV, VK_INT,   VK_INT):
+        if(rhs.as_int == 0) {
+            *err = "Division by zero";
+            break;
+        }
+        if(rhs.as_int == -1 && lhs.as_int == LLONG_MIN) {
+            *err = "Overflow";
+            break;
+        }
+        return (Value) { VK_INT, .as_int = lhs.as_int / rhs.as_int };
+
         case PACK(OID_DIV, VK_INT,   VK_FLOAT): return (Value) { VK_FLOAT, .as_float = lhs.as_int   / rhs.as_float };
         case PACK(OID_DIV, VK_FLOAT, VK_INT):   return (Value) { VK_FLOAT, .as_float = lhs.as_float / rhs.as_int   };
         case PACK(OID_DIV, VK_FLOAT, VK_FLOAT): return (Value) { VK_FLOAT, .as_float = lhs.as_float / rhs.as_float };
@@ -301,6 +1332,7 @@ static Value apply(OperatID operat, Value lhs, Value rhs, const char **err)
             case OID_SUB: *err = "Bad \"-\" operand"; break;
             case OID_MUL: *err = "Bad \"*\" operand"; break;
             case OID_DIV: *err = "Bad \"/\" operand"; break;
+            default: *err = "Bad operator"; break;
         }
         break;
     }
@@ -308,132 +1340,745 @@ static Value apply(OperatID operat, Value lhs, Value rhs, const char **err)
     return (Value) { VK_ERROR };
 }
 
-static Value eval_inner(EvalContext *ctx);
-
-/* Evaluates a "primary expression" AKA an expression with no
- * binary operators in it. If an error occurres, then a value
- * of type [VK_ERROR] is returned and the error is reported by
- * calling [report] on [ctx->err].
+/* Filters are written as [value | name(args)] and get
+ * the filtered value as first argument. The ones here
+ * run over packed arrays without boxing their items; 
+ * names that aren't theirs are called like functions.
  */
-static Value eval_primary(EvalContext *ctx)
+static bool filter_array(Value *args, int argc, int max_argc, const char **err)
 {
-    while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
-        ctx->i += 1;
-
-    if(ctx->i == ctx->len) {
-        report(ctx->err, ctx->len, "Expression ended where a primary "
-                                   "expression was expected");
-        return (Value) { VK_ERROR };
+    if(argc > max_argc) {
+        *err = (max_argc == 1) ? "Expected no arguments" : "Too many arguments";
+        return 0;
+    }
+    if(args[0].kind != VK_ARRAY) {
+        *err = "Expected an array";
+        return 0;
     }
+    return 1;
+}
 
-    if(isalpha(ctx->str[ctx->i]) || ctx->str[ctx->i ] == '_') {
+static bool filter_length(Value *args, int argc, Value *out, const char **err)
+{
+    if(argc > 1) {
+        *err = "Expected no arguments";
+        return 0;
+    }
+    long long len;
+    switch(args[0].kind) {
+        case VK_ARRAY : len = args[0].as_array->count; break;
+        case VK_STRING: len = args[0].str_len; break;
+        case VK_MAP   : len = args[0].as_map->count; break;
+        default:
+        *err = "Expected an array, a string or a map";
+        return 0;
+    }
+    *out = (Value) { VK_INT, .as_int = len };
+    return 1;
+}
 
-        long var_off = ctx->i;
-        do 
-            ctx->i += 1; 
-        while(ctx->i < ctx->len && (isalpha(ctx->str[ctx->i]) || 
-                                    isdigit(ctx->str[ctx->i]) || 
-                                    ctx->str[ctx->i] == '_'));
-        long var_len = ctx->i - var_off;
+/* Packed arrays are summed over four accumulators, which
+ * breaks the dependency between the additions so that
+ * the compiler can vectorize the loop. Integers are
+ * added as unsigned to wrap around on overflow like
+ * "+" does.
+ */
+static bool filter_sum(Value *args, int argc, Value *out, const char **err)
+{
+    if(!filter_array(args, argc, 1, err))
+        return 0;
 
-        // Find variable
-        Value *found = NULL;
-        Variables *vars = ctx->vars;
-        while(found == NULL && vars != NULL) {
-            for(long j = 0; found == NULL && vars->list[j].len > 0; j += 1)
+    const ArrayValue *array = args[0].as_array;
+    long n = array->count;
 
-                if(vars->list[j].len == var_len && !strncmp(vars->list[j].name, ctx->str + var_off, var_len))
-                    found = &vars->list[j].value;
-            vars = vars->parent;
+    if(array->stride == 0 && array->type == AT_INT) {
+        const long long *ints = array->ints;
+        unsigned long long acc[4] = {0, 0, 0, 0};
+        long i = 0;
+        for(; i+4 <= n; i += 4) {
+            acc[0] += (unsigned long long) ints[i+0];
+            acc[1] += (unsigned long long) ints[i+1];
+            acc[2] += (unsigned long long) ints[i+2];
+            acc[3] += (unsigned long long) ints[i+3];
         }
+        for(; i < n; i += 1)
+            acc[0] += (unsigned long long) ints[i];
+        *out = (Value) { VK_INT, .as_int = (long long) (acc[0] + acc[1] + acc[2] + acc[3]) };
+        return 1;
+    }
 
-        if(found == NULL) {
-            report(ctx->err, var_off, 
-                "Undefined variable [%.*s]", 
-                var_len, ctx->str + var_off);
-            return (Value) {VK_ERROR};
+    if(array->stride == 0 && array->type == AT_FLOAT) {
+        const double *floats = array->floats;
+        double acc[4] = {0, 0, 0, 0};
+        long i = 0;
+        for(; i+4 <= n; i += 4) {
+            acc[0] += floats[i+0];
+            acc[1] += floats[i+1];
+            acc[2] += floats[i+2];
+            acc[3] += floats[i+3];
         }
+        for(; i < n; i += 1)
+            acc[0] += floats[i];
+        *out = (Value) { VK_FLOAT, .as_float = (acc[0] + acc[1]) + (acc[2] + acc[3]) };
+        return 1;
+    }
 
-        return *found;
+    // Views and arrays of values go one item at a time
+    Value total = { VK_INT, .as_int = 0 };
+    for(long i = 0; i < n; i += 1) {
+        Value item = array_get(array, i);
+        if(item.kind != VK_INT && item.kind != VK_FLOAT) {
+            *err = "Items must be numbers";
+            return 0;
+        }
+        total = apply(OID_ADD, total, item, err);
+    }
+    *out = total;
+    return 1;
+}
 
-    } else if(isdigit(ctx->str[ctx->i])) {
+/* Returns the item of the array in [args] that compares
+ * [operat] to all the ones before it, the first one 
+ * when more do.
+ */
+static bool array_extreme(Value *args, int argc, OperatID operat, Value *out, const char **err)
+{
+    if(!filter_array(args, argc, 1, err))
+        return 0;
 
-        long long buff = 0;
-        do {
-            // TODO: Check overflow
-            char u = ctx->str[ctx->i] - '0';
-            
-            if(buff > (LLONG_MAX - u) / 10) {
-                report(ctx->err, ctx->i, "Overflow");
-                return (Value) {VK_ERROR};
-            }
+    const ArrayValue *array = args[0].as_array;
+    long n = array->count;
+    if(n == 0) {
+        *err = "Empty array";
+        return 0;
+    }
 
-            buff = buff * 10 + u;
-            ctx->i += 1;
-        } while(ctx->i < ctx->len && isdigit(ctx->str[ctx->i]));
+    if(array->stride == 0 && array->type == AT_INT) {
+        const long long *ints = array->ints;
+        long long m = ints[0];
+        if(operat == OID_LSS)
+            for(long i = 1; i < n; i += 1)
+                m = (ints[i] < m) ? ints[i] : m;
+        else
+            for(long i = 1; i < n; i += 1)
+                m = (ints[i] > m) ? ints[i] : m;
+        *out = (Value) { VK_INT, .as_int = m };
+        return 1;
+    }
 
-        if(ctx->i+1 < ctx->len 
-            && ctx->str[ctx->i] == '.' 
-            && isdigit(ctx->str[ctx->i+1])) {
-            
-            ctx->i += 1;
+    if(array->stride == 0 && array->type == AT_FLOAT) {
+        const double *floats = array->floats;
+        double m = floats[0];
+        if(operat == OID_LSS)
+            for(long i = 1; i < n; i += 1)
+                m = (floats[i] < m) ? floats[i] : m;
+        else
+            for(long i = 1; i < n; i += 1)
+                m = (floats[i] > m) ? floats[i] : m;
+        *out = (Value) { VK_FLOAT, .as_float = m };
+        return 1;
+    }
 
-            double decimal = 0;
-            double q = 1;
+    Value best = array_get(array, 0);
+    for(long i = 1; i < n; i += 1) {
+        Value item = array_get(array, i);
+        Value r = compare(operat, item, best, err);
+        if(r.kind == VK_ERROR)
+            return 0;
+        if(r.as_int)
+            best = item;
+    }
+    *out = value_retain(best);
+    return 1;
+}
 
-            do {
-                q /= 10;
-                decimal += q * (ctx->str[ctx->i] - '0');
-                ctx->i += 1;
-            } while(ctx->i < ctx->len && isdigit(ctx->str[ctx->i]));
-            
-            return (Value) {VK_FLOAT, .as_float = (double) buff + decimal};
-        }
+static bool filter_min(Value *args, int argc, Value *out, const char **err)
+{
+    return array_extreme(args, argc, OID_LSS, out, err);
+}
 
-        return (Value) {VK_INT, .as_int = buff};
-    
-    } else if(ctx->str[ctx->i] == '[') {
+static bool filter_max(Value *args, int argc, Value *out, const char **err)
+{
+    return array_extreme(args, argc, OID_GRT, out, err);
+}
 
-        ctx->i += 1; // Skip '['
+static bool filter_first(Value *args, int argc, Value *out, const char **err)
+{
+    if(!filter_array(args, argc, 1, err))
+        return 0;
+    if(args[0].as_array->count == 0) {
+        *err = "Empty array";
+        return 0;
+    }
+    *out = value_retain(array_get(args[0].as_array, 0));
+    return 1;
+}
 
-        while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
-            ctx->i += 1;
+static bool filter_last(Value *args, int argc, Value *out, const char **err)
+{
+    if(!filter_array(args, argc, 1, err))
+        return 0;
+    const ArrayValue *array = args[0].as_array;
+    if(array->count == 0) {
+        *err = "Empty array";
+        return 0;
+    }
+    *out = value_retain(array_get(array, array->count-1));
+    return 1;
+}
 
-        if(ctx->i == ctx->len) {
-            report(ctx->err, ctx->len, "Expression ended inside of an array");
-            return (Value) {VK_ERROR};
-        }
+/* Strings are views, so there's no value to hold the
+ * result of [join]. It's written to the output instead
+ * (see [print_join]), which only works when the filter
+ * is the whole {{ .. }} block.
+ */
+static bool filter_join(Value *args, int argc, Value *out, const char **err)
+{
+    (void) args;
+    (void) argc;
+    (void) out;
+    *err = "Can only be printed";
+    return 0;
+}
 
-        const char *errmsg;
+static bool print_join(Emitter *e, Value *args, int argc, const char **err)
+{
+    if(!filter_array(args, argc, 2, err))
+        return 0;
 
-        Value array = array_new(&errmsg);
-        if(array.kind == VK_ERROR) {
-            report(ctx->err, ctx->i, "%s", errmsg);
-            return array;
+    Value sep = { VK_STRING, 0, .as_str = "" };
+    if(argc > 1) {
+        sep = args[1];
+        if(sep.kind != VK_STRING) {
+            *err = "Separator must be a string";
+            return 0;
         }
+    }
 
-        if(ctx->str[ctx->i] != ']')
-            while(1) {
+    const ArrayValue *array = args[0].as_array;
+    for(long i = 0; i < array->count; i += 1) {
+        if(i > 0)
+            emit(e, sep.as_str, sep.str_len);
+        emit_value(e, array_get(array, i));
+    }
+    return 1;
+}
 
-                Value val = eval_inner(ctx);
-                if(val.kind == VK_ERROR) {
-                    value_free(&array);
-                    return val;
-                }
+/* Writes the decimal digits of [n] to [dst] and returns
+ * how many there are. With [group], a comma separates
+ * the thousands.
+ */
+static int format_uint(char *dst, unsigned long long n, bool group)
+{
+    char tmp[32];
+    int len = 0;
+    do {
+        if(group && len % 4 == 3)
+            tmp[len++] = ',';
+        tmp[len++] = '0' + n % 10;
+        n /= 10;
+    } while(n > 0);
+
+    for(int i = 0; i < len; i += 1)
+        dst[i] = tmp[len-i-1];
+    return len;
+}
 
-                if(!array_append(&array, val, &errmsg)) {
-                    report(ctx->err, ctx->i, "%s", errmsg);
-                    value_free(&array);
-                    return (Value) {VK_ERROR};
-                }
+/* Writes [val] formatted as described by [spec]. Integers
+ * are converted here. Floats are converted by [snprintf],
+ * which rounds their exact value correctly like Python
+ * does, and the fill, sign and grouping are applied to
+ * its digits, so the output doesn't depend on the locale.
+ */
+static bool emit_fmt(Emitter *e, Value val, const XT_FmtSpec *spec, const char **err)
+{
+    char type = spec->type;
+    if(type == 0) {
+        switch(val.kind) {
+            case VK_INT   : type = 'd'; break;
+            case VK_FLOAT : type = 'f'; break;
+            case VK_STRING: type = 's'; break;
+            default:
+            *err = "Expected a number or a string";
+            return 0;
+        }
+    }
+
+    // The formatted value is [sign] followed by [body]
+    char body[1024];
+    int  body_len = 0;
+    bool negative = false;
+
+    if(type == 's') {
+        if(val.kind != VK_STRING) {
+            *err = "Expected a string";
+            return 0;
+        }
+    } else if(type == 'd') {
+        if(val.kind != VK_INT) {
+            *err = "Expected an integer";
+            return 0;
+        }
+        negative = val.as_int < 0;
+        unsigned long long n = val.as_int;
+        if(negative)
+            n = 0ull - n;
+        body_len = format_uint(body, n, spec->group);
+    } else {
+        if(val.kind != VK_INT && val.kind != VK_FLOAT) {
+            *err = "Expected a number";
+            return 0;
+        }
+        double x = (val.kind == VK_INT) ? (double) val.as_int : val.as_float;
+        if(type == '%')
+            x *= 100;
+
+        int prec = (spec->prec < 0) ? 6 : spec->prec;
+
+        negative = x < 0;
+        if(negative)
+            x = -x;
+
+        if(x != x)
+            body_len = 3, memcpy(body, "nan", 3);
+        else if(x - x != 0)
+            body_len = 3, memcpy(body, "inf", 3);
+        else {
+            // At most 309 digits before the point and
+            // 100 after it
+            char tmp[512];
+            int len = snprintf(tmp, sizeof(tmp), "%.*f", prec, x);
+            assert(len > 0 && len < (int) sizeof(tmp));
+            int int_len = 0;
+            while(int_len < len && tmp[int_len] >= '0' && tmp[int_len] <= '9')
+                int_len += 1;
+            for(int i = 0; i < int_len; i += 1) {
+                if(spec->group && i > 0 && (int_len - i) % 3 == 0)
+                    body[body_len++] = ',';
+                body[body_len++] = tmp[i];
+            }
+            if(int_len < len) {
+                body[body_len++] = '.';
+                memcpy(body + body_len, tmp + int_len + 1, len - int_len - 1);
+                body_len += len - int_len - 1;
+            }
+        }
+
+        if(type == '%')
+            body[body_len++] = '%';
+    }
+
+    const char *text = body;
+    long text_len = body_len;
+    if(type == 's') {
+        text = val.as_str;
+        text_len = val.str_len;
+        if(spec->prec >= 0 && text_len > spec->prec)
+            text_len = spec->prec;
+    }
+
+    char sign = 0;
+    if(negative)
+        sign = '-';
+    else if(type != 's' && (spec->sign == '+' || spec->sign == ' '))
+        sign = spec->sign;
+
+    long pad = spec->width - text_len - (sign != 0);
+    if(pad < 0)
+        pad = 0;
+
+    // Zero padding goes between the sign and the digits
+    char fill  = spec->fill ? spec->fill : ' ';
+    char align = spec->align ? spec->align : (type == 's' ? '<' : '>');
+    long left = 0, right = 0;
+    if(spec->zero && type != 's' && spec->align == 0) {
+        fill = '0';
+        if(sign)
+            emit(e, &sign, 1);
+        sign = 0;
+        left = pad;
+    } else if(align == '<')
+        right = pad;
+    else if(align == '>')
+        left = pad;
+    else {
+        left = pad / 2;
+        right = pad - left;
+    }
+
+    char fills[64];
+    memset(fills, fill, sizeof(fills));
+    for(long n = left; n > 0; n -= sizeof(fills))
+        emit(e, fills, n < (long) sizeof(fills) ? n : (long) sizeof(fills));
+    if(sign)
+        emit(e, &sign, 1);
+    emit(e, text, text_len);
+    for(long n = right; n > 0; n -= sizeof(fills))
+        emit(e, fills, n < (long) sizeof(fills) ? n : (long) sizeof(fills));
+    return 1;
+}
+
+/* Parses the format string of [fmt] into [spec]. Returns
+ * false if it's malformed.
+ */
+static bool parse_fmt_spec(const char *str, long len, XT_FmtSpec *spec)
+{
+    *spec = (XT_FmtSpec) { .width = -1, .prec = -1 };
+
+    long i = 0;
+    if(len > 1 && (str[1] == '<' || str[1] == '>' || str[1] == '^')) {
+        spec->fill  = str[0];
+        spec->align = str[1];
+        i = 2;
+    } else if(len > 0 && (str[0] == '<' || str[0] == '>' || str[0] == '^')) {
+        spec->align = str[0];
+        i = 1;
+    }
+
+    if(i < len && (str[i] == '+' || str[i] == '-' || str[i] == ' '))
+        spec->sign = str[i++];
+
+    if(i < len && str[i] == '0') {
+        spec->zero = true;
+        i += 1;
+    }
+
+    if(i < len && isdigit(str[i])) {
+        int width = 0;
+        do {
+            width = width * 10 + (str[i] - '0');
+            if(width > 1000)
+                return 0;
+            i += 1;
+        } while(i < len && isdigit(str[i]));
+        spec->width = width;
+    }
+
+    if(i < len && str[i] == ',') {
+        spec->group = true;
+        i += 1;
+    }
+
+    if(i < len && str[i] == '.') {
+        i += 1;
+        if(i == len || !isdigit(str[i]))
+            return 0;
+        int prec = 0;
+        do {
+            prec = prec * 10 + (str[i] - '0');
+            if(prec > 100)
+                return 0;
+            i += 1;
+        } while(i < len && isdigit(str[i]));
+        spec->prec = prec;
+    }
+
+    if(i < len && (str[i] == 'd' || str[i] == 'f' || str[i] == 's' || str[i] == '%'))
+        spec->type = str[i++];
+
+    if(spec->type == 'd' && spec->prec >= 0)
+        return 0;
+    if(spec->type == 's' && (spec->group || spec->sign))
+        return 0;
+    return i == len;
+}
+
+static const struct {
+    const char *name;
+    FuncValue   func;
+} filters[] = {
+    { "length", filter_length },
+    { "sum",    filter_sum    },
+    { "min",    filter_min    },
+    { "max",    filter_max    },
+    { "first",  filter_first  },
+    { "last",   filter_last   },
+    { "join",   filter_join   },
+};
+
+static FuncValue find_filter(const char *name, long len)
+{
+    for(size_t k = 0; k < sizeof(filters) / sizeof(filters[0]); k += 1)
+        if((long) strlen(filters[k].name) == len && !strncmp(filters[k].name, name, len))
+            return filters[k].func;
+    return NULL;
+}
+
+/* Appends a node to the expression array of the 
+ * template and returns its index, or -1 if it 
+ * wasn't possible to allocate memory for it.
+ */
+static int append_node(XT_Template *tmpl, Expr node)
+{
+    if(tmpl->node_count == tmpl->node_max_count) {
+
+        int new_max_count;
+        if(tmpl->node_max_count == 0)
+            new_max_count = 16;
+        else
+            new_max_count = 2 * tmpl->node_max_count;
+
+        void *temp = realloc(tmpl->nodes, new_max_count * sizeof(Expr));
+        if(temp == NULL)
+            return -1;
+
+        tmpl->nodes = temp;
+        tmpl->node_max_count = new_max_count;
+    }
+
+    int idx = tmpl->node_count++;
+    node.next = -1;
+    node.cache = -1;
+    tmpl->nodes[idx] = node;
+    return idx;
+}
+
+static int new_node(CompileContext *ctx, Expr node)
+{
+    int idx = append_node(ctx->tmpl, node);
+    if(idx < 0)
+        report(ctx->err, node.off, "Out of memory");
+    return idx;
+}
+
+static int parse_inner(CompileContext *ctx);
+
+/* Parses the argument list of a call to the function 
+ * named [len] bytes at [name_off], starting from the
+ * opening parenthesis. For a filter, [first] is the
+ * node of the filtered value, which is passed as the
+ * first argument, and the list may be omitted. It's 
+ * -1 otherwise.
+ */
+static int parse_call(CompileContext *ctx, long name_off, long name_len, int first)
+{
+    if(name_len > INT_MAX) {
+        report(ctx->err, name_off, "Function name is too long");
+        return -1;
+    }
+
+    FuncValue builtin = NULL;
+    if(first >= 0)
+        builtin = find_filter(ctx->str + name_off, name_len);
+    if(builtin == NULL)
+        builtin = find_builtin(ctx->str + name_off, name_len);
+
+    int call = new_node(ctx, (Expr) { EK_CALL, name_off, .call = { -1, 0, name_len, first >= 0, builtin } });
+    if(call < 0)
+        return -1;
+
+    int tail = -1;
+    if(first >= 0) {
+        Expr *nodes = ctx->tmpl->nodes;
+        nodes[call].call.head = first;
+        nodes[call].call.count = 1;
+        nodes[call].level = nodes[first].level;
+        tail = first;
+
+        if(ctx->i == ctx->len || ctx->str[ctx->i] != '(')
+            return call;
+    }
+
+    assert(ctx->str[ctx->i] == '(');
+    ctx->i += 1; // Skip '('
+
+    while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+        ctx->i += 1;
+
+    if(ctx->i < ctx->len && ctx->str[ctx->i] != ')')
+        while(1) {
+
+            if(ctx->tmpl->nodes[call].call.count == MAX_ARGS) {
+                report(ctx->err, ctx->i, "Too many arguments (the maximum is %d)", MAX_ARGS);
+                return -1;
+            }
+
+            int arg = parse_inner(ctx);
+            if(arg < 0)
+                return -1;
+
+            Expr *nodes = ctx->tmpl->nodes;
+            if(tail < 0)
+                nodes[call].call.head = arg;
+            else
+                nodes[tail].next = arg;
+            nodes[call].call.count += 1;
+            if(nodes[call].level < nodes[arg].level)
+                nodes[call].level = nodes[arg].level;
+            tail = arg;
+
+            while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+                ctx->i += 1;
+
+            if(ctx->i == ctx->len || ctx->str[ctx->i] == ')')
+                break;
+
+            if(ctx->str[ctx->i] != ',') {
+                report(ctx->err, ctx->i, "Unexpected character [%c] inside of an argument list", ctx->str[ctx->i]);
+                return -1;
+            }
+
+            ctx->i += 1; // Skip ','
+        }
+
+    if(ctx->i == ctx->len) {
+        report(ctx->err, ctx->len, "Expression ended inside of an argument list");
+        return -1;
+    }
+
+    assert(ctx->str[ctx->i] == ')');
+    ctx->i += 1; // Skip ')'
+
+    return call;
+}
+
+/* Parses a literal, an identifier or an array and returns
+ * the index of its node. If an error occurres, then -1 is 
+ * returned and the error is reported by calling [report]
+ * on [ctx->err].
+ */
+static int parse_atom(CompileContext *ctx)
+{
+    while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+        ctx->i += 1;
+
+    if(ctx->i == ctx->len) {
+        report(ctx->err, ctx->len, "Expression ended where a primary "
+                                   "expression was expected");
+        return -1;
+    }
+
+    if(isalpha(ctx->str[ctx->i]) || ctx->str[ctx->i ] == '_') {
+
+        long var_off = ctx->i;
+        do 
+            ctx->i += 1; 
+        while(ctx->i < ctx->len && (isalpha(ctx->str[ctx->i]) || 
+                                    isdigit(ctx->str[ctx->i]) || 
+                                    ctx->str[ctx->i] == '_'));
+        long var_len = ctx->i - var_off;
+
+        long j = ctx->i;
+        while(j < ctx->len && isspace(ctx->str[j]))
+            j += 1;
+        if(j < ctx->len && ctx->str[j] == '(') {
+            ctx->i = j;
+            return parse_call(ctx, var_off, var_len, -1);
+        }
+
+        // Iteration variables are resolved now, the
+        // most recent binding shadows the others.
+        for(int j = ctx->binding_count-1; j >= 0; j -= 1) {
+            Binding *b = &ctx->bindings[j];
+            if(b->len == var_len && !strncmp(b->name, ctx->str + var_off, var_len))
+                return new_node(ctx, (Expr) { EK_LOCAL, var_off, .level = b->level, .slot = b->slot });
+        }
+
+        return new_node(ctx, (Expr) { EK_VAR, var_off, .var.len = var_len });
+
+    } else if(isdigit(ctx->str[ctx->i])) {
+
+        long num_off = ctx->i;
+        long long buff = 0;
+        do {
+            char u = ctx->str[ctx->i] - '0';
+            
+            if(buff > (LLONG_MAX - u) / 10) {
+                report(ctx->err, ctx->i, "Overflow");
+                return -1;
+            }
+
+            buff = buff * 10 + u;
+            ctx->i += 1;
+        } while(ctx->i < ctx->len && isdigit(ctx->str[ctx->i]));
+
+        if(ctx->i+1 < ctx->len 
+            && ctx->str[ctx->i] == '.' 
+            && isdigit(ctx->str[ctx->i+1])) {
+            
+            ctx->i += 1;
+
+            double decimal = 0;
+            double q = 1;
+
+            do {
+                q /= 10;
+                decimal += q * (ctx->str[ctx->i] - '0');
+                ctx->i += 1;
+            } while(ctx->i < ctx->len && isdigit(ctx->str[ctx->i]));
+            
+            return new_node(ctx, (Expr) { EK_FLOAT, num_off, .as_float = (double) buff + decimal });
+        }
+
+        return new_node(ctx, (Expr) { EK_INT, num_off, .as_int = buff });
+
+    } else if(ctx->str[ctx->i] == '"' || ctx->str[ctx->i] == '\'') {
+
+        // There are no escape sequences, so that the value
+        // of a literal can refer to the source directly. 
+        // Either quote can be used to write the other.
+        char quote = ctx->str[ctx->i];
+        long str_off = ctx->i;
+        ctx->i += 1; // Skip the opening quote
+
+        while(ctx->i < ctx->len && ctx->str[ctx->i] != quote)
+            ctx->i += 1;
+
+        if(ctx->i == ctx->len) {
+            report(ctx->err, ctx->len, "Expression ended inside of a string");
+            return -1;
+        }
+        ctx->i += 1; // Skip the closing quote
+
+        long str_len = ctx->i - str_off - 2;
+        if(str_len > INT_MAX) {
+            report(ctx->err, str_off, "String is too long");
+            return -1;
+        }
+        return new_node(ctx, (Expr) { EK_STRING, str_off, .str.len = str_len });
+    
+    } else if(ctx->str[ctx->i] == '[') {
+
+        long array_off = ctx->i;
+        ctx->i += 1; // Skip '['
+
+        while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+            ctx->i += 1;
+
+        if(ctx->i == ctx->len) {
+            report(ctx->err, ctx->len, "Expression ended inside of an array");
+            return -1;
+        }
+
+        int array = new_node(ctx, (Expr) { EK_ARRAY, array_off, .array = { -1, 0 } });
+        if(array < 0)
+            return -1;
+
+        int tail = -1;
+        if(ctx->str[ctx->i] != ']')
+            while(1) {
+
+                int item = parse_inner(ctx);
+                if(item < 0)
+                    return -1;
+
+                // Nodes may have been moved by [parse_inner]
+                Expr *nodes = ctx->tmpl->nodes;
+                if(tail < 0)
+                    nodes[array].array.head = item;
+                else
+                    nodes[tail].next = item;
+                nodes[array].array.count += 1;
+                if(nodes[array].level < nodes[item].level)
+                    nodes[array].level = nodes[item].level;
+                tail = item;
 
                 while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
                     ctx->i += 1;
 
                 if(ctx->i == ctx->len) {
                     report(ctx->err, ctx->i, "Expression ended inside of an array");
-                    value_free(&array);
-                    return (Value) {VK_ERROR};
+                    return -1;
                 }
                 
                 if(ctx->str[ctx->i] == ']')
@@ -441,8 +2086,7 @@ static Value eval_primary(EvalContext *ctx)
 
                 if(ctx->str[ctx->i] != ',') {
                     report(ctx->err, ctx->i, "Unexpected character [%c] inside of an array", ctx->str[ctx->i]);
-                    value_free(&array);
-                    return (Value) { VK_ERROR };
+                    return -1;
                 }
                 
                 ctx->i += 1; // Skip ','
@@ -455,862 +2099,5580 @@ static Value eval_primary(EvalContext *ctx)
     }
 
     report(ctx->err, ctx->i, "Unexpected character [%c] where a primary expression was expected", ctx->str[ctx->i]);
-    return (Value) { VK_ERROR };
+    return -1;
 }
 
-static bool next_binary_operat(EvalContext *ctx, OperatID *operat, long *off)
+/* Parses a "primary expression" AKA an expression with no
+ * binary operators in it, which is an atom followed by
+ * any number of .field and [key] accesses and filters.
+ */
+static int parse_primary(CompileContext *ctx)
 {
-    while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
-        ctx->i += 1;
+    int node = parse_atom(ctx);
 
-    if(ctx->i < ctx->len) 
-        switch(ctx->str[ctx->i]) {
-        
-            case '+':
-            *off = ctx->i;
-            ctx->i += 1;
-            *operat = OID_ADD;
-            return 1;
-            
-            case '-':
-            *off = ctx->i;
-            ctx->i += 1;
-            *operat = OID_SUB;
-            return 1;
+    while(node >= 0) {
 
-            case '*':
-            *off = ctx->i;
+        while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
             ctx->i += 1;
-            *operat = OID_MUL;
-            return 1;
 
-           case '/':
-            *off = ctx->i;
-            ctx->i += 1;
-            *operat = OID_DIV;
-            return 1;
-        }
-    return 0;
-}
+        if(ctx->i == ctx->len)
+            break;
+
+        if(ctx->str[ctx->i] == '.') {
+
+            ctx->i += 1; // Skip '.'
+
+            while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+                ctx->i += 1;
+
+            if(ctx->i == ctx->len || (!isalpha(ctx->str[ctx->i]) && ctx->str[ctx->i] != '_')) {
+                report(ctx->err, ctx->i, "Expected a field name after [.]");
+                return -1;
+            }
+
+            long name_off = ctx->i;
+            do 
+                ctx->i += 1; 
+            while(ctx->i < ctx->len && (isalnum(ctx->str[ctx->i]) || ctx->str[ctx->i] == '_'));
+            long name_len = ctx->i - name_off;
+
+            Expr field = { EK_FIELD, name_off, .level = ctx->tmpl->nodes[node].level };
+            field.field.obj = node;
+            field.field.len = name_len;
+            field.field.hash = hash_key(ctx->str + name_off, name_len);
+            node = new_node(ctx, field);
+
+        } else if(ctx->str[ctx->i] == '[') {
+
+            long index_off = ctx->i;
+            ctx->i += 1; // Skip '['
+
+            while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+                ctx->i += 1;
+
+            // The start of a slice may be omitted
+            int key = -1;
+            if(ctx->i == ctx->len || ctx->str[ctx->i] != ':') {
+                key = parse_inner(ctx);
+                if(key < 0)
+                    return -1;
+
+                while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+                    ctx->i += 1;
+            }
+
+            if(ctx->i == ctx->len) {
+                report(ctx->err, ctx->i, "Expression ended inside of an index");
+                return -1;
+            }
+
+            if(ctx->str[ctx->i] == ':') {
+
+                ctx->i += 1; // Skip ':'
+
+                while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+                    ctx->i += 1;
+
+                // So may the end
+                int stop = -1;
+                if(ctx->i < ctx->len && ctx->str[ctx->i] != ']') {
+                    stop = parse_inner(ctx);
+                    if(stop < 0)
+                        return -1;
+
+                    while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+                        ctx->i += 1;
+                }
+
+                if(ctx->i == ctx->len) {
+                    report(ctx->err, ctx->i, "Expression ended inside of a slice");
+                    return -1;
+                }
+
+                if(ctx->str[ctx->i] != ']') {
+                    report(ctx->err, ctx->i, "Unexpected character [%c] inside of a slice", ctx->str[ctx->i]);
+                    return -1;
+                }
+                ctx->i += 1; // Skip ']'
+
+                const Expr *nodes = ctx->tmpl->nodes;
+                int level = nodes[node].level;
+                if(key >= 0 && level < nodes[key].level)
+                    level = nodes[key].level;
+                if(stop >= 0 && level < nodes[stop].level)
+                    level = nodes[stop].level;
+
+                node = new_node(ctx, (Expr) { EK_SLICE, index_off, .level = level, .slice = { node, key, stop } });
+                continue;
+            }
+
+            if(ctx->str[ctx->i] != ']') {
+                report(ctx->err, ctx->i, "Unexpected character [%c] inside of an index", ctx->str[ctx->i]);
+                return -1;
+            }
+            ctx->i += 1; // Skip ']'
+
+            const Expr *nodes = ctx->tmpl->nodes;
+            int level = nodes[node].level;
+            if(level < nodes[key].level)
+                level = nodes[key].level;
+
+            // A constant key is the same as a .field, so the
+            // node of the key becomes the field access.
+            if(nodes[key].kind == EK_STRING) {
+                long name_off = nodes[key].off + 1;
+                int  name_len = nodes[key].str.len;
+                Expr field = { EK_FIELD, name_off, .next = -1, .level = level, .cache = -1 };
+                field.field.obj = node;
+                field.field.len = name_len;
+                field.field.hash = hash_key(ctx->str + name_off, name_len);
+                ctx->tmpl->nodes[key] = field;
+                node = key;
+            } else
+                node = new_node(ctx, (Expr) { EK_INDEX, index_off, .level = level, .index = { node, key } });
+
+        } else if(ctx->str[ctx->i] == '|') {
+
+            ctx->i += 1; // Skip '|'
+
+            while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+                ctx->i += 1;
+
+            if(ctx->i == ctx->len || (!isalpha(ctx->str[ctx->i]) && ctx->str[ctx->i] != '_')) {
+                report(ctx->err, ctx->i, "Expected a filter name after [|]");
+                return -1;
+            }
+
+            long name_off = ctx->i;
+            do 
+                ctx->i += 1; 
+            while(ctx->i < ctx->len && (isalnum(ctx->str[ctx->i]) || ctx->str[ctx->i] == '_'));
+            long name_len = ctx->i - name_off;
+
+            while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+                ctx->i += 1;
+
+            XT_Escape mode = XT_ESCAPE_NONE;
+            bool escape = false;
+            if(name_len == 6 && !strncmp(ctx->str + name_off, "escape", 6)) {
+                mode = XT_ESCAPE_HTML;
+                escape = true;
+            } else if(name_len == 9 && !strncmp(ctx->str + name_off, "urlencode", 9)) {
+                mode = XT_ESCAPE_URL;
+                escape = true;
+            } else if(name_len == 4 && !strncmp(ctx->str + name_off, "safe", 4))
+                escape = true;
+
+            if(escape) {
+                if(ctx->i < ctx->len && ctx->str[ctx->i] == '(') {
+                    report(ctx->err, ctx->i, "Filter [%.*s] takes no arguments", (int) name_len, ctx->str + name_off);
+                    return -1;
+                }
+                Expr esc = { EK_ESCAPE, name_off, .level = ctx->tmpl->nodes[node].level };
+                esc.escape.obj  = node;
+                esc.escape.mode = mode;
+                esc.escape.len  = name_len;
+                node = new_node(ctx, esc);
+                continue;
+            }
+
+            if(name_len != 3 || strncmp(ctx->str + name_off, "fmt", 3)) {
+                node = parse_call(ctx, name_off, name_len, node);
+                continue;
+            }
+
+            // The format must be a literal, so that it can
+            // be parsed now. Without one, the spec is empty.
+            long str_off = -1, str_len = 0;
+            bool parens = ctx->i < ctx->len && ctx->str[ctx->i] == '(';
+            if(parens) {
+                ctx->i += 1; // Skip '('
+                while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+                    ctx->i += 1;
+                if(ctx->i < ctx->len && (ctx->str[ctx->i] == '"' || ctx->str[ctx->i] == '\'')) {
+                    char quote = ctx->str[ctx->i++];
+                    str_off = ctx->i;
+                    while(ctx->i < ctx->len && ctx->str[ctx->i] != quote)
+                        ctx->i += 1;
+                    str_len = ctx->i - str_off;
+                    if(ctx->i < ctx->len)
+                        ctx->i += 1; // Skip the closing quote
+                    while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+                        ctx->i += 1;
+                }
+            }
+            if(parens && (str_off < 0 || ctx->i == ctx->len || ctx->str[ctx->i] != ')')) {
+                report(ctx->err, name_off, "Expected a format string literal after [fmt]");
+                return -1;
+            }
+            if(parens)
+                ctx->i += 1; // Skip ')'
+
+            Expr fmt = { EK_FMT, name_off, .level = ctx->tmpl->nodes[node].level };
+            fmt.fmt.obj = node;
+            if(!parse_fmt_spec(ctx->str + str_off, str_len, &fmt.fmt.spec)) {
+                report(ctx->err, str_off, "Invalid format [%.*s]", (int) str_len, ctx->str + str_off);
+                return -1;
+            }
+            node = new_node(ctx, fmt);
+
+        } else
+            break;
+    }
+    return node;
+}
+
+/* Returns true if the source at the cursor is the 
+ * keyword [word], not followed by other characters 
+ * of a name.
+ */
+static bool at_word(CompileContext *ctx, const char *word)
+{
+    // Most of the times it's not even the first letter
+    if(ctx->i == ctx->len || ctx->str[ctx->i] != word[0])
+        return 0;
+
+    long len = strlen(word);
+    long end = ctx->i + len;
+    return end <= ctx->len && !strncmp(ctx->str + ctx->i, word, len)
+        && (end == ctx->len || (!isalnum(ctx->str[end]) && ctx->str[end] != '_'));
+}
+
+static bool next_binary_operat(CompileContext *ctx, OperatID *operat, long *off)
+{
+    while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+        ctx->i += 1;
+
+    if(ctx->i == ctx->len)
+        return 0;
+
+    // Two character operators
+    static const struct {
+        char str[3];
+        OperatID operat;
+    } pairs[] = {
+        { "==", OID_EQL },
+        { "!=", OID_NQL },
+        { "<=", OID_LEQ },
+        { ">=", OID_GEQ },
+    };
+    for(size_t k = 0; k < sizeof(pairs) / sizeof(pairs[0]); k += 1)
+        if(ctx->i+1 < ctx->len && ctx->str[ctx->i] == pairs[k].str[0] 
+                               && ctx->str[ctx->i+1] == pairs[k].str[1]) {
+            *off = ctx->i;
+            ctx->i += 2;
+            *operat = pairs[k].operat;
+            return 1;
+        }
+
+    if(at_word(ctx, "and")) {
+        *off = ctx->i;
+        ctx->i += 3;
+        *operat = OID_AND;
+        return 1;
+    }
+
+    if(at_word(ctx, "or")) {
+        *off = ctx->i;
+        ctx->i += 2;
+        *operat = OID_OR;
+        return 1;
+    }
+
+    switch(ctx->str[ctx->i]) {
+
+        case '+':
+        *off = ctx->i;
+        ctx->i += 1;
+        *operat = OID_ADD;
+        return 1;
+        
+        case '-':
+        *off = ctx->i;
+        ctx->i += 1;
+        *operat = OID_SUB;
+        return 1;
+
+        case '*':
+        *off = ctx->i;
+        ctx->i += 1;
+        *operat = OID_MUL;
+        return 1;
+
+        case '/':
+        *off = ctx->i;
+        ctx->i += 1;
+        *operat = OID_DIV;
+        return 1;
+
+        case '<':
+        *off = ctx->i;
+        ctx->i += 1;
+        *operat = OID_LSS;
+        return 1;
+
+        case '>':
+        *off = ctx->i;
+        ctx->i += 1;
+        *operat = OID_GRT;
+        return 1;
+    }
+    return 0;
+}
+
+static inline long preced_of(OperatID operat)
+{
+    static const long map[] = {
+        [OID_OR]  = 0,
+        [OID_AND] = 1,
+        [OID_EQL] = 2,
+        [OID_NQL] = 2,
+        [OID_LSS] = 2,
+        [OID_LEQ] = 2,
+        [OID_GRT] = 2,
+        [OID_GEQ] = 2,
+        [OID_ADD] = 3,
+        [OID_SUB] = 3,
+        [OID_MUL] = 4,
+        [OID_DIV] = 4,
+    };
+    return map[operat];
+}
+
+#define PRECED_CMP 2
+
+static inline bool is_right_assoc(OperatID operat)
+{
+    (void) operat;
+    return 0;
+}
+
+static int parse_unary(CompileContext *ctx);
+
+static int parse_expr_1(CompileContext *ctx, int lhs, long min_preced)
+{
+    if(lhs < 0)
+        return lhs;
+
+    OperatID operat;
+    long operat_off = ctx->i;
+    while(next_binary_operat(ctx, &operat, &operat_off) && preced_of(operat) >= min_preced) {
+
+        int rhs = parse_unary(ctx);
+        if(rhs < 0) {
+            assert(ctx->err->occurred);
+            return rhs;
+        }
+
+        OperatID operat2;
+        long operat2_off = ctx->i;
+        while(next_binary_operat(ctx, &operat2, &operat2_off) && (preced_of(operat2) > preced_of(operat) || (is_right_assoc(operat2) && preced_of(operat) == preced_of(operat2)))) {
+
+            ctx->i = operat2_off;
+
+            long preced = preced_of(operat) 
+                        + (preced_of(operat2) > preced_of(operat));
+
+            rhs = parse_expr_1(ctx, rhs, preced);
+            if(rhs < 0) {
+                assert(ctx->err->occurred);
+                return rhs;
+            }
+            operat2_off = ctx->i;
+        }
+        ctx->i = operat2_off;
+
+        int level = ctx->tmpl->nodes[lhs].level;
+        if(level < ctx->tmpl->nodes[rhs].level)
+            level = ctx->tmpl->nodes[rhs].level;
+
+        lhs = new_node(ctx, (Expr) { EK_BINARY, operat_off, .level = level, .binary = { operat, lhs, rhs } });
+        if(lhs < 0)
+            return lhs;
+
+        operat_off = ctx->i;
+    }
+    ctx->i = operat_off;
+    return lhs;
+}
+
+/* Parses a primary expression, optionally negated by
+ * [not]. Like in Python, [not] binds looser than the
+ * comparisons, so [not a == b] is [not (a == b)].
+ */
+static int parse_unary(CompileContext *ctx)
+{
+    while(ctx->i < ctx->len && isspace(ctx->str[ctx->i]))
+        ctx->i += 1;
+
+    if(!at_word(ctx, "not"))
+        return parse_primary(ctx);
+
+    long off = ctx->i;
+    ctx->i += 3; // Skip "not"
+
+    int operand = parse_expr_1(ctx, parse_unary(ctx), PRECED_CMP);
+    if(operand < 0)
+        return -1;
+
+    int level = ctx->tmpl->nodes[operand].level;
+    return new_node(ctx, (Expr) { EK_NOT, off, .level = level, .operand = operand });
+}
+
+static int parse_inner(CompileContext *ctx)
+{
+    return parse_expr_1(ctx, parse_unary(ctx), 0);
+}
+
+/* Compiles the expression at offset [off] of the source
+ * with length [len] and returns the index of its root
+ * node, or -1 if an error occurred.
+ */
+static int parse_expr(CompileContext *ctx, long off, long len)
+{
+    ctx->i   = off;
+    ctx->len = off + len;
+    int expr = parse_inner(ctx);
+    if(expr < 0)
+        assert(ctx->err == NULL || ctx->err->occurred == true);
+    return expr;
+}
+
+static bool iskword(const char *str, long len)
+{
+    static struct {
+        char str[6];
+        long len;
+    } kwords[] = {
+        #define KWORD(lit) { lit, sizeof(lit)-1 }
+        KWORD("in"),
+        KWORD("if"),
+        KWORD("for"),
+        KWORD("else"),
+        KWORD("endif"),
+        KWORD("endfor"),
+        KWORD("set"),
+        KWORD("and"),
+        KWORD("or"),
+        KWORD("not"),
+        #undef KWORD
+    };
+
+    for(unsigned int i = 0; i < sizeof(kwords)/sizeof(kwords[0]); i += 1)
+        if(len == kwords[i].len && !memcmp(str, kwords[i].str, len))
+            return 1;
+    return 0;
+}
+
+static bool parse_for_statement(const char *str, long len, 
+                               long *var1_off, long *var1_len,
+                               long *var2_off, long *var2_len, long var_max, 
+                               long *coll_off, long *coll_len,
+                               XT_Error *err)
+{
+    /* [str] must contain a string in one of the
+     * following forms:
+     *   A    in C
+     *   A, B in C
+     *
+     * where A and B are variable names and C is an
+     * expression.
+     *
+     * Variable names can contain alphabetical 
+     * characters, digits or _, but the first 
+     * character can't be a digit).
+     *
+     * Whitespace between elements must not matter.
+     */
+
+    long i = 0;
+
+    // Skip spaces before "A"
+    while(i < len && isspace(str[i]))
+        i += 1;
+
+    if(i == len) {
+        report(err, i, "For statement ended unexpectedly");
+        return 0;
+    }
+
+    {
+        // We expect the first character of "A"
+        if(!isalpha(str[i]) && str[i] != '_') {
+            report(err, i, "Missing iteration variable name after [for] keyword");
+            return 0;
+        }
+
+        /* Start of "A" */
+        long key_var_off = i;
+
+        do 
+            i += 1;
+        while(i < len && (isalpha(str[i]) || isdigit(str[i]) || str[i] == '_'));
+
+        /* End of "A" */
+        long key_var_len = i - key_var_off;
+
+        if(iskword(str + key_var_off, key_var_len)) {
+            report(err, key_var_off, 
+                "Unexpected keyword [%.*s] where an iteration "
+                "variable name was expected",
+                (int) key_var_len, str + key_var_off);
+            return 0;
+        }
+
+        if(key_var_len > var_max-1) {
+            report(err, key_var_off, "Variable name [%.*s] is too long (the maximum is %d)", 
+                (int) key_var_len, str + key_var_off, var_max-1);
+            return 0;
+        }
+
+        *var1_off = key_var_off;
+        *var1_len = key_var_len;
+    }
+
+    // Skip spaces before "in" or ','
+    while(i < len && isspace(str[i]))
+        i += 1;
+
+    if(i == len) {
+        report(err, i, "For statement ended unexpectedly");
+        return 0;
+    }
+
+    // If now comes either the "in" keyword or
+    // ',' if "B" was also specified.
+    
+    if(str[i] == ',') {
+
+        i += 1; // Skip ','
+
+        // Skip spaces before "B"
+        while(i < len && isspace(str[i]))
+            i += 1;
+
+        if(i == len) {
+            report(err, i, "For statement ended unexpectedly");
+            return 0;
+        }
+
+        /* Start of "B" */
+
+        if(!isalpha(str[i]) && str[i] != '_') {
+            report(err, i, "Missing second iteration variable name after ','");
+            return 0;
+        }
+
+        long val_var_off = i;
+        do i += 1; while(i < len && (isalpha(str[i]) || isdigit(str[i]) 
+                                 || str[i] == '_'));
+        /* End of B */
+        long val_var_len = i - val_var_off;
+
+        if(iskword(str + val_var_off, val_var_len)) {
+            report(err, val_var_off, 
+                "Unexpected keyword [%.*s] where an iteration "
+                "variable name was expected",
+                (int) val_var_len, str + val_var_off);
+            return 0;
+        }
+
+        if(val_var_len > var_max-1) {
+            report(err, val_var_off, "Variable name [%.*s] is too long (the maximum is %d)", 
+                (int) val_var_len, str + val_var_off, var_max-1);
+            return 0;
+        }
+
+        *var2_off = val_var_off;
+        *var2_len = val_var_len;
+    } else {
+        // "B" wasn't specified, a zero length tells
+        // the caller it wasn't specified.
+        *var2_off = i;
+        *var2_len = 0;
+    }
+
+    {
+        // Now skip the spaces before the "in" keyword
+        while(i < len && isspace(str[i]))
+            i += 1;
+        
+        if(i == len) {
+            report(err, i, "For statement ended unexpectedly");
+            return 0;
+        }
+
+        // Now the "in" keyword is expected
+
+        if(!isalpha(str[i]) && str[i] != '_') {
+            report(err, i, "Missing [in] keyword after iteration variable name");
+            return 0;
+        }
+
+        long kword_off = i;
+        do
+            i += 1;
+        while(i < len && (isalpha(str[i]) || isdigit(str[i]) || str[i] == '_'));
+        long kword_len = i - kword_off;
+
+        assert(kword_len > 0);
+
+        if(kword_len != 2 || str[kword_off] != 'i' || str[kword_off+1] != 'n') {
+            report(err, i, "Missing [in] keyword after iteration variable name");
+            return 0;
+        }
+    }
+
+    *coll_off = i;
+    *coll_len = len - i;
+    return 1;
+}
+
+static bool parse_set_statement(const char *str, long len, 
+                                long *var_off, long *var_len, long var_max,
+                                long *expr_off, long *expr_len,
+                                XT_Error *err)
+{
+    /* [str] must contain a string in the form
+     *   A = E
+     *
+     * where A is a variable name and E is an 
+     * expression. Names follow the same rules of
+     * iteration variables.
+     */
+
+    long i = 0;
+
+    while(i < len && isspace(str[i]))
+        i += 1;
+
+    if(i == len) {
+        report(err, i, "Set statement ended unexpectedly");
+        return 0;
+    }
+
+    if(!isalpha(str[i]) && str[i] != '_') {
+        report(err, i, "Missing variable name after [set] keyword");
+        return 0;
+    }
+
+    long name_off = i;
+    do
+        i += 1;
+    while(i < len && (isalpha(str[i]) || isdigit(str[i]) || str[i] == '_'));
+    long name_len = i - name_off;
+
+    if(iskword(str + name_off, name_len)) {
+        report(err, name_off, 
+            "Unexpected keyword [%.*s] where a variable "
+            "name was expected",
+            (int) name_len, str + name_off);
+        return 0;
+    }
+
+    if(name_len > var_max-1) {
+        report(err, name_off, "Variable name [%.*s] is too long (the maximum is %d)", 
+            (int) name_len, str + name_off, var_max-1);
+        return 0;
+    }
+
+    while(i < len && isspace(str[i]))
+        i += 1;
+
+    if(i == len || str[i] != '=') {
+        report(err, i, "Missing [=] after variable name");
+        return 0;
+    }
+    i += 1; // Skip '='
+
+    *var_off = name_off;
+    *var_len = name_len;
+    *expr_off = i;
+    *expr_len = len - i;
+    return 1;
+}
+
+static long append_instr(XT_Template *tmpl, Instr instr)
+{
+    if(tmpl->code_count == tmpl->code_max_count) {
+
+        long new_max_count;
+        if(tmpl->code_max_count == 0)
+            new_max_count = 16;
+        else
+            new_max_count = 2 * tmpl->code_max_count;
+
+        void *temp = realloc(tmpl->code, new_max_count * sizeof(Instr));
+        if(temp == NULL)
+            return -1;
+
+        tmpl->code = temp;
+        tmpl->code_max_count = new_max_count;
+    }
+
+    long idx = tmpl->code_count++;
+    tmpl->code[idx] = instr;
+    return idx;
+}
+
+/* Tells whether the node is a [fmt], [join] or escaping
+ * filter, which write their result instead of returning 
+ * it.
+ */
+static bool writes_output(const Expr *expr)
+{
+    return expr->kind == EK_FMT || expr->kind == EK_ESCAPE
+        || (expr->kind == EK_CALL && expr->call.func == filter_join);
+}
+
+/* Gives a cache slot to the largest subtrees of the
+ * expression [idx] that don't depend on all of the
+ * [loops] enclosing loops. Constants and iteration
+ * variables are cheaper to evaluate than to look up
+ * in the cache, so they're left alone.
+ */
+static void hoist(XT_Template *tmpl, int idx, int loops)
+{
+    Expr *expr = &tmpl->nodes[idx];
+
+    if(expr->level < loops && expr->kind != EK_INT && expr->kind != EK_FLOAT 
+                           && expr->kind != EK_STRING && expr->kind != EK_LOCAL
+                           && !writes_output(expr)) {
+        expr->cache = tmpl->cache_count++;
+        return;
+    }
+
+    switch(expr->kind) {
+
+        case EK_BINARY:
+        hoist(tmpl, expr->binary.lhs, loops);
+        hoist(tmpl, expr->binary.rhs, loops);
+        break;
+
+        case EK_NOT:
+        hoist(tmpl, expr->operand, loops);
+        break;
+
+        case EK_FMT:
+        hoist(tmpl, expr->fmt.obj, loops);
+        break;
+
+        case EK_ESCAPE:
+        hoist(tmpl, expr->escape.obj, loops);
+        break;
+
+        case EK_ARRAY:
+        for(int item = expr->array.head; item >= 0; item = tmpl->nodes[item].next)
+            hoist(tmpl, item, loops);
+        break;
+
+        case EK_FIELD:
+        hoist(tmpl, expr->field.obj, loops);
+        break;
+
+        case EK_INDEX:
+        hoist(tmpl, expr->index.obj, loops);
+        hoist(tmpl, expr->index.key, loops);
+        break;
+
+        case EK_SLICE:
+        hoist(tmpl, expr->slice.obj, loops);
+        if(expr->slice.start >= 0)
+            hoist(tmpl, expr->slice.start, loops);
+        if(expr->slice.stop >= 0)
+            hoist(tmpl, expr->slice.stop, loops);
+        break;
+
+        case EK_CALL:
+        for(int arg = expr->call.head; arg >= 0; arg = tmpl->nodes[arg].next)
+            hoist(tmpl, arg, loops);
+        break;
+
+        default:break;
+    }
+}
+
+typedef struct {
+    SliceKind kind;
+    long      patch; // Instruction whose target is the end of the current branch
+    long       body; // First instruction of a loop body
+    int    bindings; // Binding count before the block was entered
+    int      locals; // Same for the slots of {% set .. %}
+} OpenBlock;
+
+/* Closes the innermost block in [open] by emitting its
+ * ending instruction (if any) and patching the jumps 
+ * that need to point after it.
+ */
+static bool close_block(CompileContext *ctx, OpenBlock *block, int depth, long off)
+{
+    XT_Template *tmpl = ctx->tmpl;
+
+    if(block->kind == SK_FOR || block->kind == SK_CACHE) {
+        Instr end = { .op = OP_NEXT, .depth = depth, .target = block->body };
+        if(block->kind == SK_CACHE)
+            end = (Instr) { .op = OP_ENDCACHE, .expr = -1, .target = -1 };
+        if(append_instr(tmpl, end) < 0) {
+            report(ctx->err, off, "Out of memory");
+            return 0;
+        }
+    }
+
+    // Names bound inside of the block go out of scope
+    ctx->binding_count = block->bindings;
+    ctx->local_count = block->locals;
+
+    tmpl->code[block->patch].target = tmpl->code_count;
+    return 1;
+}
+
+/* Returns the length of the name of the variable that
+ * node [expr] reads, or 0 if it doesn't read one. Calls
+ * bound to a function don't.
+ */
+static long read_len(const Expr *expr)
+{
+    if(expr->kind == EK_VAR)
+        return expr->var.len;
+    if(expr->kind == EK_CALL && expr->call.func == NULL)
+        return expr->call.len;
+    return 0;
+}
+
+/* Appends node [idx] to the [count] nodes of [reads],
+ * unless one of them reads the same name already, and
+ * returns the new count.
+ */
+static int add_read(XT_Template *tmpl, int *reads, int count, int idx)
+{
+    long len = read_len(&tmpl->nodes[idx]);
+    for(int k = 0; k < count; k += 1)
+        if(read_len(&tmpl->nodes[reads[k]]) == len 
+            && !strncmp(tmpl->src + tmpl->nodes[reads[k]].off, tmpl->src + tmpl->nodes[idx].off, len))
+            return count;
+    reads[count] = idx;
+    return count + 1;
+}
+
+/* Adds to [reads] the variables read by expression [idx] */
+static int collect_reads(XT_Template *tmpl, int idx, int *reads, int count)
+{
+    Expr *expr = &tmpl->nodes[idx];
+    if(read_len(expr) > 0)
+        count = add_read(tmpl, reads, count, idx);
+
+    switch(expr->kind) {
+
+        case EK_BINARY:
+        count = collect_reads(tmpl, expr->binary.lhs, reads, count);
+        count = collect_reads(tmpl, expr->binary.rhs, reads, count);
+        break;
+
+        case EK_NOT:
+        count = collect_reads(tmpl, expr->operand, reads, count);
+        break;
+
+        case EK_FMT:
+        count = collect_reads(tmpl, expr->fmt.obj, reads, count);
+        break;
+
+        case EK_ESCAPE:
+        count = collect_reads(tmpl, expr->escape.obj, reads, count);
+        break;
+
+        case EK_ARRAY:
+        for(int item = expr->array.head; item >= 0; item = tmpl->nodes[item].next)
+            count = collect_reads(tmpl, item, reads, count);
+        break;
+
+        case EK_FIELD:
+        count = collect_reads(tmpl, expr->field.obj, reads, count);
+        break;
+
+        case EK_INDEX:
+        count = collect_reads(tmpl, expr->index.obj, reads, count);
+        count = collect_reads(tmpl, expr->index.key, reads, count);
+        break;
+
+        case EK_SLICE:
+        count = collect_reads(tmpl, expr->slice.obj, reads, count);
+        if(expr->slice.start >= 0)
+            count = collect_reads(tmpl, expr->slice.start, reads, count);
+        if(expr->slice.stop >= 0)
+            count = collect_reads(tmpl, expr->slice.stop, reads, count);
+        break;
+
+        case EK_CALL:
+        for(int arg = expr->call.head; arg >= 0; arg = tmpl->nodes[arg].next)
+            count = collect_reads(tmpl, arg, reads, count);
+        break;
+
+        default:break;
+    }
+    return count;
+}
+
+/* Points each OP_SEGMENT of [tmpl] to the end of its
+ * segment and records the variables that the segment
+ * reads. Returns false if there's no memory.
+ */
+static bool index_segments(XT_Template *tmpl)
+{
+    int count = 0;
+    for(long pc = 0; pc < tmpl->code_count; pc += 1)
+        if(tmpl->code[pc].op == OP_SEGMENT)
+            count += 1;
+    if(count == 0)
+        return 1;
+
+    // Every node is in a single expression, so there 
+    // are at most as many reads as nodes.
+    tmpl->segs = malloc(count * sizeof(Segment));
+    tmpl->seg_reads = malloc((tmpl->node_count + 1) * sizeof(int));
+    if(tmpl->segs == NULL || tmpl->seg_reads == NULL)
+        return 0;
+    tmpl->seg_count = count;
+
+    int  total = 0;
+    long start = -1; // The OP_SEGMENT of the current segment
+    for(long pc = 0; pc < tmpl->code_count; pc += 1) {
+
+        Instr instr = tmpl->code[pc];
+        if(instr.op == OP_SEGMENT || instr.op == OP_HALT) {
+            if(start >= 0)
+                tmpl->code[start].target = pc;
+            if(instr.op == OP_SEGMENT)
+                tmpl->segs[instr.depth] = (Segment) { total, 0, false };
+            start = pc;
+            continue;
+        }
+        assert(start >= 0);
+
+        Segment *seg = &tmpl->segs[tmpl->code[start].depth];
+        if(instr.op == OP_SET)
+            seg->sets = true;
+        if(instr.op == OP_PRINT || instr.op == OP_BRANCH || 
+           instr.op == OP_FOR   || instr.op == OP_SET || instr.op == OP_CACHE) {
+            seg->read_count = collect_reads(tmpl, instr.expr, tmpl->seg_reads + seg->reads, seg->read_count);
+            total = seg->reads + seg->read_count;
+        }
+    }
+    return 1;
+}
+
+/* Translates the slice array into the instruction stream
+ * of [tmpl]. The structure of the blocks was already 
+ * validated by the slicer, but blocks may be left open
+ * at the end of the source, in which case they're 
+ * closed implicitly.
+ */
+static bool compile(XT_Template *tmpl, Slices *slices, int flags, XT_Error *err)
+{
+    // Only the first [binding_count] bindings are ever
+    // read, so the array isn't cleared.
+    CompileContext ctx;
+    ctx.err = err;
+    ctx.tmpl = tmpl;
+    ctx.str = tmpl->src;
+    ctx.i = 0;
+    ctx.len = 0;
+    ctx.binding_count = 0;
+    ctx.local_count = 0;
+
+    OpenBlock open[MAX_DEPTH];
+    int depth = 0; // Number of open blocks
+    int loops = 0; // Number of open {% for .. %} blocks
+    int caches = 0; // Number of {% cache .. %} blocks so far
+    int segments = 0;
+
+    for(long k = 0; k < slices->count; k += 1) {
+
+        Slice slice = slices->list[k];
+        Instr instr = { .expr = -1, .target = -1, .off = slice.off, .len = slice.len };
+
+        // Top-level blocks start a segment. Its end is
+        // set by [index_segments].
+        if((flags & XT_SEGMENTS) && depth == 0) {
+            Instr seg = { .op = OP_SEGMENT, .expr = -1, .depth = segments++, .target = -1, .off = slice.off };
+            if(append_instr(tmpl, seg) < 0) {
+                report(err, (slice.off > tmpl->len) ? -1 : slice.off, "Out of memory");
+                return 0;
+            }
+        }
+
+        switch(slice.kind) {
+
+            case SK_TEXT:
+            instr.op = OP_TEXT;
+            break;
+
+            case SK_EXPR:
+            instr.op = OP_PRINT;
+            instr.expr = parse_expr(&ctx, slice.off, slice.len);
+            if(instr.expr < 0)
+                return 0;
+            hoist(tmpl, instr.expr, loops);
+            break;
+
+            case SK_IF:
+            instr.op = OP_BRANCH;
+            instr.expr = parse_expr(&ctx, slice.off, slice.len);
+            if(instr.expr < 0)
+                return 0;
+            hoist(tmpl, instr.expr, loops);
+            assert(depth < MAX_DEPTH);
+            open[depth++] = (OpenBlock) { SK_IF, tmpl->code_count, -1, ctx.binding_count, ctx.local_count };
+            break;
+
+            case SK_ELSE:
+            {
+                assert(depth > 0 && open[depth-1].kind == SK_IF);
+                instr.op = OP_JUMP;
+                long jump = append_instr(tmpl, instr);
+                if(jump < 0) {
+                    report(err, slice.off, "Out of memory");
+                    return 0;
+                }
+                tmpl->code[open[depth-1].patch].target = tmpl->code_count;
+                open[depth-1].patch = jump;
+
+                // Names set in the first branch aren't visible
+                // in the second.
+                ctx.binding_count = open[depth-1].bindings;
+                ctx.local_count = open[depth-1].locals;
+                continue;
+            }
+
+            case SK_FOR:
+            {
+                long var1_off, var1_len;
+                long var2_off, var2_len;
+                long coll_off, coll_len;
+                if(!parse_for_statement(tmpl->src + slice.off, slice.len, 
+                                        &var1_off, &var1_len, 
+                                        &var2_off, &var2_len, 32,
+                                        &coll_off, &coll_len, err)) {
+                    if(err && err->off >= 0)
+                        err->off += slice.off;
+                    return 0;
+                }
+
+                // Note that the offsets returned by [parse_for_statement]
+                // are relative to the for statement body, not the start
+                // of the source string.
+                instr.op = OP_FOR;
+                instr.depth = loops;
+                instr.expr = parse_expr(&ctx, slice.off + coll_off, coll_len);
+                if(instr.expr < 0)
+                    return 0;
+                hoist(tmpl, instr.expr, loops);
+
+                // The iteration variables are bound after the
+                // collection expression was compiled, since
+                // it's evaluated outside of the loop.
+                //
+                // When only one name is specified it's bound
+                // to the index of the item.
+                int bindings = ctx.binding_count;
+                ctx.bindings[ctx.binding_count++] = (Binding) { tmpl->src + slice.off + var1_off, var1_len, 2 * loops, loops + 1 };
+                if(var2_len > 0)
+                    ctx.bindings[ctx.binding_count++] = (Binding) { tmpl->src + slice.off + var2_off, var2_len, 2 * loops + 1, loops + 1 };
+
+                assert(depth < MAX_DEPTH);
+                open[depth++] = (OpenBlock) { SK_FOR, tmpl->code_count, tmpl->code_count + 1, bindings, ctx.local_count };
+                loops += 1;
+                break;
+            }
+
+            case SK_SET:
+            {
+                long var_off, var_len;
+                long expr_off, expr_len;
+                if(!parse_set_statement(tmpl->src + slice.off, slice.len, 
+                                        &var_off, &var_len, 32,
+                                        &expr_off, &expr_len, err)) {
+                    if(err && err->off >= 0)
+                        err->off += slice.off;
+                    return 0;
+                }
+
+                instr.op = OP_SET;
+                instr.expr = parse_expr(&ctx, slice.off + expr_off, expr_len);
+                if(instr.expr < 0)
+                    return 0;
+                hoist(tmpl, instr.expr, loops);
+
+                // Like iteration variables, the name is bound after
+                // the expression was compiled, so [set x = x + 1] 
+                // reads the previous [x]. Setting a name that was
+                // set by the same block reuses its slot, otherwise
+                // the new variable shadows the other ones until the
+                // end of the block.
+                const char *name = tmpl->src + slice.off + var_off;
+                int first = (depth > 0) ? open[depth-1].bindings : 0;
+                int slot = -1;
+                for(int j = ctx.binding_count-1; slot < 0 && j >= first; j -= 1) {
+                    Binding *b = &ctx.bindings[j];
+                    if(b->slot >= 2 * MAX_DEPTH && b->len == var_len && !strncmp(b->name, name, var_len))
+                        slot = b->slot;
+                }
+
+                if(slot < 0) {
+                    if(ctx.local_count == MAX_LOCALS) {
+                        report(err, slice.off + var_off, "Too many {%% set .. %%} variables in scope (the maximum is %d)", MAX_LOCALS);
+                        return 0;
+                    }
+                    slot = 2 * MAX_DEPTH + ctx.local_count++;
+                    if(tmpl->local_count < ctx.local_count)
+                        tmpl->local_count = ctx.local_count;
+                    ctx.bindings[ctx.binding_count++] = (Binding) { name, var_len, slot, loops };
+                }
+                instr.depth = slot;
+                break;
+            }
+
+            case SK_CACHE:
+            instr.op = OP_CACHE;
+            instr.depth = caches++;
+            instr.expr = parse_expr(&ctx, slice.off, slice.len);
+            if(instr.expr < 0)
+                return 0;
+            hoist(tmpl, instr.expr, loops);
+            assert(depth < MAX_DEPTH);
+            open[depth++] = (OpenBlock) { SK_CACHE, tmpl->code_count, -1, ctx.binding_count, ctx.local_count };
+            break;
+
+            case SK_ENDIF:
+            case SK_ENDFOR:
+            case SK_ENDCACHE:
+            assert(depth > 0);
+            depth -= 1;
+            if(open[depth].kind == SK_FOR)
+                loops -= 1;
+            if(!close_block(&ctx, &open[depth], loops, slice.off))
+                return 0;
+            continue;
+
+            case SK_END:
+            /* Unreachable */
+            assert(0);
+            break;
+        }
+
+        if(append_instr(tmpl, instr) < 0) {
+            // Minified text isn't in the source
+            report(err, (slice.off > tmpl->len) ? -1 : slice.off, "Out of memory");
+            return 0;
+        }
+    }
+
+    while(depth > 0) {
+        depth -= 1;
+        if(open[depth].kind == SK_FOR)
+            loops -= 1;
+        if(!close_block(&ctx, &open[depth], loops, tmpl->len))
+            return 0;
+    }
+
+    if(append_instr(tmpl, (Instr) { .op = OP_HALT }) < 0 || !index_segments(tmpl)) {
+        report(err, tmpl->len, "Out of memory");
+        return 0;
+    }
+    return 1;
+}
+
+static Value eval(RenderContext *ctx, int idx);
+
+/* Evaluates the arguments of call [expr] into [args]
+ * and returns their count, or -1 on failure.
+ */
+static int eval_args(RenderContext *ctx, const Expr *expr, Value *args)
+{
+    int argc = 0;
+    for(int arg = expr->call.head; arg >= 0; arg = ctx->tmpl->nodes[arg].next) {
+        args[argc] = eval(ctx, arg);
+        if(args[argc].kind == VK_ERROR) {
+            while(argc > 0)
+                value_free(&args[--argc]);
+            return -1;
+        }
+        argc += 1;
+    }
+    return argc;
+}
+
+/* Reports the error [errmsg] of a host function or 
+ * resolver followed by the [name] it was reached by.
+ * Allocation failures are reported as usual.
+ */
+static void report_host_error(XT_Error *err, long off, const char *errmsg, const char *name, int len)
+{
+    if(!strcmp(errmsg, "Out of memory"))
+        report(err, off, "%s", errmsg);
+    else
+        report(err, off, "%s [%.*s]", errmsg, len, name);
+}
+
+/* Evaluates the expression rooted at node [idx]. If an
+ * error occurres, then a value of type [VK_ERROR] is 
+ * returned and the error is reported through [ctx->err].
+ */
+static Value eval_node(RenderContext *ctx, int idx)
+{
+    const Expr *expr = &ctx->tmpl->nodes[idx];
+
+    switch(expr->kind) {
+
+        case EK_INT:
+        return (Value) { VK_INT, .as_int = expr->as_int };
+
+        case EK_FLOAT:
+        return (Value) { VK_FLOAT, .as_float = expr->as_float };
+
+        case EK_STRING:
+        return (Value) { VK_STRING, expr->str.len, .as_str = ctx->tmpl->src + expr->off + 1 };
+
+        case EK_LOCAL:
+        return value_retain(ctx->slots[expr->slot]);
+
+        case EK_VAR:
+        {
+            const char *name = ctx->tmpl->src + expr->off;
+            long        len  = expr->var.len;
+
+            Value found;
+            if(!find_var(ctx->vars, name, len, &found, ctx->memo)) {
+                report(ctx->err, expr->off, 
+                    "Undefined variable [%.*s]", 
+                    (int) len, name);
+                return (Value) {VK_ERROR};
+            }
+
+            if(found.kind == VK_ERROR) {
+                report_host_error(ctx->err, expr->off, found.as_str, name, len);
+                return found;
+            }
+
+            return value_retain(found);
+        }
+
+        case EK_ARRAY:
+        {
+            const char *errmsg;
+
+            Value array = array_new();
+            for(int item = expr->array.head; item >= 0; item = ctx->tmpl->nodes[item].next) {
+
+                Value val = eval(ctx, item);
+                if(val.kind == VK_ERROR) {
+                    value_free(&array);
+                    return val;
+                }
+
+                if(!array_append(&array, val, &errmsg)) {
+                    report(ctx->err, ctx->tmpl->nodes[item].off, "%s", errmsg);
+                    value_free(&val);
+                    value_free(&array);
+                    return (Value) {VK_ERROR};
+                }
+            }
+            return array;
+        }
+
+        case EK_BINARY:
+        {
+            Value lhs = eval(ctx, expr->binary.lhs);
+            if(lhs.kind == VK_ERROR)
+                return lhs;
+
+            OperatID op = expr->binary.op;
+            if(op == OID_AND || op == OID_OR) {
+                if(is_truthy(lhs) == (op == OID_OR))
+                    return lhs;
+                value_free(&lhs);
+                return eval(ctx, expr->binary.rhs);
+            }
+
+            Value rhs = eval(ctx, expr->binary.rhs);
+            if(rhs.kind == VK_ERROR) {
+                value_free(&lhs);
+                return rhs;
+            }
+
+            const char *errmsg;
+            Value res = apply(expr->binary.op, lhs, rhs, &errmsg);
+            if(res.kind == VK_ERROR)
+                report(ctx->err, expr->off, "%s", errmsg);
+            value_free(&lhs);
+            value_free(&rhs);
+            return res;
+        }
+
+        case EK_NOT:
+        {
+            Value operand = eval(ctx, expr->operand);
+            if(operand.kind == VK_ERROR)
+                return operand;
+
+            Value res = { VK_INT, .as_int = !is_truthy(operand) };
+            value_free(&operand);
+            return res;
+        }
+
+        case EK_FMT:
+        report(ctx->err, expr->off, "Can only be printed [fmt]");
+        return (Value) {VK_ERROR};
+
+        case EK_ESCAPE:
+        report(ctx->err, expr->off, "Can only be printed [%.*s]", expr->escape.len, ctx->tmpl->src + expr->off);
+        return (Value) {VK_ERROR};
+
+        case EK_FIELD:
+        {
+            Value obj = eval(ctx, expr->field.obj);
+            if(obj.kind == VK_ERROR)
+                return obj;
+
+            const char *name = ctx->tmpl->src + expr->off;
+            const char *errmsg;
+            Value res;
+            if(!map_lookup(obj, name, expr->field.len, expr->field.hash, &res, &errmsg)) {
+                report(ctx->err, expr->off, "%s [%.*s]", errmsg, expr->field.len, name);
+                value_free(&obj);
+                return (Value) {VK_ERROR};
+            }
+
+            // Take a reference before the map may be freed
+            res = value_retain(res);
+            value_free(&obj);
+            return res;
+        }
+
+        case EK_INDEX:
+        {
+            Value obj = eval(ctx, expr->index.obj);
+            if(obj.kind == VK_ERROR)
+                return obj;
+
+            Value key = eval(ctx, expr->index.key);
+            if(key.kind == VK_ERROR) {
+                value_free(&obj);
+                return key;
+            }
+
+            const char *errmsg;
+            Value res;
+            if(!index_value(obj, key, &res, &errmsg)) {
+                report(ctx->err, expr->off, "%s", errmsg);
+                res = (Value) {VK_ERROR};
+            } else
+                res = value_retain(res);
+            value_free(&obj);
+            value_free(&key);
+            return res;
+        }
+
+        case EK_SLICE:
+        {
+            Value obj = eval(ctx, expr->slice.obj);
+            if(obj.kind == VK_ERROR)
+                return obj;
+
+            Value start = { VK_INT, .as_int = 0 };
+            if(expr->slice.start >= 0)
+                start = eval(ctx, expr->slice.start);
+
+            Value stop = { VK_INT, .as_int = LLONG_MAX };
+            if(expr->slice.stop >= 0 && start.kind != VK_ERROR)
+                stop = eval(ctx, expr->slice.stop);
+
+            const char *errmsg;
+            Value res = { VK_ERROR };
+            if(start.kind != VK_ERROR && stop.kind != VK_ERROR
+                && !array_slice(obj, start, stop, &res, &errmsg))
+                report(ctx->err, expr->off, "%s", errmsg);
+            value_free(&obj);
+            value_free(&start);
+            value_free(&stop);
+            return res;
+        }
+
+        case EK_CALL:
+        {
+            const char *name = ctx->tmpl->src + expr->off;
+            const char *errmsg = NULL;
+
+            FuncValue func = expr->call.func;
+            if(func == NULL) {
+                Value found;
+                bool defined = find_var(ctx->vars, name, expr->call.len, &found, ctx->memo);
+                if(defined && found.kind == VK_ERROR) {
+                    report_host_error(ctx->err, expr->off, found.as_str, name, expr->call.len);
+                    return (Value) {VK_ERROR};
+                }
+                if(!defined || found.kind != VK_FUNC) {
+                    report(ctx->err, expr->off, "%s [%.*s]", defined ? "Not a function" : "Undefined function", 
+                           expr->call.len, name);
+                    return (Value) {VK_ERROR};
+                }
+                func = found.as_func;
+            }
+
+            Value args[MAX_ARGS];
+            int argc = eval_args(ctx, expr, args);
+            if(argc < 0)
+                return (Value) {VK_ERROR};
+
+            Value res;
+            if(func(args, argc, &res, &errmsg) && res.kind != VK_ERROR) {
+                // When the result is one of the arguments, the
+                // reference to the argument is moved to it.
+                for(int k = 0; k < argc; k += 1)
+                    if(same_object(args[k], res)) {
+                        args[k] = (Value) { VK_INT, .as_int = 0 };
+                        break;
+                    }
+            } else {
+                report_host_error(ctx->err, expr->off, errmsg ? errmsg : "Call failed", name, expr->call.len);
+                res = (Value) {VK_ERROR};
+            }
+            while(argc > 0)
+                value_free(&args[--argc]);
+            return res;
+        }
+    }
+
+    /* Unreachable */
+    assert(0);
+    return (Value) {VK_ERROR};
+}
+
+/* Like [eval_node], but values of nodes with a cache 
+ * slot are reused until loop number [level] is entered
+ * again. The cache holds a reference to the value it
+ * stores, which is dropped when it's replaced or at 
+ * the end of the render. Iterators are never cached,
+ * since they're consumed by the loops over them.
+ */
+static Value eval(RenderContext *ctx, int idx)
+{
+    const Expr *expr = &ctx->tmpl->nodes[idx];
+    if(expr->cache < 0)
+        return eval_node(ctx, idx);
+
+    CacheSlot *slot = &ctx->cache[expr->cache];
+    long stamp = ctx->frames[expr->level].entry;
+    if(slot->stamp == stamp)
+        return value_retain(slot->val);
+
+    Value val = eval_node(ctx, idx);
+    if(val.kind != VK_ERROR && val.kind != VK_ITER) {
+        if(slot->stamp != 0)
+            value_free(&slot->val);
+        slot->stamp = stamp;
+        slot->val = value_retain(val);
+    }
+    return val;
+}
+
+/* Prints the expression [idx] of a {{ .. }} block,
+ * escaped with the mode of the template unless an
+ * escaping filter at its root says otherwise.
+ */
+static bool print_expr(RenderContext *ctx, int idx)
+{
+    XT_Escape mode = ctx->tmpl->escape;
+    const Expr *expr = &ctx->tmpl->nodes[idx];
+    if(expr->kind == EK_ESCAPE) {
+        mode = expr->escape.mode;
+        idx  = expr->escape.obj;
+        expr = &ctx->tmpl->nodes[idx];
+    }
+
+    Emitter e;
+    emit_init(&e, ctx->callback, ctx->userp, mode);
+
+    if(!writes_output(expr) || expr->kind == EK_ESCAPE) {
+        Value val = eval(ctx, idx);
+        if(val.kind == VK_ERROR)
+            return 0;
+        if(mode == XT_ESCAPE_NONE)
+            value_print(val, ctx->callback, ctx->userp);
+        else {
+            emit_value(&e, val);
+            emit_flush(&e);
+        }
+        value_free(&val);
+        return 1;
+    }
+
+    Value args[MAX_ARGS];
+    int argc;
+    if(expr->kind == EK_FMT) {
+        args[0] = eval(ctx, expr->fmt.obj);
+        argc = (args[0].kind == VK_ERROR) ? -1 : 1;
+    } else
+        argc = eval_args(ctx, expr, args);
+    if(argc < 0)
+        return 0;
+
+    const char *errmsg = NULL;
+    bool ok;
+    if(expr->kind == EK_FMT)
+        ok = emit_fmt(&e, args[0], &expr->fmt.spec, &errmsg);
+    else
+        ok = print_join(&e, args, argc, &errmsg);
+    emit_flush(&e);
+
+    while(argc > 0)
+        value_free(&args[--argc]);
+
+    if(!ok) {
+        const char *name = ctx->tmpl->src + expr->off;
+        report_host_error(ctx->err, expr->off, errmsg, name, (expr->kind == EK_FMT) ? 3 : expr->call.len);
+        return 0;
+    }
+    return 1;
+}
+
+/* Appends [len] bytes to the capture [c], or marks it 
+ * as failed if there's no memory for them.
+ */
+static void capture_write(Capture *c, const char *str, long len)
+{
+    if(c->failed)
+        return;
+
+    if(len > c->size - c->used) {
+        long size = (c->size > 0) ? 2 * c->size : 256;
+        while(size - c->used < len)
+            size *= 2;
+        char *data = realloc(c->data, size);
+        if(data == NULL) {
+            c->failed = true;
+            return;
+        }
+        c->data = data;
+        c->size = size;
+    }
+    memcpy(c->data + c->used, str, len);
+    c->used += len;
+}
+
+static void capture_append(const char *str, long len, void *userp)
+{
+    capture_write(userp, str, len);
+}
+
+/* Callback of the renders while a capture is active */
+static void capture_output(const char *str, long len, void *userp)
+{
+    Capture *c = userp;
+    c->callback(str, len, c->userp);
+    capture_write(c, str, len);
+}
+
+/* Appends to [c] an encoding of [val] that's equal for
+ * two values only if they print and iterate the same
+ * way. Returns false for iterators, which can't be 
+ * inspected without consuming them.
+ */
+static bool memo_key(Capture *c, Value val)
+{
+    char tag = "eifasmpt"[val.kind];
+    capture_write(c, &tag, 1);
+    switch(val.kind) {
+        case VK_ERROR: break;
+        case VK_INT  : capture_write(c, (char*) &val.as_int,   sizeof(val.as_int));   break;
+        case VK_FLOAT: capture_write(c, (char*) &val.as_float, sizeof(val.as_float)); break;
+        case VK_FUNC : capture_write(c, (char*) &val.as_func,  sizeof(val.as_func));  break;
+        case VK_ITER : return false;
+
+        case VK_STRING:
+        capture_write(c, (char*) &val.str_len, sizeof(val.str_len));
+        capture_write(c, val.as_str, val.str_len);
+        break;
+
+        case VK_ARRAY:
+        capture_write(c, (char*) &val.as_array->count, sizeof(int));
+        for(int k = 0; k < val.as_array->count; k += 1)
+            if(!memo_key(c, xt_array_get(val.as_array, k)))
+                return false;
+        break;
+
+        case VK_MAP:
+        capture_write(c, (char*) &val.as_map->count, sizeof(int));
+        for(int k = 0; k < val.as_map->capacity; k += 1) {
+            MapEntry *entry = &val.as_map->entries[k];
+            if(entry->key == NULL)
+                continue;
+            capture_write(c, (char*) &entry->key_len, sizeof(int));
+            capture_write(c, entry->key, entry->key_len);
+            if(!memo_key(c, entry->value))
+                return false;
+        }
+        break;
+    }
+    return true;
+}
+
+/* Starts the {% cache %} block of [instr] by writing its
+ * cached output, in which case it returns true, or by
+ * capturing the output of its body. Without a cache, 
+ * the body is rendered as usual.
+ */
+static bool begin_cache(RenderContext *ctx, Instr instr, Value key)
+{
+    XT_Cache *frags = ctx->tmpl->frags;
+    Capture *c = &ctx->captures[ctx->capture_count];
+    *c = (Capture) { ctx->callback, ctx->userp, .failed = (frags == NULL) };
+
+    if(frags) {
+
+        // The key is the id of the template, the number
+        // of the block and the encoded value. Blocks with
+        // keys that can't be encoded aren't cached.
+        char prefix[64];
+        int n = snprintf(prefix, sizeof(prefix), "%lx:%d:", ctx->tmpl->id, instr.depth);
+        capture_write(c, prefix, n);
+        if(!memo_key(c, key))
+            c->failed = true;
+        c->keylen = c->used;
+
+        const char *data;
+        long len;
+        if(!c->failed && frags->get(frags, c->data, c->keylen, &data, &len)) {
+            ctx->callback(data, len, ctx->userp);
+            free(c->data);
+            return true;
+        }
+
+        ctx->callback = capture_output;
+        ctx->userp = c;
+    }
+    ctx->capture_count += 1;
+    return false;
+}
+
+/* Ends the innermost {% cache %} block by storing the
+ * output of its body.
+ */
+static void end_cache(RenderContext *ctx)
+{
+    XT_Cache *frags = ctx->tmpl->frags;
+    Capture *c = &ctx->captures[--ctx->capture_count];
+    if(frags) {
+        ctx->callback = c->callback;
+        ctx->userp = c->userp;
+        if(!c->failed)
+            frags->put(frags, c->data, c->keylen, c->data + c->keylen, c->used - c->keylen);
+    }
+    free(c->data);
+}
+
+/* Builds in [c] the key of a render of [ctx->tmpl] from 
+ * the values of the variables it reads, and looks up 
+ * its output. On a hit, the output is written and true
+ * is returned. Otherwise, if [c] didn't fail, the output
+ * of the render should be captured and stored.
+ */
+static bool begin_memo(RenderContext *ctx, Capture *c)
+{
+    XT_Template *tmpl = ctx->tmpl;
+    char prefix[64];
+    int n = snprintf(prefix, sizeof(prefix), "%lx:r:", tmpl->id);
+    capture_write(c, prefix, n);
+
+    for(int k = 0; k < tmpl->read_count; k += 1) {
+        Expr *expr = &tmpl->nodes[tmpl->reads[k]];
+        long len = read_len(expr);
+        if(len == 0)
+            continue; // Bound with [xt_bind]
+
+        // The values are looked up through the memo of
+        // the render, so resolvers aren't called again.
+        Value val;
+        if(!find_var(ctx->vars, tmpl->src + expr->off, len, &val, ctx->memo))
+            val = (Value) {VK_ERROR};
+        if(!memo_key(c, val)) {
+            c->failed = true;
+            return false;
+        }
+    }
+    c->keylen = c->used;
+
+    const char *data;
+    long len;
+    XT_Cache *renders = tmpl->renders;
+    if(!c->failed && renders->get(renders, c->data, c->keylen, &data, &len)) {
+        ctx->callback(data, len, ctx->userp);
+        return true;
+    }
+    return false;
+}
+
+static void discard(const char *str, long len, void *userp)
+{
+    (void) str;
+    (void) len;
+    (void) userp;
+}
+
+/* Starts the segment of [instr], which is at [pc], and
+ * returns the instruction to continue from. Segments
+ * that aren't rendered are skipped, unless they set 
+ * variables for the ones after them, in which case 
+ * they run without output.
+ */
+static long begin_segment(RenderContext *ctx, Instr instr, long pc)
+{
+    if(ctx->segments == NULL)
+        return pc + 1;
+
+    int i = instr.depth;
+    if(ctx->dirty == NULL || ctx->dirty[i]) {
+        ctx->callback = capture_append;
+        ctx->userp = &ctx->segments[i];
+        return pc + 1;
+    }
+    if(ctx->tmpl->segs[i].sets) {
+        ctx->callback = discard;
+        ctx->userp = NULL;
+        return pc + 1;
+    }
+    return instr.target;
+}
+
+#if defined(__GNUC__) && !defined(XT_NO_COMPUTED_GOTO)
+#define XT_COMPUTED_GOTO 1
+#else
+#define XT_COMPUTED_GOTO 0
+#endif
+
+/* Executes the instruction stream of [ctx->tmpl]. Every
+ * handler ends by dispatching the next instruction on
+ * its own, which with computed goto gives each opcode
+ * a separate indirect branch to predict. Without it,
+ * [DISPATCH] goes back to a single switch.
+ */
+static bool run(RenderContext *ctx)
+{
+    const Instr *code = ctx->tmpl->code;
+    const char  *src  = ctx->tmpl->src;
+    long pc = 0;
+
+#if XT_COMPUTED_GOTO
+    static void *const labels[] = {
+        [OP_TEXT]     = &&do_text,
+        [OP_PRINT]    = &&do_print,
+        [OP_BRANCH]   = &&do_branch,
+        [OP_JUMP]     = &&do_jump,
+        [OP_FOR]      = &&do_for,
+        [OP_NEXT]     = &&do_next,
+        [OP_SET]      = &&do_set,
+        [OP_CACHE]    = &&do_cache,
+        [OP_ENDCACHE] = &&do_endcache,
+        [OP_SEGMENT]  = &&do_segment,
+        [OP_HALT]     = &&do_halt,
+    };
+    #define DISPATCH() goto *labels[code[pc].op]
+#else
+    #define DISPATCH() goto dispatch
+dispatch:
+    switch(code[pc].op) {
+        case OP_TEXT    : goto do_text;
+        case OP_PRINT   : goto do_print;
+        case OP_BRANCH  : goto do_branch;
+        case OP_JUMP    : goto do_jump;
+        case OP_FOR     : goto do_for;
+        case OP_NEXT    : goto do_next;
+        case OP_SET     : goto do_set;
+        case OP_CACHE   : goto do_cache;
+        case OP_ENDCACHE: goto do_endcache;
+        case OP_SEGMENT : goto do_segment;
+        case OP_HALT    : goto do_halt;
+    }
+#endif
+
+    DISPATCH();
+
+do_text:
+    ctx->callback(src + code[pc].off, code[pc].len, ctx->userp);
+    pc += 1;
+    DISPATCH();
+
+do_print:
+    if(!print_expr(ctx, code[pc].expr))
+        goto failed;
+    pc += 1;
+    DISPATCH();
+
+do_branch:
+    {
+        Value r = eval(ctx, code[pc].expr);
+        if(r.kind == VK_ERROR)
+            goto failed;
+
+        bool taken = is_truthy(r);
+        value_free(&r);
+
+        if(!taken)
+            pc = code[pc].target;
+        else
+            pc += 1;
+        DISPATCH();
+    }
+
+do_jump:
+    pc = code[pc].target;
+    DISPATCH();
+
+do_for:
+    {
+        int depth = code[pc].depth;
+        assert(depth == ctx->depth);
+
+        Value collection = eval(ctx, code[pc].expr);
+        if(collection.kind == VK_ERROR)
+            goto failed;
+
+        if(collection.kind != VK_ARRAY && collection.kind != VK_ITER) {
+            report(ctx->err, ctx->tmpl->nodes[code[pc].expr].off, 
+                   "Iteration subject isn't an array or an iterator");
+            value_free(&collection);
+            goto failed;
+        }
+
+        Value item;
+        if(!coll_next(collection, 0, &item)) {
+            value_free(&collection);
+            pc = code[pc].target;
+            DISPATCH();
+        }
+
+        ctx->frames[depth] = (LoopFrame) { collection, 0, ++ctx->entries };
+        ctx->slots[2 * depth + 0] = (Value) { VK_INT, .as_int = 0 };
+        ctx->slots[2 * depth + 1] = item;
+        ctx->depth = depth + 1;
+        pc += 1;
+        DISPATCH();
+    }
+
+do_next:
+    {
+        int depth = code[pc].depth;
+        assert(depth == ctx->depth-1);
+
+        LoopFrame *frame = &ctx->frames[depth];
+        frame->idx += 1;
+
+        Value item;
+        if(coll_next(frame->coll, frame->idx, &item)) {
+            ctx->slots[2 * depth + 0].as_int = frame->idx;
+            ctx->slots[2 * depth + 1] = item;
+            pc = code[pc].target;
+            DISPATCH();
+        }
+
+        value_free(&frame->coll);
+        ctx->depth = depth;
+        pc += 1;
+        DISPATCH();
+    }
+
+do_set:
+    {
+        Value val = eval(ctx, code[pc].expr);
+        if(val.kind == VK_ERROR)
+            goto failed;
+        value_free(&ctx->slots[code[pc].depth]);
+        ctx->slots[code[pc].depth] = val;
+        pc += 1;
+        DISPATCH();
+    }
+
+do_cache:
+    {
+        Value key = eval(ctx, code[pc].expr);
+        if(key.kind == VK_ERROR)
+            goto failed;
+        bool hit = begin_cache(ctx, code[pc], key);
+        value_free(&key);
+        pc = hit ? code[pc].target : pc + 1;
+        DISPATCH();
+    }
+
+do_endcache:
+    end_cache(ctx);
+    pc += 1;
+    DISPATCH();
+
+do_segment:
+    pc = begin_segment(ctx, code[pc], pc);
+    DISPATCH();
+
+do_halt:
+    assert(ctx->depth == 0 && ctx->capture_count == 0);
+    return 1;
+
+    #undef DISPATCH
+
+failed:
+    assert(ctx->err == NULL || ctx->err->occurred == true);
+    while(ctx->depth > 0)
+        value_free(&ctx->frames[--ctx->depth].coll);
+    while(ctx->capture_count > 0)
+        free(ctx->captures[--ctx->capture_count].data);
+    return 0;
+}
+
+/* Appends [slice] to the list, which is moved to the
+ * heap when it outgrows the [small] one of the caller.
+ */
+static bool append_slice(Slices **slices, Slices *small, Slice slice)
+{
+    Slices *slices2 = *slices;
+
+    if(slices2->count == slices2->max_count) {
+        
+        assert(slices2->max_count > 0);
+
+        int new_max_count = 2 * slices2->max_count;
+
+        void *temp;
+        if(slices2 == small) {
+            temp = malloc(sizeof(Slices) + new_max_count * sizeof(Slice));
+            if(temp != NULL)
+                memcpy(temp, small, sizeof(Slices) + small->count * sizeof(Slice));
+        } else
+            temp = realloc(*slices, sizeof(Slices) + new_max_count * sizeof(Slice));
+        if(temp == NULL)
+            return 0;
+
+        slices2 = temp;
+        slices2->max_count = new_max_count;
+        *slices = slices2;
+    }
+
+    slices2->list[slices2->count++] = slice;
+    return 1;
+}
+
+/* Splits the source into slices, starting from the
+ * [small] list of the caller. Returns the list, which
+ * must be freed if it's not [small], or NULL if the
+ * source is malformed or there's no memory.
+ */
+static Slices *slice_up(const char *tmpl, long len, Slices *small, XT_Error *err)
+{
+    #define SKIP_SPACES()                \
+        while(i < len && (tmpl[i] == ' ' \
+            || tmpl[i] == '\t'           \
+            || tmpl[i] == '\n'))         \
+            i += 1;
+
+    // String literals inside of blocks are skipped 
+    // as a whole, so they can contain "}}" and "%}".
+    #define SKIP_UNTIL_2(X, Y)                        \
+        while(i < len                                 \
+            && (i+1 > len                             \
+            || tmpl[i] != (X)                         \
+            || tmpl[i+1] != (Y))) {                   \
+            if(tmpl[i] == '"' || tmpl[i] == '\'') {   \
+                char quote = tmpl[i++];               \
+                while(i < len && tmpl[i] != quote)    \
+                    i += 1;                           \
+                if(i == len)                          \
+                    break;                            \
+            }                                         \
+            i += 1;                                   \
+        }
+
+    Slices *slices = small;
+    slices->count = 0;
+
+    SliceKind context[MAX_DEPTH];
+    bool     has_else[MAX_DEPTH];
+    int depth = 0, i = 0;
+    bool trim = false;
+    while(1) {
+
+        // A block ending with "-%}" or "-}}" trims the
+        // whitespace that follows it.
+        if(trim)
+            while(i < len && isspace((unsigned char) tmpl[i]))
+                i += 1;
+
+        // Slice the raw text before the next {{ .. }}, {% .. %} or,
+        // end of the string, then append it to the slice list.
+        Slice text;
+        text.kind = SK_TEXT;
+        text.off = i;
+        while(i < len) {
+            const char *brace = memchr(tmpl + i, '{', len - i);
+            if(brace == NULL) {
+                i = len;
+                break;
+            }
+            i = brace - tmpl;
+            if(i+1 < len && (tmpl[i+1] == '%' || tmpl[i+1] == '{'))
+                break;
+            i += 1;
+        }
+        text.len = i - text.off;
+
+        // While one starting with "{%-" or "{{-" trims
+        // the whitespace that precedes it.
+        if(i+2 < len && tmpl[i+2] == '-')
+            while(text.len > 0 && isspace((unsigned char) tmpl[text.off + text.len - 1]))
+                text.len -= 1;
+        
+        if(text.len > 0)
+            if(!append_slice(&slices, small, text)) {
+                report(err, i, "Out of memory");
+                goto failed;
+            }
+
+        // Did the source end?
+        if(i == len)
+            break;
+
+        // Now handle either the {{ .. }} or {% .. %}
+
+        assert(tmpl[i] == '{' && (tmpl[i+1] == '%' || tmpl[i+1] == '{'));
+        i += 2; // Skip the "{%" or "{{"
+
+        Slice slice;
+        if(tmpl[i-1] == '%') {
+
+            assert(tmpl[i-2] == '{' && tmpl[i-1] == '%');
+            long block_off = i-2; // Useful for error reporting. This is the
+                                  // offset of the first '{' of the {% .. %}
+                                  // block.
+
+            if(i < len && tmpl[i] == '-')
+                i += 1; // Skip the trim marker
+
+            // Now skip any spaces between the '%' and
+            // the first keyword. If there is no keyword,
+            // report the error.
+
+            SKIP_SPACES()
+            
+            if(i == len || (!isalpha(tmpl[i]) && tmpl[i] != '_')) {
+                report(err, block_off, "block {%% .. %%} doesn't start with a keyword");
+                goto failed;
+            }
+
+            long kword_off = i;
+            do
+                i += 1;
+            while(i < len && (isalpha(tmpl[i]) || tmpl[i] == '_'));
+            long kword_len = i - kword_off;
+            
+            // The keyword is the substring that starts at offset
+            // [kword_off] and has length [kword_len].
+            
+            // Check that:
+            //   - The keyword is valid (if, for, else, endif, ..).
+            //   - If it's an if or for, that the maximum depth of
+            //     nested blocks isn't reached.
+            //   - If it's an endif, it's relative to a previous if.
+            //   - If it's an endfor, it's relativo to a previous for.
+            //   - If it's an else, it's relative to a previous if
+            //     that had no other else associated to it.
+
+            switch(kword_len) {
+                
+                case 2:
+                if(strncmp(tmpl + kword_off, "if", kword_len))
+                    goto badkword;
+                
+                if(depth == MAX_DEPTH) {
+                    report(err, block_off, "Too many nested {%% if .. %%}, {%% for .. %%} and {%% cache .. %%} blocks");
+                    goto failed;
+                }
+                has_else[depth] = 0;
+                context[depth++] = SK_IF;
+                slice.kind = SK_IF;
+                break;
+
+                case 3:
+                if(!strncmp(tmpl + kword_off, "set", kword_len)) {
+                    slice.kind = SK_SET;
+                    break;
+                }
+
+                if(strncmp(tmpl + kword_off, "for", kword_len))
+                    goto badkword;
+
+                if(depth == MAX_DEPTH) {
+                    report(err, block_off, "Too many nested {%% if .. %%}, {%% for .. %%} and {%% cache .. %%} blocks");
+                    goto failed;
+                }
+                has_else[depth] = 0;
+                context[depth++] = SK_FOR;
+                slice.kind = SK_FOR;
+                break;
+
+                case 4:
+                if(strncmp(tmpl + kword_off, "else", kword_len))
+                    goto badkword;
+
+                if(depth == 0 || context[depth-1] != SK_IF) {
+                    report(err, block_off, "{%% else %%} has no matching {%% if .. %%}");
+                    goto failed;
+                }
+                if(has_else[depth-1]) {
+                    report(err, block_off, "Can't have multiple {%% else %%} blocks "
+                                           "relative to only one {%% if .. %%}");
+                    goto failed;
+                }
+
+                has_else[depth-1] = true;
+                slice.kind = SK_ELSE;
+                break;
+
+                case 5:
+                if(!strncmp(tmpl + kword_off, "cache", kword_len)) {
+                    if(depth == MAX_DEPTH) {
+                        report(err, block_off, "Too many nested {%% if .. %%}, {%% for .. %%} and {%% cache .. %%} blocks");
+                        goto failed;
+                    }
+                    context[depth++] = SK_CACHE;
+                    slice.kind = SK_CACHE;
+                    break;
+                }
+
+                if(strncmp(tmpl + kword_off, "endif", kword_len))
+                    goto badkword;
+
+                if(depth == 0 || context[depth-1] != SK_IF) {
+                    report(err, block_off, "{%% endif %%} has no matching {%% if .. %%}");
+                    goto failed;
+                }
+                depth -= 1;
+                slice.kind = SK_ENDIF;
+                break;
+
+                case 6:
+                if(strncmp(tmpl + kword_off, "endfor", kword_len))
+                    goto badkword;
+
+                if(depth == 0 || context[depth-1] != SK_FOR) {
+                    report(err, block_off, "{%% endfor %%} has no matching {%% for .. %%}");
+                    goto failed;
+                }
+                depth -= 1;
+                slice.kind = SK_ENDFOR;
+                break;
+
+                case 8:
+                if(strncmp(tmpl + kword_off, "endcache", kword_len))
+                    goto badkword;
+
+                if(depth == 0 || context[depth-1] != SK_CACHE) {
+                    report(err, block_off, "{%% endcache %%} has no matching {%% cache .. %%}");
+                    goto failed;
+                }
+                depth -= 1;
+                slice.kind = SK_ENDCACHE;
+                break;
+
+                default:
+            badkword:
+                report(err, kword_off, "Bad {%% .. %%} block keyword");
+                goto failed;
+            }
+
+            // Now get the slice that goes from the first
+            // byte after the keyword until the byte before
+            // the '%' of the ending "%}" (or the end of
+            // the source).
+
+            slice.off = i;
+            SKIP_UNTIL_2('%', '}')
+            slice.len = i - slice.off;
+
+        } else {
+
+            assert(tmpl[i-2] == '{' && tmpl[i-1] == '{');
+
+            if(i < len && tmpl[i] == '-')
+                i += 1; // Skip the trim marker
+
+            slice.kind = SK_EXPR;
+            slice.off = i;
+            SKIP_UNTIL_2('}', '}')
+            slice.len = i - slice.off;
+        }
+
+        trim = false;
+        if(i < len) {
+            assert((tmpl[i] == '%' || tmpl[i] == '}') && tmpl[i+1] == '}');
+            if(slice.len > 0 && tmpl[i-1] == '-') {
+                slice.len -= 1; // Drop the trim marker
+                trim = true;
+            }
+            i += 2; // Skip the "%}" or "}}"
+        }
+
+        if(!append_slice(&slices, small, slice)) {
+            report(err, i, "Out of memory");
+            goto failed;
+        }
+    }
+
+    return slices;
+
+failed:
+    assert(err == NULL || err->occurred == true);
+    if(slices != small)
+        free(slices);
+    return NULL;
+}
+
+/* Calculates the line and column of the error given
+ * its absolute offset and the source string.
+ */
+static void locate_error(XT_Error *err, const char *str, long len)
+{
+    if(err && err->off >= 0) {
+        assert(err->off <= len);
+
+        long col = 1, 
+             row = 1;
+        long i = 0;
+        while(i < err->off) {
+            col += 1;
+            if(str[i] == '\n') {
+                col = 0;
+                row += 1;
+            }
+            i += 1;
+        }
+        err->col = col;
+        err->row = row;
+    }
+}
+
+/* Collapses each run of whitespace in the text slices
+ * into a newline, if the run has one, or a space. The
+ * result is stored after the null byte of the source, 
+ * which is kept as it is for locating errors, and the
+ * slices are moved to it. Returns the reallocated
+ * template, or NULL if out of memory, in which case
+ * [tmpl] is left as it was.
+ */
+static XT_Template *minify(XT_Template *tmpl, Slices *slices)
+{
+    long total = 0;
+    for(int k = 0; k < slices->count; k += 1)
+        if(slices->list[k].kind == SK_TEXT)
+            total += slices->list[k].len;
+
+    // Collapsing never makes the text longer
+    XT_Template *tmpl2 = realloc(tmpl, sizeof(XT_Template) + tmpl->len + 1 + total + 1);
+    if(tmpl2 == NULL)
+        return NULL;
+
+    char *dst = tmpl2->src + tmpl2->len + 1;
+    long used = 0;
+    for(int k = 0; k < slices->count; k += 1) {
+
+        Slice *slice = &slices->list[k];
+        if(slice->kind != SK_TEXT)
+            continue;
+
+        const char *src = tmpl2->src + slice->off;
+        long start = used;
+        long j = 0;
+        while(j < slice->len) {
+            if(!isspace((unsigned char) src[j])) {
+                dst[used++] = src[j++];
+                continue;
+            }
+            bool newline = false;
+            while(j < slice->len && isspace((unsigned char) src[j])) {
+                if(src[j] == '\n')
+                    newline = true;
+                j += 1;
+            }
+            dst[used++] = newline ? '\n' : ' ';
+        }
+        slice->off = tmpl2->len + 1 + start;
+        slice->len = used - start;
+    }
+    dst[used] = '\0';
+    tmpl2->pool_len = used;
+    return tmpl2;
+}
+
+/* Templates get a new id when compiled or specialized, 
+ * so that they don't share the entries of a cache. Ids
+ * may be taken by several threads at once.
+ */
+static _Atomic unsigned long template_ids = 0;
+
+static unsigned long new_template_id(void)
+{
+    return atomic_fetch_add(&template_ids, 1) + 1;
+}
+
+XT_Template *xt_compile(const char *str, long len, XT_Error *err)
+{
+    return xt_compile_flags(str, len, 0, err);
+}
+
+XT_Template *xt_compile_flags(const char *str, long len, int flags, XT_Error *err)
+{
+    if(str == NULL)
+        str = "";
+
+    if(len < 0)
+        len = strlen(str);
+
+    memset(err, 0, sizeof(XT_Error));
+    
+    XT_Template *tmpl = malloc(sizeof(XT_Template) + len + 1);
+    if(tmpl == NULL) {
+        report(err, -1, "Out of memory");
+        return NULL;
+    }
+    memset(tmpl, 0, sizeof(XT_Template));
+    memcpy(tmpl->src, str, len);
+    tmpl->src[len] = '\0';
+    tmpl->len = len;
+    tmpl->id = new_template_id();
+
+    // Most templates are made of a few slices, so
+    // their list can live on the stack.
+    union {
+        Slices head;
+        char   bytes[sizeof(Slices) + 32 * sizeof(Slice)];
+    } small;
+    small.head.max_count = 32;
+
+    Slices *slices = slice_up(tmpl->src, len, &small.head, err);
+    if(slices == NULL) {
+        assert(err == NULL || err->occurred == true);
+        goto failed;
+    }
+
+    if(flags & XT_MINIFY) {
+        XT_Template *tmpl2 = minify(tmpl, slices);
+        if(tmpl2 == NULL) {
+            report(err, -1, "Out of memory");
+            goto failed;
+        }
+        tmpl = tmpl2;
+    }
+
+    if(!compile(tmpl, slices, flags, err)) {
+        assert(err == NULL || err->occurred == true);
+        goto failed;
+    }
+
+    if(slices != &small.head)
+        free(slices);
+    return tmpl;
+
+failed:
+    locate_error(err, tmpl->src, len);
+    if(slices != &small.head)
+        free(slices);
+    xt_free(tmpl);
+    return NULL;
+}
+
+void xt_free(XT_Template *tmpl)
+{
+    if(tmpl) {
+        free(tmpl->code);
+        free(tmpl->nodes);
+        free(tmpl->reads);
+        free(tmpl->segs);
+        free(tmpl->seg_reads);
+        free(tmpl);
+    }
+}
+
+/* Binds [func] to the calls of [name] in [tmpl], so 
+ * that they don't look up the name when evaluated. 
+ * Returns false if [tmpl] doesn't call [name].
+ */
+bool xt_bind(XT_Template *tmpl, const char *name, FuncValue func)
+{
+    long len = strlen(name);
+    bool found = false;
+    for(int k = 0; k < tmpl->node_count; k += 1) {
+        Expr *expr = &tmpl->nodes[k];
+        if(expr->kind == EK_CALL && expr->call.len == len && !strncmp(tmpl->src + expr->off, name, len)) {
+            expr->call.func = func;
+            found = true;
+        }
+    }
+
+    // The output stored for the template may call the
+    // functions that were bound before.
+    if(found)
+        xt_invalidate(tmpl);
+    return found;
+}
+
+/* Sets how the {{ .. }} blocks of [tmpl] escape the
+ * values they print. The default is XT_ESCAPE_NONE.
+ * The output stored for the template by its caches is
+ * dropped, since it was escaped the old way.
+ */
+void xt_set_escape(XT_Template *tmpl, XT_Escape escape)
+{
+    tmpl->escape = escape;
+    xt_invalidate(tmpl);
+}
+
+/* Sets where the {% cache .. %} blocks of [tmpl] store
+ * their output. Without one (the default), they're 
+ * rendered every time.
+ */
+void xt_set_cache(XT_Template *tmpl, XT_Cache *cache)
+{
+    tmpl->frags = cache;
+}
+
+/* Sets where whole renders of [tmpl] are memoized. The
+ * key of a render is made of the values of the variables
+ * that the template reads, so renders with the same
+ * values write the stored output instead of running
+ * the template. Like the bodies of {% cache %} blocks,
+ * functions are assumed to depend only on their 
+ * arguments. Renders that read iterators aren't stored.
+ *
+ * Since the key is built before running the template,
+ * every variable it names is looked up, even the ones
+ * in branches that aren't taken: resolvers are called
+ * and JSON values decoded for all of them, on hits as
+ * well as on misses. Templates relying on lazy lookups
+ * of costly variables shouldn't be memoized.
+ *
+ * Returns false if there's no memory for the list of
+ * variables, in which case renders aren't memoized.
+ */
+bool xt_set_memo(XT_Template *tmpl, XT_Cache *cache)
+{
+    free(tmpl->reads);
+    tmpl->reads = NULL;
+    tmpl->read_count = 0;
+    tmpl->renders = NULL;
+    if(cache == NULL)
+        return true;
+
+    int *reads = malloc(tmpl->node_count * sizeof(int));
+    if(reads == NULL && tmpl->node_count > 0)
+        return false;
+
+    int count = 0;
+    for(int k = 0; k < tmpl->node_count; k += 1)
+        if(read_len(&tmpl->nodes[k]) > 0)
+            count = add_read(tmpl, reads, count, k);
+    tmpl->reads = reads;
+    tmpl->read_count = count;
+    tmpl->renders = cache;
+    return true;
+}
+
+/* Drops the output of [tmpl] stored in its caches, both
+ * the memoized renders and the {% cache %} blocks, by
+ * giving it a new id. The old entries are never looked
+ * up again and are evicted as the caches fill up.
+ */
+void xt_invalidate(XT_Template *tmpl)
+{
+    tmpl->id = new_template_id();
+}
+
+/* Renders [tmpl] to [callback], or to the [segments] 
+ * marked as [dirty] (see [begin_segment]) if they're
+ * not NULL.
+ */
+static bool render_to(XT_Template *tmpl, Variables *vars, xt_callback callback, void *userp, 
+                      Capture *segments, const bool *dirty, XT_Resolved *shared, XT_Error *err)
+{
+    memset(err, 0, sizeof(XT_Error));
+
+    // Most templates only have a few cached nodes, 
+    // so they can live on the stack.
+    CacheSlot small_cache[16];
+    CacheSlot *cache = small_cache;
+    if(tmpl->cache_count > (int) (sizeof(small_cache) / sizeof(small_cache[0]))) {
+        cache = malloc(tmpl->cache_count * sizeof(CacheSlot));
+        if(cache == NULL) {
+            report(err, -1, "Out of memory");
+            return 0;
+        }
+    }
+    for(int k = 0; k < tmpl->cache_count; k += 1)
+        cache[k].stamp = 0;
+
+    ResolveMemo own = {0};
+    RenderContext ctx = {
+        .err = err,
+        .tmpl = tmpl,
+        .vars = vars,
+        .userp = userp,
+        .callback = callback,
+        .memo = shared ? &shared->memo : &own,
+        .depth = 0,
+        .entries = 0,
+        .cache = cache,
+        .segments = segments,
+        .dirty = dirty,
+    };
+
+    for(int k = 0; k < tmpl->local_count; k += 1)
+        ctx.slots[2 * MAX_DEPTH + k] = (Value) { VK_INT, .as_int = 0 };
+
+    // Renders to segments aren't memoized
+    bool memoize = (tmpl->renders != NULL && segments == NULL);
+    Capture memo = { callback, userp, .failed = !memoize };
+    bool ok;
+    if(memoize && begin_memo(&ctx, &memo))
+        ok = true;
+    else {
+        if(!memo.failed) {
+            ctx.callback = capture_output;
+            ctx.userp = &memo;
+        }
+        ok = run(&ctx);
+        if(ok && !memo.failed)
+            tmpl->renders->put(tmpl->renders, memo.data, memo.keylen, memo.data + memo.keylen, memo.used - memo.keylen);
+    }
+    free(memo.data);
+
+    for(int k = 0; k < tmpl->local_count; k += 1)
+        value_free(&ctx.slots[2 * MAX_DEPTH + k]);
+    free(own.list);
+    for(int k = 0; k < tmpl->cache_count; k += 1)
+        if(cache[k].stamp != 0)
+            value_free(&cache[k].val);
+    if(cache != small_cache)
+        free(cache);
+    
+    assert((ok && err->occurred == false) || 
+          (!ok && err->occurred == true));
+
+    if(!ok)
+        locate_error(err, tmpl->src, tmpl->len);
+    return ok;
+}
+
+bool xt_render_to_cb(XT_Template *tmpl, Variables *vars, 
+                     xt_callback callback, void *userp, XT_Error *err)
+{
+    return render_to(tmpl, vars, callback, userp, NULL, NULL, NULL, err);
+}
+
+/* Results of resolvers that are shared by the renders 
+ * and evaluations they're passed to, so that a name is
+ * resolved once for all of them. Values are remembered
+ * by the scope that resolved them and by the name in
+ * the template source, so the scopes and the templates
+ * must outlive the memo. Returns NULL if there's no 
+ * memory for it.
+ */
+XT_Resolved *xt_resolved_create(void)
+{
+    XT_Resolved *resolved = malloc(sizeof(XT_Resolved));
+    if(resolved)
+        resolved->memo = (ResolveMemo) {0};
+    return resolved;
+}
+
+void xt_resolved_free(XT_Resolved *resolved)
+{
+    if(resolved) {
+        free(resolved->memo.list);
+        free(resolved);
+    }
+}
+
+/* Same as [xt_render_to_cb], resolving names through
+ * [resolved] if it's not NULL.
+ */
+bool xt_render_resolved(XT_Template *tmpl, Variables *vars, XT_Resolved *resolved,
+                        xt_callback callback, void *userp, XT_Error *err)
+{
+    return render_to(tmpl, vars, callback, userp, NULL, NULL, resolved, err);
+}
+
+/*                  INCREMENTAL RENDERS
+ * A render to segments keeps the output of each segment
+ * of the template apart, so that [xt_rerender] can 
+ * render again only the ones that read the variables
+ * that changed. Templates compiled without XT_SEGMENTS
+ * are a single segment that reads every variable.
+ *
+ * Segments that set variables make the following ones
+ * depend on what they read, since they can't tell 
+ * which of the variables they set are read later.
+ */
+
+struct XT_Segments {
+    XT_Template *tmpl;
+    int count;
+    Capture list[]; // Output of each segment
+};
+
+/* Whether segment [seg] of [tmpl] reads one of the names
+ * of the NULL-terminated [changed] list.
+ */
+static bool reads_changed(XT_Template *tmpl, Segment *seg, const char **changed)
+{
+    for(int k = 0; k < seg->read_count; k += 1) {
+        Expr *expr = &tmpl->nodes[tmpl->seg_reads[seg->reads + k]];
+        long len = read_len(expr);
+        for(int j = 0; changed[j]; j += 1)
+            if((long) strlen(changed[j]) == len && !strncmp(changed[j], tmpl->src + expr->off, len))
+                return true;
+    }
+    return false;
+}
+
+/* Renders the [dirty] segments of [segs] (all of them
+ * if it's NULL) and replaces their output. When the
+ * render fails, the output is left as it was.
+ */
+static bool update_segments(XT_Segments *segs, Variables *vars, const bool *dirty, XT_Error *err)
+{
+    Capture *fresh = malloc(segs->count * sizeof(Capture));
+    if(fresh == NULL) {
+        memset(err, 0, sizeof(XT_Error));
+        report(err, -1, "Out of memory");
+        return 0;
+    }
+    memset(fresh, 0, segs->count * sizeof(Capture));
+
+    bool ok;
+    if(segs->tmpl->seg_count == 0)
+        ok = render_to(segs->tmpl, vars, capture_append, fresh, NULL, NULL, NULL, err);
+    else
+        ok = render_to(segs->tmpl, vars, discard, NULL, fresh, dirty, NULL, err);
+
+    for(int k = 0; ok && k < segs->count; k += 1)
+        if(fresh[k].failed) {
+            report(err, -1, "Out of memory");
+            ok = false;
+        }
+
+    for(int k = 0; k < segs->count; k += 1) {
+        if(ok && (dirty == NULL || dirty[k])) {
+            free(segs->list[k].data);
+            segs->list[k] = fresh[k];
+        } else
+            free(fresh[k].data);
+    }
+    free(fresh);
+    return ok;
+}
+
+/* Renders [tmpl] keeping the output of its segments 
+ * apart. The template must outlive the result, which
+ * is freed with [xt_segments_free].
+ */
+XT_Segments *xt_render_segments(XT_Template *tmpl, Variables *vars, XT_Error *err)
+{
+    int count = (tmpl->seg_count > 0) ? tmpl->seg_count : 1;
+    XT_Segments *segs = malloc(sizeof(XT_Segments) + count * sizeof(Capture));
+    if(segs == NULL) {
+        memset(err, 0, sizeof(XT_Error));
+        report(err, -1, "Out of memory");
+        return NULL;
+    }
+    memset(segs, 0, sizeof(XT_Segments) + count * sizeof(Capture));
+    segs->tmpl = tmpl;
+    segs->count = count;
+
+    if(!update_segments(segs, vars, NULL, err)) {
+        xt_segments_free(segs);
+        return NULL;
+    }
+    return segs;
+}
+
+/* Renders again the segments of [segs] that read one
+ * of the [changed] variables, a list of names ending
+ * with NULL, using the new values in [vars]. Returns
+ * false if the render fails, in which case [segs] is 
+ * left as it was.
+ */
+bool xt_rerender(XT_Segments *segs, Variables *vars, const char **changed, XT_Error *err)
+{
+    memset(err, 0, sizeof(XT_Error));
+    if(changed[0] == NULL)
+        return 1;
+
+    XT_Template *tmpl = segs->tmpl;
+    if(tmpl->seg_count == 0)
+        return update_segments(segs, vars, NULL, err);
+
+    bool *dirty = malloc(segs->count * sizeof(bool));
+    if(dirty == NULL) {
+        report(err, -1, "Out of memory");
+        return 0;
+    }
+
+    bool any = false;
+    bool after_set = false; // A dirty segment set variables
+    for(int k = 0; k < segs->count; k += 1) {
+        Segment *seg = &tmpl->segs[k];
+        dirty[k] = after_set || reads_changed(tmpl, seg, changed);
+        if(dirty[k] && seg->sets)
+            after_set = true;
+        any = any || dirty[k];
+    }
+
+    bool ok = !any || update_segments(segs, vars, dirty, err);
+    free(dirty);
+    return ok;
+}
+
+/* Writes the output of all segments to [callback] */
+void xt_segments_write(XT_Segments *segs, xt_callback callback, void *userp)
+{
+    for(int k = 0; k < segs->count; k += 1)
+        if(segs->list[k].used > 0)
+            callback(segs->list[k].data, segs->list[k].used, userp);
+}
+
+void xt_segments_free(XT_Segments *segs)
+{
+    if(segs) {
+        for(int k = 0; k < segs->count; k += 1)
+            free(segs->list[k].data);
+        free(segs);
+    }
+}
+
+/* Appends the output of [segs] to [rope] without copying
+ * it, so the rope is valid until [segs] is rendered 
+ * again or freed.
+ */
+bool xt_segments_to_rope(XT_Segments *segs, XT_Rope *rope)
+{
+    for(int k = 0; k < segs->count; k += 1)
+        if(!xt_rope_append(rope, segs->list[k].data, segs->list[k].used, false))
+            return 0;
+    return 1;
+}
+
+/*                         ROPES
+ * A rope is a list of pieces of output that are written
+ * one after the other. Pieces either refer to bytes
+ * that outlive the rope, like the text of a template,
+ * or to copies in the chunks of the rope. Pieces are
+ * allocated in the chunks too, and copies that follow
+ * a copy extend its piece when the chunk has room.
+ *
+ * Appending a rope to another moves its pieces and its
+ * chunks, so it takes constant time and copies no byte
+ * of output.
+ */
+
+typedef struct RopeChunk RopeChunk;
+struct RopeChunk {
+    RopeChunk *next;
+    long used, size;
+    char data[];
+};
+
+struct XT_Rope {
+    XT_Piece *head, *tail;
+    long    length;
+    RopeChunk *chunks, // The one being filled first
+              *last;
+};
+
+XT_Rope *xt_rope_create(void)
+{
+    XT_Rope *rope = malloc(sizeof(XT_Rope));
+    if(rope)
+        memset(rope, 0, sizeof(XT_Rope));
+    return rope;
+}
+
+void xt_rope_free(XT_Rope *rope)
+{
+    if(rope) {
+        RopeChunk *chunk = rope->chunks;
+        while(chunk) {
+            RopeChunk *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        free(rope);
+    }
+}
+
+/* Returns [len] bytes from the chunks of [rope], aligned
+ * to [align], or NULL if there's no memory for them.
+ */
+static void *rope_alloc(XT_Rope *rope, long len, long align)
+{
+    RopeChunk *chunk = rope->chunks;
+    if(chunk) {
+        long start = (chunk->used + align - 1) & ~(align - 1);
+        if(start <= chunk->size - len) {
+            chunk->used = start + len;
+            return chunk->data + start;
+        }
+    }
+
+    long size = 4096 - sizeof(RopeChunk);
+    if(size < len)
+        size = len;
+    chunk = malloc(sizeof(RopeChunk) + size);
+    if(chunk == NULL)
+        return NULL;
+    chunk->next = rope->chunks;
+    chunk->used = len;
+    chunk->size = size;
+    if(rope->chunks == NULL)
+        rope->last = chunk;
+    rope->chunks = chunk;
+    return chunk->data;
+}
+
+/* Appends [len] bytes to [rope], either by copying them
+ * or, if [copy] is false, by referring to them. Returns
+ * false if there's no memory.
+ */
+bool xt_rope_append(XT_Rope *rope, const char *data, long len, bool copy)
+{
+    if(len == 0)
+        return 1;
+
+    XT_Piece *tail = rope->tail;
+    RopeChunk *chunk = rope->chunks;
+    if(copy && tail && chunk && tail->data + tail->len == chunk->data + chunk->used
+            && len <= chunk->size - chunk->used) {
+        memcpy(chunk->data + chunk->used, data, len);
+        chunk->used += len;
+        tail->len += len;
+        rope->length += len;
+        return 1;
+    }
+
+    // The piece goes before its bytes, so that the 
+    // next copies can extend it.
+    XT_Piece *piece = rope_alloc(rope, sizeof(XT_Piece), sizeof(void*));
+    if(piece == NULL)
+        return 0;
+    if(copy) {
+        char *dst = rope_alloc(rope, len, 1);
+        if(dst == NULL)
+            return 0;
+        memcpy(dst, data, len);
+        data = dst;
+    }
+    *piece = (XT_Piece) { data, len, NULL };
+
+    if(tail)
+        tail->next = piece;
+    else
+        rope->head = piece;
+    rope->tail = piece;
+    rope->length += len;
+    return 1;
+}
+
+/* Moves the pieces of [other] to the end of [rope], 
+ * leaving [other] empty.
+ */
+void xt_rope_concat(XT_Rope *rope, XT_Rope *other)
+{
+    if(other->head) {
+        if(rope->tail)
+            rope->tail->next = other->head;
+        else
+            rope->head = other->head;
+        rope->tail = other->tail;
+        rope->length += other->length;
+    }
+
+    // The chunk being filled stays the same
+    if(other->chunks) {
+        if(rope->chunks) {
+            rope->last->next = other->chunks;
+            rope->last = other->last;
+        } else {
+            rope->chunks = other->chunks;
+            rope->last = other->last;
+        }
+    }
+    memset(other, 0, sizeof(XT_Rope));
+}
+
+long xt_rope_length(XT_Rope *rope)
+{
+    return rope->length;
+}
+
+/* Returns the first piece of [rope], or NULL if it's
+ * empty. The others follow through [next].
+ */
+XT_Piece *xt_rope_first(XT_Rope *rope)
+{
+    return rope->head;
+}
+
+void xt_rope_write(XT_Rope *rope, xt_callback callback, void *userp)
+{
+    for(XT_Piece *piece = rope->head; piece; piece = piece->next)
+        callback(piece->data, piece->len, userp);
+}
+
+typedef struct {
+    XT_Rope *rope;
+    uintptr_t text, text_end; // Bytes of the template
+    bool failed;
+} RopeOutput;
+
+/* Callback of the renders to ropes. The text of the 
+ * template is referred to, other bytes are copied,
+ * and so are short texts, since a piece would take
+ * more memory than them.
+ */
+static void rope_output(const char *str, long len, void *userp)
+{
+    RopeOutput *out = userp;
+    uintptr_t addr = (uintptr_t) str;
+    bool copy = len < (long) sizeof(XT_Piece) || addr < out->text || addr >= out->text_end;
+    if(!out->failed && !xt_rope_append(out->rope, str, len, copy))
+        out->failed = true;
+}
+
+/* Appends the output of [tmpl] to [rope], which refers
+ * to the text of [tmpl] so the template must outlive
+ * it. When the render fails, [rope] is left as it was.
+ */
+bool xt_render_to_rope(XT_Template *tmpl, Variables *vars, XT_Rope *rope, XT_Error *err)
+{
+    XT_Piece *tail = rope->tail;
+    long tail_len = tail ? tail->len : 0; // Copies may extend it
+    long   length = rope->length;
+
+    RopeOutput out = {
+        .rope = rope,
+        .text = (uintptr_t) tmpl->src,
+        .text_end = (uintptr_t) (tmpl->src + tmpl->len + 1 + tmpl->pool_len),
+    };
+    bool ok = xt_render_to_cb(tmpl, vars, rope_output, &out, err);
+    if(ok && out.failed) {
+        report(err, -1, "Out of memory");
+        ok = false;
+    }
+
+    // The pieces that were added are dropped. Their
+    // bytes stay in the chunks until the rope is freed.
+    if(!ok) {
+        if(tail) {
+            tail->len = tail_len;
+            tail->next = NULL;
+        } else
+            rope->head = NULL;
+        rope->tail = tail;
+        rope->length = length;
+    }
+    return ok;
+}
+
+XT_Template *xt_compile_expr(const char *str, long len, XT_Error *err)
+{
+    if(str == NULL)
+        str = "";
+
+    if(len < 0)
+        len = strlen(str);
+
+    memset(err, 0, sizeof(XT_Error));
+
+    XT_Template *tmpl = malloc(sizeof(XT_Template) + len + 1);
+    if(tmpl == NULL) {
+        report(err, -1, "Out of memory");
+        return NULL;
+    }
+    memset(tmpl, 0, sizeof(XT_Template));
+    memcpy(tmpl->src, str, len);
+    tmpl->src[len] = '\0';
+    tmpl->len = len;
+
+    // An expression is compiled as a template made
+    // of a single {{ .. }} block.
+    CompileContext ctx = {
+        .err = err,
+        .tmpl = tmpl,
+        .str = tmpl->src,
+    };
+    Instr print = { .op = OP_PRINT, .off = 0, .len = len };
+    print.expr = parse_expr(&ctx, 0, len);
+    if(print.expr < 0 || append_instr(tmpl, print) < 0 
+                      || append_instr(tmpl, (Instr) { .op = OP_HALT }) < 0) {
+        if(print.expr >= 0)
+            report(err, len, "Out of memory");
+        locate_error(err, tmpl->src, len);
+        xt_free(tmpl);
+        return NULL;
+    }
+    return tmpl;
+}
+
+bool xt_eval(XT_Template *expr, Variables *vars, Value *out, XT_Error *err)
+{
+    return xt_eval_resolved(expr, vars, NULL, out, err);
+}
+
+/* Same as [xt_eval], resolving names through [resolved]
+ * if it's not NULL.
+ */
+bool xt_eval_resolved(XT_Template *expr, Variables *vars, XT_Resolved *resolved, Value *out, XT_Error *err)
+{
+    memset(err, 0, sizeof(XT_Error));
+    assert(expr->code_count > 0 && expr->code[0].op == OP_PRINT);
+
+    ResolveMemo own = {0};
+    RenderContext ctx = {
+        .err = err,
+        .tmpl = expr,
+        .vars = vars,
+        .memo = resolved ? &resolved->memo : &own,
+        .depth = 0,
+    };
+
+    *out = eval(&ctx, expr->code[0].expr);
+    free(own.list);
+    if(out->kind == VK_ERROR) {
+        locate_error(err, expr->src, expr->len);
+        return 0;
+    }
+    return 1;
+}
+
+bool xt_render_str_to_cb(const char *str, long len, Variables *vars, 
+                         xt_callback callback, void *userp, XT_Error *err)
+{
+    XT_Template *tmpl = xt_compile(str, len, err);
+    if(tmpl == NULL) {
+        assert(err == NULL || err->occurred == true);
+        return 0;
+    }
+
+    bool ok = xt_render_to_cb(tmpl, vars, callback, userp, err);
+
+    xt_free(tmpl);
+    return ok;
+}
+
+typedef struct {
+    bool  failed;
+    char *data;
+    long  size;
+    long  used;
+} buff_t;
+
+static void callback(const char *str, long len, void *userp)
+{
+    buff_t *buff = userp;
+    if(buff->failed)
+        return;
+
+    if(buff->used + len > buff->size) {
+
+        long new_size;
+        if(buff->size == 0) 
+            new_size = 1024-1;
+        else
+            new_size = buff->size * 2;
+
+        if(buff->used + len > new_size)
+            new_size = buff->used + len;
+
+        void *temp = realloc(buff->data, new_size+1);
+        if(temp == NULL) {
+            buff->failed = 1;
+            return;
+        }
+
+        buff->data = temp;
+        buff->size = new_size;
+    }
+
+    memcpy(buff->data + buff->used, str, len);
+    buff->used += len;
+}
+
+/*                  PARTIAL EVALUATION
+ * [xt_specialize] builds a new template where every 
+ * expression that only depends on a set of known
+ * variables was evaluated ahead of time. Conditions
+ * that became constant turn into unconditional jumps
+ * (or disappear), the code no longer reachable is 
+ * dropped and constant prints become text which is
+ * then merged with the text around it.
+ *
+ * Text produced this way doesn't come from the source,
+ * so it's stored in a pool right after the copy of the
+ * source in [XT_Template.src] (after its null byte).
+ */
+
+typedef struct {
+    XT_Template *old;
+    XT_Template *new;
+    Variables *known;
+    buff_t      pool;
+} SpecContext;
+
+static bool is_scalar(Value val)
+{
+    return val.kind == VK_INT || val.kind == VK_FLOAT || val.kind == VK_STRING;
+}
+
+/* Copies node [idx] of the old template to the new one,
+ * folding it if possible. Returns the new index, or -1
+ * if out of memory. When the node folded to a constant,
+ * its value is returned through [cval], otherwise the
+ * kind of [cval] is set to VK_ERROR.
+ */
+static int spec_expr(SpecContext *ctx, int idx, Value *cval)
+{
+    Expr expr = ctx->old->nodes[idx];
+    cval->kind = VK_ERROR;
+
+    switch(expr.kind) {
+
+        case EK_INT:
+        *cval = (Value) { VK_INT, .as_int = expr.as_int };
+        break;
+
+        case EK_FLOAT:
+        *cval = (Value) { VK_FLOAT, .as_float = expr.as_float };
+        break;
+
+        case EK_STRING:
+        *cval = (Value) { VK_STRING, expr.str.len, .as_str = ctx->old->src + expr.off + 1 };
+        break;
+
+        case EK_LOCAL:
+        break;
+
+        case EK_VAR:
+        {
+            // Arrays are left to the render, since their
+            // items are owned by the host.
+            Value found;
+            if(find_var(ctx->known, ctx->old->src + expr.off, expr.var.len, &found, NULL) 
+                && (is_scalar(found) || found.kind == VK_MAP))
+                *cval = found;
+            break;
+        }
+
+        case EK_NOT:
+        {
+            Value operand;
+            expr.operand = spec_expr(ctx, expr.operand, &operand);
+            if(expr.operand < 0)
+                return -1;
+            if(is_scalar(operand))
+                *cval = (Value) { VK_INT, .as_int = !is_truthy(operand) };
+            break;
+        }
+
+        case EK_FMT:
+        {
+            Value obj;
+            expr.fmt.obj = spec_expr(ctx, expr.fmt.obj, &obj);
+            if(expr.fmt.obj < 0)
+                return -1;
+            break;
+        }
+
+        case EK_ESCAPE:
+        {
+            Value obj;
+            expr.escape.obj = spec_expr(ctx, expr.escape.obj, &obj);
+            if(expr.escape.obj < 0)
+                return -1;
+            break;
+        }
+
+        case EK_FIELD:
+        {
+            Value obj;
+            expr.field.obj = spec_expr(ctx, expr.field.obj, &obj);
+            if(expr.field.obj < 0)
+                return -1;
+
+            const char *errmsg;
+            Value found;
+            if(map_lookup(obj, ctx->old->src + expr.off, expr.field.len, expr.field.hash, &found, &errmsg)
+                && (is_scalar(found) || found.kind == VK_MAP))
+                *cval = found;
+            break;
+        }
+
+        case EK_INDEX:
+        {
+            Value obj, key;
+            expr.index.obj = spec_expr(ctx, expr.index.obj, &obj);
+            if(expr.index.obj < 0)
+                return -1;
+            expr.index.key = spec_expr(ctx, expr.index.key, &key);
+            if(expr.index.key < 0)
+                return -1;
+
+            const char *errmsg;
+            Value found;
+            if(index_value(obj, key, &found, &errmsg) && (is_scalar(found) || found.kind == VK_MAP))
+                *cval = found;
+            break;
+        }
+
+        case EK_SLICE:
+        {
+            // Arrays are never known, so slices are never folded
+            Value ignored;
+            expr.slice.obj = spec_expr(ctx, expr.slice.obj, &ignored);
+            if(expr.slice.obj < 0)
+                return -1;
+            if(expr.slice.start >= 0) {
+                expr.slice.start = spec_expr(ctx, expr.slice.start, &ignored);
+                if(expr.slice.start < 0)
+                    return -1;
+            }
+            if(expr.slice.stop >= 0) {
+                expr.slice.stop = spec_expr(ctx, expr.slice.stop, &ignored);
+                if(expr.slice.stop < 0)
+                    return -1;
+            }
+            break;
+        }
+
+        case EK_ARRAY:
+        {
+            int tail = -1;
+            for(int item = expr.array.head; item >= 0; item = ctx->old->nodes[item].next) {
+                Value ignored;
+                int copy = spec_expr(ctx, item, &ignored);
+                if(copy < 0)
+                    return -1;
+                if(tail < 0)
+                    expr.array.head = copy;
+                else
+                    ctx->new->nodes[tail].next = copy;
+                tail = copy;
+            }
+            break;
+        }
+
+        case EK_CALL:
+        {
+            // Calls are never folded, but known functions 
+            // are bound to the call.
+            int tail = -1;
+            for(int arg = expr.call.head; arg >= 0; arg = ctx->old->nodes[arg].next) {
+                Value ignored;
+                int copy = spec_expr(ctx, arg, &ignored);
+                if(copy < 0)
+                    return -1;
+                if(tail < 0)
+                    expr.call.head = copy;
+                else
+                    ctx->new->nodes[tail].next = copy;
+                tail = copy;
+            }
+
+            Value found;
+            if(expr.call.func == NULL && find_var(ctx->known, ctx->old->src + expr.off, expr.call.len, &found, NULL) 
+                && found.kind == VK_FUNC)
+                expr.call.func = found.as_func;
+            break;
+        }
+
+        case EK_BINARY:
+        {
+            Value lhs, rhs;
+            expr.binary.lhs = spec_expr(ctx, expr.binary.lhs, &lhs);
+            if(expr.binary.lhs < 0)
+                return -1;
+            expr.binary.rhs = spec_expr(ctx, expr.binary.rhs, &rhs);
+            if(expr.binary.rhs < 0)
+                return -1;
+
+            // A known left operand of [and] and [or] either is
+            // the result or leaves it to the right one.
+            if(expr.binary.op == OID_AND || expr.binary.op == OID_OR) {
+                if(is_scalar(lhs)) {
+                    if(is_truthy(lhs) == (expr.binary.op == OID_OR))
+                        *cval = lhs;
+                    else {
+                        *cval = rhs;
+                        return expr.binary.rhs;
+                    }
+                }
+                break;
+            }
+
+            // Errors are left to the render, so that they're 
+            // reported as usual.
+            if(is_scalar(lhs) && is_scalar(rhs)) {
+                const char *errmsg;
+                *cval = apply(expr.binary.op, lhs, rhs, &errmsg);
+            }
+            break;
+        }
+    }
+
+    int cache = expr.cache;
+    if(cval->kind == VK_INT)
+        expr = (Expr) { EK_INT, expr.off, .as_int = cval->as_int };
+    else if(cval->kind == VK_FLOAT)
+        expr = (Expr) { EK_FLOAT, expr.off, .as_float = cval->as_float };
+    else if(cache >= 0) {
+        // The node keeps its cache slot
+        int copy = append_node(ctx->new, expr);
+        if(copy >= 0)
+            ctx->new->nodes[copy].cache = cache;
+        return copy;
+    }
+
+    return append_node(ctx->new, expr);
+}
+
+/* Removes from [tmpl] the instructions with [keep] set to
+ * false. Jumps to a removed instruction are redirected to
+ * the first kept instruction after it.
+ */
+static void compact(XT_Template *tmpl, const bool *keep, long *map)
+{
+    long count = 0;
+    for(long pc = 0; pc < tmpl->code_count; pc += 1) {
+        map[pc] = count;
+        if(keep[pc])
+            count += 1;
+    }
+    map[tmpl->code_count] = count;
+
+    for(long pc = 0; pc < tmpl->code_count; pc += 1)
+        if(keep[pc]) {
+            Instr instr = tmpl->code[pc];
+            if(instr.op == OP_BRANCH || instr.op == OP_JUMP || 
+               instr.op == OP_FOR    || instr.op == OP_NEXT || instr.op == OP_CACHE)
+                instr.target = map[instr.target];
+            tmpl->code[map[pc]] = instr;
+        }
+    tmpl->code_count = count;
+}
+
+/* Marks through [reach] the instructions reachable from
+ * the first one. [stack] must have room for as many 
+ * items as there are instructions.
+ */
+static void reachable(XT_Template *tmpl, bool *reach, long *stack)
+{
+    memset(reach, 0, tmpl->code_count * sizeof(bool));
+
+    long depth = 0;
+    stack[depth++] = 0;
+    reach[0] = true;
+
+    while(depth > 0) {
+
+        long pc = stack[--depth];
+        Instr instr = tmpl->code[pc];
+
+        long next[2];
+        int  count = 0;
+        switch(instr.op) {
+            case OP_TEXT  :
+            case OP_PRINT :
+            case OP_SET   :
+            case OP_ENDCACHE:
+            case OP_SEGMENT : next[count++] = pc + 1; break;
+            case OP_JUMP  : next[count++] = instr.target; break;
+            case OP_BRANCH:
+            case OP_FOR   :
+            case OP_NEXT  :
+            case OP_CACHE : next[count++] = pc + 1; next[count++] = instr.target; break;
+            case OP_HALT  : break;
+        }
+
+        for(int k = 0; k < count; k += 1)
+            if(!reach[next[k]]) {
+                reach[next[k]] = true;
+                stack[depth++] = next[k];
+            }
+    }
+}
+
+XT_Template *xt_specialize(XT_Template *tmpl, Variables *known, XT_Error *err)
+{
+    memset(err, 0, sizeof(XT_Error));
+
+    XT_Template work;
+    memset(&work, 0, sizeof(XT_Template));
+    work.cache_count = tmpl->cache_count;
+    work.local_count = tmpl->local_count;
+    work.escape = tmpl->escape;
+    work.frags = tmpl->frags;
+    work.id = new_template_id();
+
+    SpecContext ctx = {
+        .old = tmpl,
+        .new = &work,
+        .known = known,
+    };
+    memset(&ctx.pool, 0, sizeof(buff_t));
+
+    buff_t pool;
+    memset(&pool, 0, sizeof(buff_t));
+
+    long  *map = NULL;
+    bool *flags = NULL;
+    XT_Template *res = NULL;
+
+    // The pool starts after the null byte of the source
+    #define POOL_OFF(i) (tmpl->len + 1 + (i))
+
+    for(long pc = 0; pc < tmpl->code_count; pc += 1) {
+
+        Instr instr = tmpl->code[pc];
+
+        // Texts after the source (like the ones of a
+        // minified template) are only in the old pool,
+        // which isn't copied, so they're moved.
+        if(instr.op == OP_TEXT && instr.off > tmpl->len) {
+            long start = ctx.pool.used;
+            callback(tmpl->src + instr.off, instr.len, &ctx.pool);
+            instr.off = POOL_OFF(start);
+        }
+
+        // The segments aren't kept, so their starts become
+        // jumps to the next instruction, which are dropped.
+        if(instr.op == OP_SEGMENT)
+            instr = (Instr) { .op = OP_JUMP, .expr = -1, .target = pc + 1 };
+
+        if(instr.op == OP_PRINT || instr.op == OP_BRANCH || 
+           instr.op == OP_FOR   || instr.op == OP_SET || instr.op == OP_CACHE) {
+
+            Value cval;
+            instr.expr = spec_expr(&ctx, instr.expr, &cval);
+            if(instr.expr < 0)
+                goto nomem;
+
+            if(instr.op == OP_PRINT && cval.kind != VK_ERROR) {
+                // Folded values are escaped now, since the
+                // text they become is written as it is.
+                long start = ctx.pool.used;
+                Emitter e;
+                emit_init(&e, callback, &ctx.pool, tmpl->escape);
+                emit_value(&e, cval);
+                emit_flush(&e);
+                instr = (Instr) { .op = OP_TEXT, .expr = -1, .off = POOL_OFF(start), .len = ctx.pool.used - start };
+            }
+
+            if(instr.op == OP_BRANCH && cval.kind != VK_ERROR) {
+                instr.op = OP_JUMP;
+                if(is_truthy(cval))
+                    instr.target = pc + 1;
+            }
+        }
+
+        // Instructions are kept at the same index for now,
+        // so the jump targets are still valid.
+        if(append_instr(&work, instr) < 0)
+            goto nomem;
+    }
+
+    if(ctx.pool.failed)
+        goto nomem;
+
+    map   = malloc((work.code_count + 1) * sizeof(long));
+    flags = malloc(work.code_count * sizeof(bool));
+    if(map == NULL || flags == NULL)
+        goto nomem;
+
+    // Drop the unreachable code, then the jumps to the
+    // next instruction.
+    reachable(&work, flags, map);
+    compact(&work, flags, map);
+
+    for(long pc = 0; pc < work.code_count; pc += 1)
+        flags[pc] = !(work.code[pc].op == OP_JUMP && work.code[pc].target == pc + 1);
+    compact(&work, flags, map);
+
+    // Now merge runs of text instructions. Only the first
+    // one of a run can be the target of a jump. Merged 
+    // runs are written to a new pool, along with the 
+    // texts that are in the old one.
+    memset(flags, 0, work.code_count * sizeof(bool));
+    for(long pc = 0; pc < work.code_count; pc += 1) {
+        Opcode op = work.code[pc].op;
+        if(op == OP_BRANCH || op == OP_JUMP || op == OP_FOR || op == OP_NEXT || op == OP_CACHE)
+            flags[work.code[pc].target] = true;
+    }
+
+    long count = 0;
+    for(long pc = 0; pc < work.code_count; ) {
+
+        Instr instr = work.code[pc];
+
+        long end = pc + 1;
+        if(instr.op == OP_TEXT)
+            while(end < work.code_count && work.code[end].op == OP_TEXT && !flags[end])
+                end += 1;
+
+        if(instr.op == OP_TEXT && (end - pc > 1 || instr.off > tmpl->len)) {
+            long start = pool.used;
+            for(long k = pc; k < end; k += 1) {
+                Instr text = work.code[k];
+                if(text.off > tmpl->len)
+                    callback(ctx.pool.data + text.off - POOL_OFF(0), text.len, &pool);
+                else
+                    callback(tmpl->src + text.off, text.len, &pool);
+            }
+            if(pool.failed)
+                goto nomem;
+            instr.off = POOL_OFF(start);
+            instr.len = pool.used - start;
+        }
+
+        // Targets never point inside a merged run
+        for(long k = pc; k < end; k += 1)
+            map[k] = count;
+        work.code[count++] = instr;
+        pc = end;
+    }
+    map[work.code_count] = count;
+    for(long pc = 0; pc < count; pc += 1) {
+        Opcode op = work.code[pc].op;
+        if(op == OP_BRANCH || op == OP_JUMP || op == OP_FOR || op == OP_NEXT || op == OP_CACHE)
+            work.code[pc].target = map[work.code[pc].target];
+    }
+    work.code_count = count;
+
+    res = malloc(sizeof(XT_Template) + tmpl->len + 1 + pool.used + 1);
+    if(res == NULL)
+        goto nomem;
+
+    *res = work;
+    res->len = tmpl->len;
+    res->pool_len = pool.used;
+    memcpy(res->src, tmpl->src, tmpl->len + 1);
+    if(pool.used > 0)
+        memcpy(res->src + POOL_OFF(0), pool.data, pool.used);
+    res->src[POOL_OFF(pool.used)] = '\0';
+
+    #undef POOL_OFF
+
+    free(ctx.pool.data);
+    free(pool.data);
+    free(flags);
+    free(map);
+    return res;
+
+nomem:
+    report(err, -1, "Out of memory");
+    free(ctx.pool.data);
+    free(pool.data);
+    free(flags);
+    free(map);
+    free(work.code);
+    free(work.nodes);
+    return NULL;
+}
+
+/*                   C CODE GENERATOR
+ * [xt_emit_c] translates a compiled template to a C
+ * translation unit exporting a function with the same
+ * signature as [xt_render_str_to_cb]. Text slices
+ * become static arrays, expressions become inline
+ * code on [Value]s and loops become C loops over the
+ * collection. Conditional jumps are translated to 
+ * gotos, since the instruction stream doesn't keep
+ * the if/else structure around.
+ *
+ * The generated code only relies on the xt_rt_* 
+ * functions of xtmpl_rt.h for the slow paths, which
+ * aren't part of the public interface and are the same
+ * routines used by the interpreter, so the output
+ * is the same byte by byte.
+ */
+
+typedef struct {
+    XT_Template *tmpl;
+    const char  *name; // Of the generated function, which prefixes its statics
+    xt_callback callback;
+    void          *userp;
+    int             temp; // Next unused temporary
+    bool           *owned; // Temporaries holding arrays built by the generated code
+    bool        *labelled; // Instructions that are the target of a jump
+    bool         can_fail; // Whether the code jumps to the "failed" label
+    int            *names; // First node looking up the same name as each EK_VAR node
+} GenContext;
+
+static void genf(GenContext *ctx, const char *fmt, ...)
+{
+    char buf[512];
+    va_list va;
+    va_start(va, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, va);
+    va_end(va);
+    assert(n >= 0 && n < (int) sizeof(buf));
+    ctx->callback(buf, n, ctx->userp);
+}
+
+/* Emits [str] as the body of a C string literal */
+static void gen_cstr(GenContext *ctx, const char *str, long len)
+{
+    long i = 0;
+    while(i < len) {
+
+        long j = i;
+        while(j < len && isprint((unsigned char) str[j]) 
+                      && str[j] != '"' && str[j] != '\\' 
+                      && str[j] != '?')
+            j += 1;
+
+        if(j > i)
+            ctx->callback(str + i, j - i, ctx->userp);
+
+        if(j < len) {
+            if(str[j] == '\n')
+                genf(ctx, (j+1 < len) ? "\\n\"\n    \"" : "\\n");
+            else
+                genf(ctx, "\\%03o", (unsigned char) str[j]);
+            j += 1;
+        }
+        i = j;
+    }
+}
+
+/* Emits a call to [xt_rt_error] reporting an error at 
+ * offset [off], followed by a jump to the cleanup code.
+ * The [args] are pasted after the format string.
+ */
+static void gen_error(GenContext *ctx, int indent, long off, 
+                      const char *fmt, const char *args)
+{
+    XT_Error pos = { .off = off };
+    locate_error(&pos, ctx->tmpl->src, ctx->tmpl->len);
+    genf(ctx, "%*sxt_rt_error(err, %ld, %ld, %ld, \"%s\"%s);\n", 
+         indent, "", off, pos.row, pos.col, fmt, args);
+    genf(ctx, "%*sgoto failed;\n", indent, "");
+    ctx->can_fail = true;
+}
+
+/* Like [gen_error], but the message is in [errmsg] and
+ * is followed by the [len] bytes of [name] in brackets.
+ * The format string is the C expression [fmt].
+ */
+static void gen_named_error(GenContext *ctx, int indent, long off, 
+                            const char *fmt, const char *name, int len)
+{
+    XT_Error pos = { .off = off };
+    locate_error(&pos, ctx->tmpl->src, ctx->tmpl->len);
+    genf(ctx, "%*sxt_rt_error(err, %ld, %ld, %ld, %s, errmsg, %d, \"", 
+         indent, "", off, pos.row, pos.col, fmt, len);
+    gen_cstr(ctx, name, len);
+    genf(ctx, "\");\n%*sgoto failed;\n", indent, "");
+    ctx->can_fail = true;
+}
+
+/* Emits the statements that drop the reference of an
+ * owned temporary [o] after [t] was looked up in it. 
+ * Since [t] may be owned by [o], a reference to it is
+ * taken first.
+ */
+static void gen_release(GenContext *ctx, int indent, int t, int o)
+{
+    if(!ctx->owned[o])
+        return;
+    genf(ctx, "%*st%d = xt_rt_retain(t%d);\n", indent, "", t, t);
+    genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", o);
+    ctx->owned[t] = true;
+}
+
+/* Emits the statements that evaluate expression [idx]
+ * and returns the number of the temporary holding the 
+ * result. The [loop_idx] and [loop_coll] arrays map a
+ * loop nesting level to the names of its index and 
+ * the temporary holding its collection.
+ */
+static int gen_expr(GenContext *ctx, int idx, int indent, 
+                    const long *loop_idx, const int *loop_coll)
+{
+    const Expr *expr = &ctx->tmpl->nodes[idx];
+    int t;
+
+    switch(expr->kind) {
+
+        case EK_INT:
+        t = ctx->temp++;
+        genf(ctx, "%*st%d = (Value) { VK_INT, .as_int = %lldLL };\n", indent, "", t, expr->as_int);
+        return t;
+
+        case EK_FLOAT:
+        t = ctx->temp++;
+        genf(ctx, "%*st%d = (Value) { VK_FLOAT, .as_float = %.17g };\n", indent, "", t, expr->as_float);
+        return t;
+
+        case EK_STRING:
+        t = ctx->temp++;
+        genf(ctx, "%*st%d = (Value) { VK_STRING, %d, .as_str = \"", indent, "", t, expr->str.len);
+        gen_cstr(ctx, ctx->tmpl->src + expr->off + 1, expr->str.len);
+        genf(ctx, "\" };\n");
+        return t;
+
+        case EK_LOCAL:
+        {
+            int depth = expr->slot / 2;
+            t = ctx->temp++;
+            if(expr->slot >= 2 * MAX_DEPTH)
+                genf(ctx, "%*st%d = l%d;\n", indent, "", t, expr->slot - 2 * MAX_DEPTH);
+            else if(expr->slot % 2 == 0)
+                genf(ctx, "%*st%d = (Value) { VK_INT, .as_int = i%ld };\n", indent, "", t, loop_idx[depth]);
+            else
+                genf(ctx, "%*st%d = (t%d.kind == VK_ARRAY) ? xt_array_get(t%d.as_array, i%ld) : v%ld;\n", 
+                     indent, "", t, loop_coll[depth], loop_coll[depth], loop_idx[depth], loop_idx[depth]);
+            return t;
+        }
+
+        case EK_VAR:
+        {
+            // Each name is looked up the first time it's 
+            // evaluated, then the value is reused.
+            const char *name = ctx->tmpl->src + expr->off;
+            int n = ctx->names[idx];
+            t = ctx->temp++;
+            genf(ctx, "%*sif(!n%d_set) {\n", indent, "", n);
+            genf(ctx, "%*sif(!xt_rt_lookup(vars, \"", indent+4, "");
+            gen_cstr(ctx, name, expr->var.len);
+            genf(ctx, "\", %ld, &n%d)) {\n", expr->var.len, n);
+            genf(ctx, "%*sxt_rt_error(err, ", indent+8, "");
+            XT_Error pos = { .off = expr->off };
+            locate_error(&pos, ctx->tmpl->src, ctx->tmpl->len);
+            genf(ctx, "%ld, %ld, %ld, \"Undefined variable [%%.*s]\", %ld, \"", 
+                 expr->off, pos.row, pos.col, expr->var.len);
+            gen_cstr(ctx, name, expr->var.len);
+            genf(ctx, "\");\n%*sgoto failed;\n", indent+8, "");
+            genf(ctx, "%*s}\n", indent+4, "");
+            genf(ctx, "%*sif(n%d.kind == VK_ERROR) {\n", indent+4, "", n);
+            genf(ctx, "%*serrmsg = n%d.as_str;\n", indent+8, "", n);
+            gen_named_error(ctx, indent+8, expr->off, "strcmp(errmsg, \"Out of memory\") ? \"%s [%.*s]\" : \"%s\"", 
+                            name, expr->var.len);
+            genf(ctx, "%*s}\n", indent+4, "");
+            genf(ctx, "%*sn%d_set = true;\n", indent+4, "", n);
+            genf(ctx, "%*s}\n", indent, "");
+            genf(ctx, "%*st%d = n%d;\n", indent, "", t, n);
+            ctx->can_fail = true;
+            return t;
+        }
+
+        case EK_ARRAY:
+        t = ctx->temp++;
+        ctx->owned[t] = true;
+        genf(ctx, "%*st%d = (Value) { VK_ARRAY, .as_array = &%s_empty_array };\n", indent, "", t, ctx->name);
+        for(int item = expr->array.head; item >= 0; item = ctx->tmpl->nodes[item].next) {
+            int u = gen_expr(ctx, item, indent, loop_idx, loop_coll);
+            genf(ctx, "%*sif(!xt_rt_append(&t%d, t%d, &errmsg)) {\n", indent, "", t, u);
+            gen_error(ctx, indent+4, ctx->tmpl->nodes[item].off, "%s", ", errmsg");
+            genf(ctx, "%*s}\n", indent, "");
+            if(ctx->owned[u])
+                genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", u); // The array has its own reference
+        }
+        return t;
+
+        case EK_BINARY:
+        {
+            static const char *const ops[] = { 
+                [OID_ADD] = "+",  [OID_SUB] = "-",  [OID_MUL] = "*",  [OID_DIV] = "/", 
+                [OID_EQL] = "==", [OID_NQL] = "!=", [OID_LSS] = "<",  [OID_LEQ] = "<=", 
+                [OID_GRT] = ">",  [OID_GEQ] = ">=", [OID_AND] = NULL, [OID_OR]  = NULL,
+            };
+            const char *op = ops[expr->binary.op];
+
+            if(op == NULL) {
+                // The right operand of [and] and [or] is only 
+                // evaluated when the left one doesn't decide.
+                bool is_or = (expr->binary.op == OID_OR);
+                int l = gen_expr(ctx, expr->binary.lhs, indent, loop_idx, loop_coll);
+                t = ctx->temp++;
+
+                // The result gets its own reference to whichever
+                // operand it is.
+                genf(ctx, "%*sif(%sxt_rt_test(t%d))\n", indent, "", is_or ? "" : "!", l);
+                genf(ctx, "%*st%d = xt_rt_retain(t%d);\n", indent+4, "", t, l);
+                genf(ctx, "%*selse {\n", indent, "");
+                if(ctx->owned[l])
+                    genf(ctx, "%*sxt_rt_free(&t%d);\n", indent+4, "", l);
+                int r = gen_expr(ctx, expr->binary.rhs, indent+4, loop_idx, loop_coll);
+                genf(ctx, "%*st%d = xt_rt_retain(t%d);\n", indent+4, "", t, r);
+                if(ctx->owned[r])
+                    genf(ctx, "%*sxt_rt_free(&t%d);\n", indent+4, "", r);
+                genf(ctx, "%*s}\n", indent, "");
+                if(ctx->owned[l])
+                    genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", l);
+                ctx->owned[t] = true;
+                return t;
+            }
+
+            int l = gen_expr(ctx, expr->binary.lhs, indent, loop_idx, loop_coll);
+            int r = gen_expr(ctx, expr->binary.rhs, indent, loop_idx, loop_coll);
+            t = ctx->temp++;
+            // Integer division by zero or by -1 (which overflows
+            // for LLONG_MIN) goes through the runtime, which
+            // reports the errors.
+            if(expr->binary.op == OID_DIV)
+                genf(ctx, "%*sif(t%d.kind == VK_INT && t%d.kind == VK_INT && t%d.as_int != 0 && t%d.as_int != -1)\n", indent, "", l, r, r, r);
+            else
+                genf(ctx, "%*sif(t%d.kind == VK_INT && t%d.kind == VK_INT)\n", indent, "", l, r);
+            genf(ctx, "%*st%d = (Value) { VK_INT, .as_int = t%d.as_int %s t%d.as_int };\n", indent+4, "", t, l, op, r);
+            genf(ctx, "%*selse if(!xt_rt_apply(\"%s\", t%d, t%d, &t%d, &errmsg)) {\n", indent, "", op, l, r, t);
+            gen_error(ctx, indent+4, expr->off, "%s", ", errmsg");
+            genf(ctx, "%*s}\n", indent, "");
+            if(ctx->owned[l])
+                genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", l);
+            if(ctx->owned[r])
+                genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", r);
+            return t;
+        }
+
+        case EK_NOT:
+        {
+            int u = gen_expr(ctx, expr->operand, indent, loop_idx, loop_coll);
+            t = ctx->temp++;
+            genf(ctx, "%*st%d = (Value) { VK_INT, .as_int = !xt_rt_test(t%d) };\n", indent, "", t, u);
+            if(ctx->owned[u])
+                genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", u);
+            return t;
+        }
+
+        case EK_FMT:
+        {
+            // Printed by [gen_range] when it's the whole
+            // expression. The node has no temporary.
+            t = gen_expr(ctx, expr->fmt.obj, indent, loop_idx, loop_coll);
+            gen_error(ctx, indent, expr->off, "Can only be printed [fmt]", "");
+            return t;
+        }
+
+        case EK_ESCAPE:
+        {
+            // Like [fmt], only handled at the root
+            char msg[64];
+            snprintf(msg, sizeof(msg), "Can only be printed [%.*s]", expr->escape.len, ctx->tmpl->src + expr->off);
+            t = gen_expr(ctx, expr->escape.obj, indent, loop_idx, loop_coll);
+            gen_error(ctx, indent, expr->off, msg, "");
+            return t;
+        }
+
+        case EK_FIELD:
+        {
+            const char *name = ctx->tmpl->src + expr->off;
+            int o = gen_expr(ctx, expr->field.obj, indent, loop_idx, loop_coll);
+            t = ctx->temp++;
+            genf(ctx, "%*sif(!xt_rt_field(t%d, \"", indent, "", o);
+            gen_cstr(ctx, name, expr->field.len);
+            genf(ctx, "\", %d, %uu, &t%d, &errmsg)) {\n", expr->field.len, expr->field.hash, t);
+            gen_named_error(ctx, indent+4, expr->off, "\"%s [%.*s]\"", name, expr->field.len);
+            genf(ctx, "%*s}\n", indent, "");
+            gen_release(ctx, indent, t, o);
+            return t;
+        }
+
+        case EK_INDEX:
+        {
+            int o = gen_expr(ctx, expr->index.obj, indent, loop_idx, loop_coll);
+            int k = gen_expr(ctx, expr->index.key, indent, loop_idx, loop_coll);
+            t = ctx->temp++;
+            genf(ctx, "%*sif(!xt_rt_index(t%d, t%d, &t%d, &errmsg)) {\n", indent, "", o, k, t);
+            gen_error(ctx, indent+4, expr->off, "%s", ", errmsg");
+            genf(ctx, "%*s}\n", indent, "");
+            gen_release(ctx, indent, t, o);
+            if(ctx->owned[k])
+                genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", k);
+            return t;
+        }
+
+        case EK_SLICE:
+        {
+            int o = gen_expr(ctx, expr->slice.obj, indent, loop_idx, loop_coll);
+            int lo = -1, hi = -1;
+            if(expr->slice.start >= 0)
+                lo = gen_expr(ctx, expr->slice.start, indent, loop_idx, loop_coll);
+            if(expr->slice.stop >= 0)
+                hi = gen_expr(ctx, expr->slice.stop, indent, loop_idx, loop_coll);
+            t = ctx->temp++;
+            ctx->owned[t] = true;
+            genf(ctx, "%*sif(!xt_rt_slice(t%d, ", indent, "", o);
+            if(lo < 0)
+                genf(ctx, "(Value) { VK_INT, .as_int = 0 }, ");
+            else
+                genf(ctx, "t%d, ", lo);
+            if(hi < 0)
+                genf(ctx, "(Value) { VK_INT, .as_int = %lldLL }, ", LLONG_MAX);
+            else
+                genf(ctx, "t%d, ", hi);
+            genf(ctx, "&t%d, &errmsg)) {\n", t);
+            gen_error(ctx, indent+4, expr->off, "%s", ", errmsg");
+            genf(ctx, "%*s}\n", indent, "");
+
+            // The slice holds its own reference to the array
+            int operands[] = { o, lo, hi };
+            for(int k = 0; k < 3; k += 1)
+                if(operands[k] >= 0 && ctx->owned[operands[k]])
+                    genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", operands[k]);
+            return t;
+        }
+
+        case EK_CALL:
+        {
+            // Bindings made by [xt_bind] can't be named by the
+            // generated code, so functions are looked up by name
+            // (builtins first, like when compiling).
+            const char *name = ctx->tmpl->src + expr->off;
+            int args[MAX_ARGS];
+            int argc = 0;
+            for(int arg = expr->call.head; arg >= 0; arg = ctx->tmpl->nodes[arg].next)
+                args[argc++] = gen_expr(ctx, arg, indent, loop_idx, loop_coll);
+            t = ctx->temp++;
+            ctx->owned[t] = true; // The result is retained by [xt_rt_call]
+            genf(ctx, "%*sif(!xt_rt_%s(vars, \"", indent, "", expr->call.filter ? "filter" : "call");
+            gen_cstr(ctx, name, expr->call.len);
+            genf(ctx, "\", %d, ", expr->call.len);
+            if(argc == 0)
+                genf(ctx, "NULL, 0");
+            else {
+                genf(ctx, "(Value[]) { ");
+                for(int k = 0; k < argc; k += 1)
+                    genf(ctx, k ? ", t%d" : "t%d", args[k]);
+                genf(ctx, " }, %d", argc);
+            }
+            genf(ctx, ", &t%d, &errmsg)) {\n", t);
+            gen_named_error(ctx, indent+4, expr->off, "strcmp(errmsg, \"Out of memory\") ? \"%s [%.*s]\" : \"%s\"", 
+                            name, expr->call.len);
+            genf(ctx, "%*s}\n", indent, "");
+            for(int k = 0; k < argc; k += 1)
+                if(ctx->owned[args[k]])
+                    genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", args[k]);
+            return t;
+        }
+    }
+
+    /* Unreachable */
+    assert(0);
+    return -1;
+}
+
+/* Returns the expression printed by [instr] without
+ * the escaping filter at its root, if there's one, and
+ * stores in [mode] how it's escaped.
+ */
+static int print_root(const XT_Template *tmpl, Instr instr, XT_Escape *mode)
+{
+    const Expr *expr = &tmpl->nodes[instr.expr];
+    if(expr->kind == EK_ESCAPE) {
+        *mode = expr->escape.mode;
+        return expr->escape.obj;
+    }
+    *mode = tmpl->escape;
+    return instr.expr;
+}
+
+/* Tells whether [instr] prints the result of a [join]
+ * filter, which is written directly. The call doesn't 
+ * get a temporary.
+ */
+static bool prints_join(const XT_Template *tmpl, Instr instr)
+{
+    if(instr.op != OP_PRINT)
+        return false;
+    XT_Escape mode;
+    const Expr *expr = &tmpl->nodes[print_root(tmpl, instr, &mode)];
+    return expr->kind == EK_CALL && expr->call.func == filter_join;
+}
+
+/* Emits the code printing the result of the [join] 
+ * call [idx].
+ */
+static void gen_join(GenContext *ctx, int idx, XT_Escape mode, int indent, 
+                     long *loop_idx, int *loop_coll)
+{
+    const Expr *expr = &ctx->tmpl->nodes[idx];
+    int args[MAX_ARGS];
+    int argc = 0;
+    for(int arg = expr->call.head; arg >= 0; arg = ctx->tmpl->nodes[arg].next)
+        args[argc++] = gen_expr(ctx, arg, indent, loop_idx, loop_coll);
+
+    genf(ctx, "%*sif(!xt_rt_join((Value[]) { ", indent, "");
+    for(int k = 0; k < argc; k += 1)
+        genf(ctx, k ? ", t%d" : "t%d", args[k]);
+    genf(ctx, " }, %d, %d, callback, userp, &errmsg)) {\n", argc, mode);
+    gen_named_error(ctx, indent+4, expr->off, "\"%s [%.*s]\"", 
+                    ctx->tmpl->src + expr->off, expr->call.len);
+    genf(ctx, "%*s}\n", indent, "");
+    for(int k = 0; k < argc; k += 1)
+        if(ctx->owned[args[k]])
+            genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", args[k]);
+}
+
+/* Emits the code for the instructions in [start, end).
+ * Loops are emitted as nested C loops, so a range never
+ * starts or ends in the middle of a loop body.
+ */
+static void gen_range(GenContext *ctx, long start, long end, int indent, 
+                      long *loop_idx, int *loop_coll)
+{
+    const Instr *code = ctx->tmpl->code;
+
+    long pc = start;
+    while(pc < end) {
+
+        if(ctx->labelled[pc])
+            genf(ctx, "L%ld:;\n", pc);
+
+        Instr instr = code[pc];
+        switch(instr.op) {
+
+            case OP_TEXT:
+            genf(ctx, "%*scallback(%s_text_%ld, sizeof(%s_text_%ld)-1, userp);\n", indent, "", ctx->name, pc, ctx->name, pc);
+            pc += 1;
+            break;
+
+            case OP_PRINT:
+            {
+                XT_Escape mode;
+                int root = print_root(ctx->tmpl, instr, &mode);
+                if(prints_join(ctx->tmpl, instr)) {
+                    gen_join(ctx, root, mode, indent, loop_idx, loop_coll);
+                    pc += 1;
+                    break;
+                }
+                const Expr *expr = &ctx->tmpl->nodes[root];
+                if(expr->kind == EK_FMT) {
+                    int t = gen_expr(ctx, expr->fmt.obj, indent, loop_idx, loop_coll);
+                    genf(ctx, "%*sif(!xt_rt_fmt(t%d, &%s_fmt_%d, %d, callback, userp, &errmsg)) {\n", indent, "", t, ctx->name, root, mode);
+                    gen_named_error(ctx, indent+4, expr->off, "\"%s [%.*s]\"", "fmt", 3);
+                    genf(ctx, "%*s}\n", indent, "");
+                    if(ctx->owned[t])
+                        genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", t);
+                    pc += 1;
+                    break;
+                }
+                int t = gen_expr(ctx, root, indent, loop_idx, loop_coll);
+                if(mode == XT_ESCAPE_NONE)
+                    genf(ctx, "%*sxt_rt_print(t%d, callback, userp);\n", indent, "", t);
+                else
+                    genf(ctx, "%*sxt_rt_escape(t%d, %d, callback, userp);\n", indent, "", t, mode);
+                if(ctx->owned[t])
+                    genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", t);
+                pc += 1;
+                break;
+            }
+
+            case OP_BRANCH:
+            {
+                int t = gen_expr(ctx, instr.expr, indent, loop_idx, loop_coll);
+                genf(ctx, "%*sr = !xt_rt_test(t%d);\n", indent, "", t);
+                if(ctx->owned[t])
+                    genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", t);
+                genf(ctx, "%*sif(r) goto L%ld;\n", indent, "", instr.target);
+                pc += 1;
+                break;
+            }
+
+            case OP_JUMP:
+            genf(ctx, "%*sgoto L%ld;\n", indent, "", instr.target);
+            pc += 1;
+            break;
+
+            case OP_FOR:
+            {
+                int depth = instr.depth;
+                int t = gen_expr(ctx, instr.expr, indent, loop_idx, loop_coll);
+                genf(ctx, "%*sif(t%d.kind != VK_ARRAY && t%d.kind != VK_ITER) {\n", indent, "", t, t);
+                gen_error(ctx, indent+4, ctx->tmpl->nodes[instr.expr].off, "Iteration subject isn't an array or an iterator", "");
+                genf(ctx, "%*s}\n", indent, "");
+
+                // Items of arrays are read in place, the ones of
+                // iterators are pulled into [v] by [xt_rt_next].
+                genf(ctx, "%*sValue v%ld = { VK_INT, .as_int = 0 };\n", indent, "", pc);
+                genf(ctx, "%*sfor(long i%ld = 0; (t%d.kind == VK_ARRAY) ? i%ld < t%d.as_array->count : xt_rt_next(t%d, i%ld, &v%ld); i%ld += 1) {\n", 
+                     indent, "", pc, t, pc, t, t, pc, pc, pc);
+
+                loop_idx[depth] = pc;
+                loop_coll[depth] = t;
+
+                // The OP_NEXT closing the loop comes right 
+                // before its exit target.
+                long next = instr.target - 1;
+                assert(code[next].op == OP_NEXT && code[next].depth == depth);
+                gen_range(ctx, pc + 1, next, indent + 4, loop_idx, loop_coll);
+
+                genf(ctx, "%*s}\n", indent, "");
+                if(ctx->owned[t])
+                    genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", t);
+                pc = instr.target;
+                break;
+            }
+
+            case OP_NEXT:
+            /* Unreachable: consumed by OP_FOR */
+            assert(0);
+            break;
+
+            case OP_SET:
+            {
+                // The old value is dropped after the new one
+                // was retained, since it may be the same.
+                int t = gen_expr(ctx, instr.expr, indent, loop_idx, loop_coll);
+                int l = instr.depth - 2 * MAX_DEPTH;
+                genf(ctx, "%*s{ Value old = l%d; l%d = xt_rt_retain(t%d); xt_rt_free(&old); }\n", indent, "", l, l, t);
+                if(ctx->owned[t])
+                    genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", t);
+                pc += 1;
+                break;
+            }
+
+            case OP_CACHE:
+            {
+                // The generated code has no cache, so only
+                // the key is evaluated, for its errors.
+                int t = gen_expr(ctx, instr.expr, indent, loop_idx, loop_coll);
+                genf(ctx, "%*s(void) t%d;\n", indent, "", t);
+                if(ctx->owned[t])
+                    genf(ctx, "%*sxt_rt_free(&t%d);\n", indent, "", t);
+                pc += 1;
+                break;
+            }
+
+            case OP_ENDCACHE:
+            case OP_SEGMENT:
+            pc += 1;
+            break;
+
+            case OP_HALT:
+            for(int l = 0; l < ctx->tmpl->local_count; l += 1)
+                genf(ctx, "%*sxt_rt_free(&l%d);\n", indent, "", l);
+            genf(ctx, "%*sreturn 1;\n", indent, "");
+            pc += 1;
+            break;
+        }
+    }
+
+    // A jump may target the end of a loop body
+    if(end < ctx->tmpl->code_count && ctx->labelled[end] && code[end].op == OP_NEXT)
+        genf(ctx, "L%ld:;\n", end);
+}
+
+/* Returns the number of temporaries [gen_expr] uses for
+ * expression [idx], one per node, and marks its nodes
+ * as [reached]. Nodes that aren't referenced by any 
+ * instruction (like the ones left behind by 
+ * [xt_specialize]) get none.
+ */
+static int count_temps(XT_Template *tmpl, int idx, bool *reached)
+{
+    const Expr *expr = &tmpl->nodes[idx];
+    int count = 1;
+    reached[idx] = true;
+    switch(expr->kind) {
+
+        case EK_ARRAY:
+        for(int item = expr->array.head; item >= 0; item = tmpl->nodes[item].next)
+            count += count_temps(tmpl, item, reached);
+        break;
+
+        case EK_BINARY:
+        count += count_temps(tmpl, expr->binary.lhs, reached);
+        count += count_temps(tmpl, expr->binary.rhs, reached);
+        break;
+
+        case EK_NOT:
+        count += count_temps(tmpl, expr->operand, reached);
+        break;
+
+        case EK_FMT:
+        count = count_temps(tmpl, expr->fmt.obj, reached);
+        break;
+
+        case EK_ESCAPE:
+        count = count_temps(tmpl, expr->escape.obj, reached);
+        break;
+
+        case EK_FIELD:
+        count += count_temps(tmpl, expr->field.obj, reached);
+        break;
 
-static inline long preced_of(OperatID operat)
-{
-    static const long map[] = {
-        [OID_ADD] = 0,
-        [OID_SUB] = 0,
-        [OID_MUL] = 1,
-        [OID_DIV] = 1,
-    };
-    return map[operat];
+        case EK_INDEX:
+        count += count_temps(tmpl, expr->index.obj, reached);
+        count += count_temps(tmpl, expr->index.key, reached);
+        break;
+
+        case EK_SLICE:
+        count += count_temps(tmpl, expr->slice.obj, reached);
+        if(expr->slice.start >= 0)
+            count += count_temps(tmpl, expr->slice.start, reached);
+        if(expr->slice.stop >= 0)
+            count += count_temps(tmpl, expr->slice.stop, reached);
+        break;
+
+        case EK_CALL:
+        for(int arg = expr->call.head; arg >= 0; arg = tmpl->nodes[arg].next)
+            count += count_temps(tmpl, arg, reached);
+        break;
+
+        default:break;
+    }
+    return count;
 }
 
-static inline bool is_right_assoc(OperatID operat)
+/* The name is pasted in the lines formatted by [genf],
+ * so it's kept well below the size of its buffer.
+ */
+static bool is_c_identifier(const char *name)
 {
-    (void) operat;
-    return 0;
+    if(!isalpha((unsigned char) name[0]) && name[0] != '_')
+        return 0;
+    for(long i = 1; name[i] != '\0'; i += 1)
+        if(i == 64 || (!isalnum((unsigned char) name[i]) && name[i] != '_'))
+            return 0;
+    return 1;
 }
 
-static Value eval_expr_1(EvalContext *ctx, Value lhs, long min_preced)
+bool xt_emit_c(XT_Template *tmpl, const char *name, 
+               xt_callback callback, void *userp, XT_Error *err)
 {
-    if(lhs.kind == VK_ERROR)
-        return lhs;
-
-    OperatID operat;
-    long operat_off = ctx->i;
-    while(next_binary_operat(ctx, &operat, &operat_off) && preced_of(operat) >= min_preced) {
-
-        Value rhs = eval_primary(ctx);
-        if(rhs.kind == VK_ERROR) {
-            assert(ctx->err->occurred);
-            return rhs;
-        }
+    memset(err, 0, sizeof(XT_Error));
 
-        OperatID operat2;
-        long operat2_off = ctx->i;
-        while(next_binary_operat(ctx, &operat2, &operat2_off) && (preced_of(operat2) > preced_of(operat) || (is_right_assoc(operat2) && preced_of(operat) == preced_of(operat2)))) {
+    if(!is_c_identifier(name)) {
+        report(err, -1, "[%s] isn't a valid C function name", name);
+        return 0;
+    }
 
-            ctx->i = operat2_off;
+    bool *flags = malloc(2 * tmpl->node_count + tmpl->code_count + 1);
+    int  *names = malloc(tmpl->node_count * sizeof(int) + 1);
+    if(flags == NULL || names == NULL) {
+        report(err, -1, "Out of memory");
+        free(flags);
+        free(names);
+        return 0;
+    }
+    memset(flags, 0, 2 * tmpl->node_count + tmpl->code_count + 1);
+    bool *reached = flags + tmpl->node_count + tmpl->code_count + 1;
 
-            long preced = preced_of(operat) 
-                        + (preced_of(operat2) > preced_of(operat));
+    GenContext ctx = {
+        .tmpl = tmpl,
+        .name = name,
+        .callback = callback,
+        .userp = userp,
+        .temp = 0,
+        .owned = flags,
+        .labelled = flags + tmpl->node_count,
+        .names = names,
+    };
 
-            rhs = eval_expr_1(ctx, rhs, preced);
-            if(rhs.kind == VK_ERROR) {
-                assert(ctx->err->occurred);
-                return rhs;
+    for(long pc = 0; pc < tmpl->code_count; pc += 1)
+        if(tmpl->code[pc].op == OP_BRANCH || tmpl->code[pc].op == OP_JUMP)
+            ctx.labelled[tmpl->code[pc].target] = true;
+
+    genf(&ctx, "/* Generated by xtmpl. Do not edit. */\n"
+               "#include <string.h>\n"
+               "#include \"xtmpl_rt.h\"\n\n");
+
+    int temps = 0;
+    for(long pc = 0; pc < tmpl->code_count; pc += 1)
+        if(tmpl->code[pc].op == OP_PRINT || tmpl->code[pc].op == OP_BRANCH || 
+           tmpl->code[pc].op == OP_FOR   || tmpl->code[pc].op == OP_SET || tmpl->code[pc].op == OP_CACHE)
+            temps += count_temps(tmpl, tmpl->code[pc].expr, reached) - prints_join(tmpl, tmpl->code[pc]);
+
+    // Lookups of the same name share the variable holding
+    // the value, which is named after the first of them.
+    bool arrays = false;
+    for(int k = 0; k < tmpl->node_count; k += 1) {
+        const Expr *expr = &tmpl->nodes[k];
+        if(!reached[k])
+            continue;
+        if(expr->kind == EK_ARRAY)
+            arrays = true;
+        if(expr->kind != EK_VAR)
+            continue;
+        names[k] = k;
+        for(int j = 0; j < k; j += 1)
+            if(reached[j] && tmpl->nodes[j].kind == EK_VAR && tmpl->nodes[j].var.len == expr->var.len
+                && !strncmp(tmpl->src + tmpl->nodes[j].off, tmpl->src + expr->off, expr->var.len)) {
+                names[k] = j;
+                break;
             }
-            operat2_off = ctx->i;
-        }
-        ctx->i = operat2_off;
+    }
 
-        const char *errmsg;
-        lhs = apply(operat, lhs, rhs, &errmsg);
+    // Array literals start out as the same empty array.
+    // The statics are named after the function, so that
+    // more of them can be generated in the same file.
+    if(arrays)
+        genf(&ctx, "static ArrayValue %s_empty_array;\n\n", name);
+
+    for(long pc = 0; pc < tmpl->code_count; pc += 1)
+        if(tmpl->code[pc].op == OP_TEXT) {
+            genf(&ctx, "static const char %s_text_%ld[] = \"", name, pc);
+            gen_cstr(&ctx, tmpl->src + tmpl->code[pc].off, tmpl->code[pc].len);
+            genf(&ctx, "\";\n");
+        }
 
-        if(lhs.kind == VK_ERROR) {
-            assert(!ctx->err->occurred);
-            report(ctx->err, operat_off, "%s", errmsg);
-            return lhs;
+    // Format specs are emitted already parsed
+    for(int k = 0; k < tmpl->node_count; k += 1)
+        if(reached[k] && tmpl->nodes[k].kind == EK_FMT) {
+            XT_FmtSpec spec = tmpl->nodes[k].fmt.spec;
+            genf(&ctx, "static const XT_FmtSpec %s_fmt_%d = { %d, %d, %d, %d, %d, %d, %d, %d };\n", name, k, 
+                 spec.fill, spec.align, spec.sign, spec.type, spec.zero, spec.group, spec.width, spec.prec);
         }
-        operat_off = ctx->i;
+
+    genf(&ctx, "\nbool %s(const char *str, long len, Variables *vars, \n"
+               "    xt_callback callback, void *userp, XT_Error *err)\n{\n"
+               "    (void) str;\n"
+               "    (void) len;\n"
+               "    (void) vars;\n"
+               "    (void) callback;\n"
+               "    (void) userp;\n"
+               "    const char *errmsg;\n"
+               "    bool r;\n"
+               "    (void) errmsg;\n"
+               "    (void) r;\n", name);
+
+    for(int t = 0; t < temps; t += 1)
+        genf(&ctx, "    Value t%d = { VK_INT, .as_int = 0 };\n", t);
+    for(int l = 0; l < tmpl->local_count; l += 1)
+        genf(&ctx, "    Value l%d = { VK_INT, .as_int = 0 };\n", l);
+    for(int k = 0; k < tmpl->node_count; k += 1)
+        if(reached[k] && tmpl->nodes[k].kind == EK_VAR && names[k] == k)
+            genf(&ctx, "    Value n%d;\n    bool n%d_set = false;\n", k, k);
+
+    genf(&ctx, "    memset(err, 0, sizeof(XT_Error));\n");
+
+    long loop_idx[MAX_DEPTH];
+    int  loop_coll[MAX_DEPTH];
+    gen_range(&ctx, 0, tmpl->code_count, 4, loop_idx, loop_coll);
+    assert(ctx.temp == temps);
+
+    if(ctx.can_fail) {
+        genf(&ctx, "\nfailed:\n");
+        for(int t = 0; t < temps; t += 1)
+            if(ctx.owned[t])
+                genf(&ctx, "    xt_rt_free(&t%d);\n", t);
+        for(int l = 0; l < tmpl->local_count; l += 1)
+            genf(&ctx, "    xt_rt_free(&l%d);\n", l);
+        genf(&ctx, "    return 0;\n");
     }
-    ctx->i = operat_off;
-    return lhs;
+    genf(&ctx, "}\n");
+
+    free(flags);
+    free(names);
+    return 1;
 }
 
-static Value eval_inner(EvalContext *ctx)
+Value xt_array_get(const ArrayValue *array, long idx)
 {
-    return eval_expr_1(ctx, eval_primary(ctx), 0);
+    assert(idx >= 0 && idx < array->count);
+    return array_get(array, idx);
 }
 
-static Value eval(const char *str, long len, Variables *vars, XT_Error *err)
+/* Fills [view] so that it describes the [count] items 
+ * of type [type] starting at [data], [stride] bytes 
+ * apart (or next to each other if [stride] is 0), and
+ * returns an array value referring to it. Nothing is
+ * copied: both [view] and [data] are borrowed and must
+ * outlive the renders that use the value.
+ */
+Value xt_array_view(ArrayValue *view, const void *data, long count, ArrayType type, long stride)
 {
-    EvalContext ctx = {
-        .vars = vars,
-         .err = err,
-         .str = str,
-         .len = len,
-           .i = 0,
-    };
-    Value val = eval_inner(&ctx);
-    if(val.kind == VK_ERROR)
-        assert(err == NULL || err->occurred == true);
-    return val;
+    assert(count >= 0 && count <= INT_MAX);
+
+    view->refs = 0;
+    view->count = count;
+    view->capacity = count;
+    view->type = type;
+    view->items = (Value*) data;
+    view->stride = stride;
+    view->base = NULL;
+
+    // Densely packed and aligned views can use the same
+    // path as the arrays built while rendering.
+    if(stride == (long) array_type_size(type) && (uintptr_t) data % sizeof(long long) == 0)
+        view->stride = 0;
+    return (Value) { VK_ARRAY, .as_array = view };
 }
 
-static bool iskword(const char *str, long len)
+/* Returns a string value referring to [str]. When [len]
+ * is negative, [str] must be null terminated. 
+ */
+Value xt_string(const char *str, long len)
 {
-    static struct {
-        char str[6];
-        long len;
-    } kwords[] = {
-        #define KWORD(lit) { lit, sizeof(lit)-1 }
-        KWORD("in"),
-        KWORD("if"),
-        KWORD("for"),
-        KWORD("else"),
-        KWORD("endif"),
-        KWORD("endfor"),
-        #undef KWORD
-    };
+    if(len < 0)
+        len = strlen(str);
+    assert(len <= INT_MAX);
+    return (Value) { VK_STRING, len, .as_str = str };
+}
 
-    for(unsigned int i = 0; i < sizeof(kwords)/sizeof(kwords[0]); i += 1)
-        if(len == kwords[i].len && !memcmp(str, kwords[i].str, len))
-            return 1;
-    return 0;
+Value xt_func(FuncValue func)
+{
+    return (Value) { VK_FUNC, .as_func = func };
 }
 
-static bool parse_for_statement(const char *str, long len, 
-                               char *var1, char *var2, long var_max, 
-                               long *coll_off, long *coll_len,
-                               XT_Error *err)
+/* Makes [map] an empty map using [table] for its 
+ * entries and returns a value referring to it. The
+ * [capacity] must be a power of 2, and since one slot
+ * is always kept free, the map can hold up to 
+ * [capacity]-1 entries. Both [map] and [table] are 
+ * borrowed and must outlive the renders using them.
+ */
+Value xt_map_view(MapValue *map, MapEntry *table, int capacity)
 {
-    /* [str] must contain a string in one of the
-     * following forms:
-     *   A    in C
-     *   A, B in C
-     *
-     * where A and B are variable names and C is an
-     * expression.
-     *
-     * Variable names can contain alphabetical 
-     * characters, digits or _, but the first 
-     * character can't be a digit).
-     *
-     * Whitespace between elements must not matter.
-     */
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
 
-    long i = 0;
+    for(int i = 0; i < capacity; i += 1)
+        table[i].key = NULL;
 
-    // Skip spaces before "A"
-    while(i < len && isspace(str[i]))
-        i += 1;
+    map->refs = 0;
+    map->count = 0;
+    map->capacity = capacity;
+    map->entries = table;
+    return (Value) { VK_MAP, .as_map = map };
+}
 
-    if(i == len) {
-        report(err, i, "For statement ended unexpectedly");
+/* Sets field [key] of [map] to [value]. The key isn't
+ * copied. Returns false if the table is full.
+ */
+bool xt_map_put(MapValue *map, const char *key, long len, Value value)
+{
+    if(len < 0)
+        len = strlen(key);
+    if(len > INT_MAX)
         return 0;
-    }
 
-    {
-        // We expect the first character of "A"
-        if(!isalpha(str[i]) && str[i] != '_') {
-            report(err, i, "Missing iteration variable name after [for] keyword");
+    unsigned int hash = hash_key(key, len);
+    MapEntry *entry = map_slot(map, key, len, hash);
+    if(entry->key == NULL) {
+        if(map->count + 1 >= map->capacity)
             return 0;
-        }
+        *entry = (MapEntry) { key, len, hash, value };
+        map->count += 1;
+    } else
+        entry->value = value;
+    return 1;
+}
 
-        /* Start of "A" */
-        long key_var_off = i;
+bool xt_map_get(const MapValue *map, const char *key, long len, Value *out)
+{
+    if(len < 0)
+        len = strlen(key);
 
-        do 
-            i += 1;
-        while(i < len && (isalpha(str[i]) || isdigit(str[i]) || str[i] == '_'));
+    const char *errmsg;
+    Value obj = { VK_MAP, .as_map = (MapValue*) map };
+    return map_lookup(obj, key, len, hash_key(key, len), out, &errmsg);
+}
 
-        /* End of "A" */
-        long key_var_len = i - key_var_off;
+/*                    FRAGMENT CACHE
+ * [xt_cache_create] returns a cache for the output of 
+ * {% cache %} blocks that lives in memory. Entries are
+ * found through a chained hash table and kept in a list
+ * from the most to the least recently used, so that 
+ * the entries evicted when the cache is over its budget 
+ * are the ones at the tail. The budget counts the keys,
+ * the data and the entries themselves. Expired entries
+ * are dropped when they're looked up.
+ */
 
-        if(iskword(str + key_var_off, key_var_len)) {
-            report(err, key_var_off, 
-                "Unexpected keyword [%.*s] where an iteration "
-                "variable name was expected",
-                (int) key_var_len, str + key_var_off);
-            return 0;
-        }
+typedef struct FragEntry FragEntry;
+struct FragEntry {
+    FragEntry *prev, *next; // Use list
+    FragEntry *chain;       // Next entry of the bucket
+    unsigned int hash;
+    time_t expires; // 0 if it doesn't
+    long keylen, len;
+    char data[]; // The key followed by the data
+};
 
-        if(key_var_len > var_max-1) {
-            report(err, key_var_off, "Variable name [%.*s] is too long (the maximum is %d)", 
-                (int) key_var_len, str + key_var_off, var_max-1);
-            return 0;
-        }
+typedef struct {
+    XT_Cache base;
+    FragEntry **buckets;
+    int  bucket_count;
+    long entry_count;
+    FragEntry *head, *tail;
+    long used, max_bytes;
+    long ttl;
+} FragCache;
+
+static FragEntry **frag_find(FragCache *cache, const char *key, long keylen, unsigned int hash)
+{
+    FragEntry **link = &cache->buckets[hash & (cache->bucket_count - 1)];
+    while(*link && ((*link)->hash != hash || (*link)->keylen != keylen || memcmp((*link)->data, key, keylen)))
+        link = &(*link)->chain;
+    return link;
+}
 
-        memcpy(var1, str + key_var_off, key_var_len);
-        var1[key_var_len] = '\0';
-    }
+static void frag_unlink(FragCache *cache, FragEntry *entry)
+{
+    if(entry->prev) entry->prev->next = entry->next; else cache->head = entry->next;
+    if(entry->next) entry->next->prev = entry->prev; else cache->tail = entry->prev;
+}
 
-    // Skip spaces before "in" or ','
-    while(i < len && isspace(str[i]))
-        i += 1;
+static void frag_push(FragCache *cache, FragEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if(cache->head) cache->head->prev = entry; else cache->tail = entry;
+    cache->head = entry;
+}
 
-    if(i == len) {
-        report(err, i, "For statement ended unexpectedly");
-        return 0;
+static void frag_remove(FragCache *cache, FragEntry *entry)
+{
+    FragEntry **link = frag_find(cache, entry->data, entry->keylen, entry->hash);
+    assert(*link == entry);
+    *link = entry->chain;
+    frag_unlink(cache, entry);
+    cache->used -= sizeof(FragEntry) + entry->keylen + entry->len;
+    cache->entry_count -= 1;
+    free(entry);
+}
+
+static bool frag_get(XT_Cache *base, const char *key, long keylen, const char **data, long *len)
+{
+    FragCache *cache = (FragCache*) base;
+    FragEntry *entry = *frag_find(cache, key, keylen, hash_key(key, keylen));
+    if(entry == NULL)
+        return false;
+
+    if(entry->expires != 0 && time(NULL) >= entry->expires) {
+        frag_remove(cache, entry);
+        return false;
     }
 
-    // If now comes either the "in" keyword or
-    // ',' if "B" was also specified.
-    
-    if(str[i] == ',') {
+    frag_unlink(cache, entry);
+    frag_push(cache, entry);
+    *data = entry->data + entry->keylen;
+    *len  = entry->len;
+    return true;
+}
 
-        i += 1; // Skip ','
+static void frag_put(XT_Cache *base, const char *key, long keylen, const char *data, long len)
+{
+    FragCache *cache = (FragCache*) base;
+    unsigned int hash = hash_key(key, keylen);
 
-        // Skip spaces before "B"
-        while(i < len && isspace(str[i]))
-            i += 1;
+    FragEntry *old = *frag_find(cache, key, keylen, hash);
+    if(old)
+        frag_remove(cache, old);
 
-        if(i == len) {
-            report(err, i, "For statement ended unexpectedly");
-            return 0;
+    long size = sizeof(FragEntry) + keylen + len;
+    if(size > cache->max_bytes)
+        return;
+
+    // The table grows when it has more entries than
+    // buckets. If it can't, it just gets more crowded.
+    if(cache->entry_count == cache->bucket_count) {
+        int count = 2 * cache->bucket_count;
+        FragEntry **buckets = malloc(count * sizeof(FragEntry*));
+        if(buckets) {
+            memset(buckets, 0, count * sizeof(FragEntry*));
+            for(FragEntry *entry = cache->head; entry; entry = entry->next) {
+                FragEntry **link = &buckets[entry->hash & (count - 1)];
+                entry->chain = *link;
+                *link = entry;
+            }
+            free(cache->buckets);
+            cache->buckets = buckets;
+            cache->bucket_count = count;
         }
+    }
 
-        /* Start of "B" */
+    FragEntry *entry = malloc(size);
+    if(entry == NULL)
+        return;
 
-        if(!isalpha(str[i]) && str[i] != '_') {
-            report(err, i, "Missing second iteration variable name after ','");
-            return 0;
-        }
+    while(cache->used + size > cache->max_bytes)
+        frag_remove(cache, cache->tail);
+
+    entry->hash = hash;
+    entry->expires = (cache->ttl > 0) ? time(NULL) + cache->ttl : 0;
+    entry->keylen = keylen;
+    entry->len = len;
+    memcpy(entry->data, key, keylen);
+    memcpy(entry->data + keylen, data, len);
+
+    FragEntry **link = &cache->buckets[hash & (cache->bucket_count - 1)];
+    entry->chain = *link;
+    *link = entry;
+    frag_push(cache, entry);
+    cache->used += size;
+    cache->entry_count += 1;
+}
 
-        long val_var_off = i;
-        do i += 1; while(i < len && (isalpha(str[i]) || isdigit(str[i]) 
-                                 || str[i] == '_'));
-        /* End of B */
-        long val_var_len = i - val_var_off;
+XT_Cache *xt_cache_create(long max_bytes, long ttl)
+{
+    FragCache *cache = malloc(sizeof(FragCache));
+    FragEntry **buckets = malloc(16 * sizeof(FragEntry*));
+    if(cache == NULL || buckets == NULL) {
+        free(cache);
+        free(buckets);
+        return NULL;
+    }
+    memset(buckets, 0, 16 * sizeof(FragEntry*));
+    *cache = (FragCache) {
+        .base = { frag_get, frag_put },
+        .buckets = buckets,
+        .bucket_count = 16,
+        .max_bytes = max_bytes,
+        .ttl = ttl,
+    };
+    return &cache->base;
+}
 
-        if(iskword(str + val_var_off, val_var_len)) {
-            report(err, val_var_off, 
-                "Unexpected keyword [%.*s] where an iteration "
-                "variable name was expected",
-                (int) val_var_len, str + val_var_off);
-            return 0;
+/* Frees a cache returned by [xt_cache_create] */
+void xt_cache_free(XT_Cache *base)
+{
+    FragCache *cache = (FragCache*) base;
+    if(cache) {
+        FragEntry *entry = cache->head;
+        while(entry) {
+            FragEntry *next = entry->next;
+            free(entry);
+            entry = next;
         }
+        free(cache->buckets);
+        free(cache);
+    }
+}
 
-        if(val_var_len > var_max-1) {
-            report(err, val_var_off, "Variable name [%.*s] is too long (the maximum is %d)", 
-                (int) val_var_len, str + val_var_off, var_max-1);
-            return 0;
-        }
+/*                      JSON SCOPES
+ * [xt_json_open] wraps a JSON document whose root is
+ * an object in a scope defining the fields of the root.
+ * Nothing is done until a variable is looked up, which
+ * is when the document is indexed. Like the first stage
+ * of simdjson, indexing is a single pass over the bytes
+ * that records where each token starts, followed by a
+ * pass over the tokens that checks the grammar and links
+ * every [ and { to the token after its closing bracket,
+ * so that whole values can be skipped in constant time.
+ *
+ * A field of the root is decoded the first time it's
+ * looked up, together with everything it contains, and
+ * kept until [xt_json_close]. Fields that are never 
+ * looked up are never decoded. Strings with no escape
+ * sequences refer to the document directly. Decoded 
+ * values are borrowed by the renders, like the ones 
+ * provided by the host. The literals true and false 
+ * become 1 and 0, null becomes 0.
+ */
 
-        memcpy(var2, str + val_var_off, val_var_len);
-        var2[val_var_len] = '\0';
-    } else {
-        // "B" wasn't specified, just write a null byte
-        // to tell the caller it wasn't specified.
-        if(var_max > 0)
-            var2[0] = '\0';
+#define JSON_MAX_DEPTH 512
+
+typedef struct {
+    long off; // Offset of the first byte of the token
+    int  end; // Index of the token after the value starting here
+} JsonToken;
+
+typedef struct JsonChunk JsonChunk;
+struct JsonChunk {
+    JsonChunk *next;
+    size_t     used,
+               size;
+    char    data[];
+};
+
+struct XT_Json {
+    Variables scope;
+    const char *src;
+    long        len;
+
+    int state; // 0 if not indexed yet, 1 if indexed, -1 if malformed
+    XT_Error error;
+
+    JsonToken *tokens;
+    int        token_count,
+           token_max_count;
+
+    // Fields that weren't decoded yet have kind VK_ERROR
+    // and the index of their first token in [as_int].
+    MapValue root;
+
+    JsonChunk *chunks; // Memory of the decoded values
+};
+
+static void *json_alloc(XT_Json *json, size_t size)
+{
+    size = (size + 7) & ~(size_t) 7;
+
+    JsonChunk *chunk = json->chunks;
+    if(chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = (size > 4096) ? size : 4096;
+        chunk = malloc(sizeof(JsonChunk) + chunk_size);
+        if(chunk == NULL)
+            return NULL;
+        chunk->next = json->chunks;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        json->chunks = chunk;
     }
 
-    {
-        // Now skip the spaces before the "in" keyword
-        while(i < len && isspace(str[i]))
-            i += 1;
-        
-        if(i == len) {
-            report(err, i, "For statement ended unexpectedly");
-            return 0;
-        }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
 
-        // Now the "in" keyword is expected
+static bool json_append_token(XT_Json *json, long off)
+{
+    if(json->token_count == json->token_max_count) {
 
-        if(!isalpha(str[i]) && str[i] != '_') {
-            report(err, i, "Missing [in] keyword after iteration variable name");
+        if(json->token_max_count > INT_MAX / 2)
             return 0;
-        }
-
-        long kword_off = i;
-        do
-            i += 1;
-        while(i < len && (isalpha(str[i]) || isdigit(str[i]) || str[i] == '_'));
-        long kword_len = i - kword_off;
 
-        assert(kword_len > 0);
+        int new_max_count;
+        if(json->token_max_count == 0)
+            new_max_count = 64;
+        else
+            new_max_count = 2 * json->token_max_count;
 
-        if(kword_len != 2 || str[kword_off] != 'i' || str[kword_off+1] != 'n') {
-            report(err, i, "Missing [in] keyword after iteration variable name");
+        void *temp = realloc(json->tokens, new_max_count * sizeof(JsonToken));
+        if(temp == NULL)
             return 0;
-        }
+
+        json->tokens = temp;
+        json->token_max_count = new_max_count;
     }
 
-    *coll_off = i;
-    *coll_len = len - i;
-    return 1;
+    int idx = json->token_count++;
+    json->tokens[idx] = (JsonToken) { off, idx + 1 };
+    return 1;
+}
+
+static bool is_json_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool is_json_delim(char c)
+{
+    return is_json_space(c) || c == '{' || c == '}' || c == '[' 
+        || c == ']' || c == ':' || c == ',' || c == '"';
 }
 
-static void skip_until_or_end(RenderContext *ctx, SliceKind until)
+/* Checks the string starting at the quote at [i] and
+ * returns the offset of its closing quote, or -1.
+ */
+static long json_scan_string(XT_Json *json, long i)
 {
-    int depth = 0;
-    while(ctx->slice_idx < ctx->slices->count) {
-        
-        Slice slice = ctx->slices->list[ctx->slice_idx++];
+    const char *src = json->src;
+    long j = i + 1;
+    while(j < json->len && src[j] != '"') {
+
+        if((unsigned char) src[j] < 0x20) {
+            report(&json->error, j, "Control character inside of a string");
+            return -1;
+        }
 
-        if(depth == 0 && slice.kind == until)
+        if(src[j] != '\\') {
+            j += 1;
+            continue;
+        }
+
+        j += 1; // Skip '\'
+        if(j == json->len)
             break;
 
-        switch(slice.kind) {
-            default       : break;
-            case SK_IF    :
-            case SK_FOR   : depth += 1; break;
-            case SK_ENDIF :
-            case SK_ENDFOR: depth -= 1; break;
+        if(src[j] == 'u') {
+            for(int k = 1; k <= 4; k += 1)
+                if(j + k >= json->len || !isxdigit((unsigned char) src[j + k])) {
+                    report(&json->error, j - 1, "Bad \\u escape sequence");
+                    return -1;
+                }
+            j += 5;
+        } else if(src[j] != '\0' && strchr("\"\\/bfnrt", src[j]))
+            j += 1;
+        else {
+            report(&json->error, j - 1, "Bad escape sequence");
+            return -1;
         }
     }
+
+    if(j >= json->len) {
+        report(&json->error, i, "Document ended inside of a string");
+        return -1;
+    }
+
+    if(j - i - 1 > INT_MAX) {
+        report(&json->error, i, "String is too long");
+        return -1;
+    }
+    return j;
 }
 
-static bool render(RenderContext *ctx, SliceKind until)
+static bool json_check_scalar(XT_Json *json, long i, long j)
 {
-    while(ctx->slice_idx < ctx->slices->count && 
-          ctx->slices->list[ctx->slice_idx].kind != until) {
+    const char *s = json->src + i;
+    long n = j - i;
+
+    if((n == 4 && !strncmp(s, "true", 4)) ||
+       (n == 5 && !strncmp(s, "false", 5)) ||
+       (n == 4 && !strncmp(s, "null", 4)))
+        return 1;
+
+    // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+    long k = 0;
+    if(k < n && s[k] == '-')
+        k += 1;
+    if(k < n && s[k] == '0')
+        k += 1;
+    else if(k < n && isdigit((unsigned char) s[k]))
+        while(k < n && isdigit((unsigned char) s[k]))
+            k += 1;
+    else
+        goto bad;
+
+    if(k < n && s[k] == '.') {
+        k += 1;
+        if(k == n || !isdigit((unsigned char) s[k]))
+            goto bad;
+        while(k < n && isdigit((unsigned char) s[k]))
+            k += 1;
+    }
 
-        Slice slice = ctx->slices->list[ctx->slice_idx++];
+    if(k < n && (s[k] == 'e' || s[k] == 'E')) {
+        k += 1;
+        if(k < n && (s[k] == '+' || s[k] == '-'))
+            k += 1;
+        if(k == n || !isdigit((unsigned char) s[k]))
+            goto bad;
+        while(k < n && isdigit((unsigned char) s[k]))
+            k += 1;
+    }
 
-        switch(slice.kind) {
-            
-            case SK_TEXT:
-            ctx->callback(ctx->str + slice.off, slice.len, ctx->userp);
-            break;
+    if(k == n)
+        return 1;
 
-            case SK_EXPR:
-            {
-                Value val = eval(ctx->str + slice.off, slice.len, 
-                                 ctx->vars, ctx->err);
+bad:
+    report(&json->error, i, "Bad value [%.*s]", (int) (n < 32 ? n : 32), s);
+    return 0;
+}
 
-                if(val.kind == VK_ERROR) {
-                    assert(ctx->err == NULL || 
-                           ctx->err->occurred == true);
-
-                    // The error offset reported by [print]
-                    // is relative to the expression start,
-                    // so we need to adjust it to make it
-                    // relative to the start of the file.
-                    // We need to do it only if there is an
-                    // error structure and [print] did report
-                    // an error offset (it's not set to a
-                    // negative value)
-                    if(ctx->err && ctx->err->off >= 0)
-                        ctx->err->off += slice.off;
-                    return 0;
-                }
-                value_print(val, ctx->callback, ctx->userp);
-                value_free(&val);
-                break;
-            }
+/* Records the offset of every token of the document */
+static bool json_scan(XT_Json *json)
+{
+    const char *src = json->src;
+    long i = 0;
+    while(i < json->len) {
 
-            case SK_IF:
-            {
-                Value r = eval(ctx->str + slice.off, slice.len, 
-                               ctx->vars, ctx->err);
-
-                if(r.kind == VK_ERROR) {
-                    
-                    assert(ctx->err == NULL || 
-                           ctx->err->occurred == true);
-
-                    // Like for the SK_EXPR case, we need
-                    // to fix the error offset reported by
-                    // [eval]
-                    if(ctx->err && ctx->err->off >= 0)
-                        ctx->err->off += slice.off;
-                    return 0;
-                }
+        if(is_json_space(src[i])) {
+            i += 1;
+            continue;
+        }
 
-                bool returned_0 = (r.kind == VK_INT && r.as_int == 0);
+        if(!json_append_token(json, i)) {
+            report(&json->error, -1, "Out of memory");
+            return 0;
+        }
 
-                value_free(&r);
+        switch(src[i]) {
 
-                if(!returned_0) {
-                    
-                    /* -- Took the IF branch -- */
-                    
-                    // Execute until the {% else %}
-                    if(!render(ctx, SK_ELSE))
-                        return 0;
+            case '{': case '}': case '[': 
+            case ']': case ':': case ',':
+            i += 1;
+            break;
 
-                    // Now skip to the token after the {% endif %}
-                    skip_until_or_end(ctx, SK_ENDIF);
+            case '"':
+            i = json_scan_string(json, i);
+            if(i < 0)
+                return 0;
+            i += 1; // Skip the closing quote
+            break;
 
-                } else {
+            default:
+            {
+                long j = i;
+                while(j < json->len && !is_json_delim(src[j]))
+                    j += 1;
+                if(!json_check_scalar(json, i, j))
+                    return 0;
+                i = j;
+                break;
+            }
+        }
+    }
+    return 1;
+}
 
-                    /* -- Took the ELSE branch -- */
+/* Checks the order of the tokens and sets the [end] of
+ * the opening brackets. While a bracket is open, its
+ * [end] holds the index of the bracket enclosing it.
+ */
+static bool json_link(XT_Json *json)
+{
+    enum { J_VALUE, J_KEY, J_COLON, J_NEXT, J_DONE } expect = J_VALUE;
 
-                    // Now skip to the token after the {% else %}
-                    skip_until_or_end(ctx, SK_ELSE);
+    JsonToken *tokens = json->tokens;
+    const char *src = json->src;
+    int  top = -1;
+    int  depth = 0;
+    bool empty = false; // The innermost bracket was just opened
 
-                    if(!render(ctx, SK_ENDIF))
-                        return 0;
-                }
-                break;
-            }
+    for(int i = 0; i < json->token_count; i += 1) {
 
-            case SK_FOR:
-            {
-                char var1[32];
-                char var2[32];
-                assert(sizeof(var1) == sizeof(var2));
+        long off = tokens[i].off;
+        char c = src[off];
+        bool close = false;
 
-                long coll_off, coll_len;
-                if(!parse_for_statement(ctx->str + slice.off, slice.len, 
-                                        var1, var2, sizeof(var1), 
-                                        &coll_off, &coll_len, ctx->err)) {
-                    if(ctx->err && ctx->err->off >= 0)
-                        ctx->err->off += slice.off;
-                    return 0;
-                }
+        switch(expect) {
 
-                // Note that [coll_off] is relative to the
-                // for statement body, not the start of the
-                // source string. We need to ass [slice.off]
-                // to use it here.
-                const char *coll_str = ctx->str + slice.off + coll_off;
-
-                Value collection = eval(coll_str, coll_len, ctx->vars, ctx->err);
-                if(collection.kind == VK_ERROR) {
-                    assert(ctx->err == NULL || 
-                           ctx->err->occurred == true);
-                    if(ctx->err && ctx->err->off >= 0)
-                        ctx->err->off += coll_off;
+            case J_VALUE:
+            if(c == '{' || c == '[') {
+                if(top < 0 && c != '{') {
+                    report(&json->error, off, "The root of the document isn't an object");
                     return 0;
                 }
-
-                if(collection.kind != VK_ARRAY) {
-                    report(ctx->err, coll_off, "Iteration subject isn't an array");
+                if(depth == JSON_MAX_DEPTH) {
+                    report(&json->error, off, "Too many nested values");
                     return 0;
                 }
+                tokens[i].end = top;
+                top = i;
+                depth += 1;
+                expect = (c == '{') ? J_KEY : J_VALUE;
+                empty = true;
+                continue;
+            }
+            if(c == ']' && empty && src[tokens[top].off] == '[')
+                close = true;
+            else if(top < 0) {
+                report(&json->error, off, "The root of the document isn't an object");
+                return 0;
+            } else if(c == '}' || c == ']' || c == ':' || c == ',') {
+                report(&json->error, off, "Unexpected [%c] where a value was expected", c);
+                return 0;
+            } else
+                expect = J_NEXT;
+            break;
 
-                Variables vars = {
-                    ctx->vars,
-                    (Variable[]) {
-                        { var1, strlen(var1), { VK_INT, .as_int = 0 }},
-                        { var2, strlen(var2), { VK_INT, .as_int = 0 }},
-                        { NULL, 0, { VK_INT, .as_int = 0 }},
-                    }
-                };
+            case J_KEY:
+            if(c == '}' && empty)
+                close = true;
+            else if(c == '"')
+                expect = J_COLON;
+            else {
+                report(&json->error, off, "Expected a key");
+                return 0;
+            }
+            break;
 
-                vars.parent = ctx->vars;
-                ctx->vars = &vars;
-                
-                long count = collection.as_array.count;
-    
-                if(count == 0)
-                    skip_until_or_end(ctx, SK_ENDFOR);
-                else {
-    
-                    long start = ctx->slice_idx;
-                    for(int no = 0; no < count; no += 1) {
-                        
-                        vars.list[0].value.as_int = no;
-                        vars.list[1].value = collection.as_array.items[no];
-
-                        ctx->slice_idx = start;
-                        
-                        if(!render(ctx, SK_ENDFOR)) {
-                            value_free(&collection);
-                            return 0;
-                        }
-                    }
-                }
-                value_free(&collection);
-                value_free(&vars.list[0].value);
-                value_free(&vars.list[1].value);
-                ctx->vars = ctx->vars->parent;
-                break;
+            case J_COLON:
+            if(c != ':') {
+                report(&json->error, off, "Expected [:] after a key");
+                return 0;
             }
+            expect = J_VALUE;
+            break;
 
-            case SK_END:
-            case SK_ELSE:
-            case SK_ENDIF:
-            case SK_ENDFOR:
-            /* Unreachable */
-            assert(0);
+            case J_NEXT:
+            if(c == ',')
+                expect = (src[tokens[top].off] == '{') ? J_KEY : J_VALUE;
+            else if(c == (src[tokens[top].off] == '{' ? '}' : ']'))
+                close = true;
+            else {
+                report(&json->error, off, "Expected [,] or the end of the %s", 
+                       src[tokens[top].off] == '{' ? "object" : "array");
+                return 0;
+            }
             break;
+
+            case J_DONE:
+            report(&json->error, off, "Unexpected data after the root object");
+            return 0;
+        }
+        empty = false;
+
+        if(close) {
+            int parent = tokens[top].end;
+            tokens[top].end = i + 1;
+            top = parent;
+            depth -= 1;
+            expect = (top < 0) ? J_DONE : J_NEXT;
         }
     }
 
-    if(ctx->slice_idx < ctx->slices->count)
-        ctx->slice_idx += 1;
+    if(expect != J_DONE) {
+        report(&json->error, json->len, json->token_count ? "Document ended inside of a value" 
+                                                          : "The root of the document isn't an object");
+        return 0;
+    }
     return 1;
 }
 
-static bool append_slice(Slices **slices, Slice slice)
+/* Returns the index of the token after the member or
+ * item starting at [tok], skipping its comma.
+ */
+static int json_skip(XT_Json *json, int tok)
 {
-    Slices *slices2 = *slices;
+    tok = json->tokens[tok].end;
+    if(json->src[json->tokens[tok].off] == ',')
+        tok += 1;
+    return tok;
+}
 
-    if(slices2->count == slices2->max_count) {
-        
-        assert(slices2->max_count > 0);
+static bool json_is_close(XT_Json *json, int tok)
+{
+    char c = json->src[json->tokens[tok].off];
+    return c == '}' || c == ']';
+}
 
-        int new_max_count = 2 * slices2->max_count;
+/* Returns the contents of the string at token [tok].
+ * Strings with escape sequences are decoded in the 
+ * memory of [json], the others are left in place.
+ */
+static bool json_string(XT_Json *json, int tok, const char **str, int *len)
+{
+    const char *s = json->src + json->tokens[tok].off + 1;
+
+    long n = 0;
+    bool plain = true;
+    while(s[n] != '"') {
+        if(s[n] == '\\') {
+            plain = false;
+            n += 2;
+        } else
+            n += 1;
+    }
 
-        void *temp = realloc(*slices, sizeof(Slices) + new_max_count * sizeof(Slice));
-        if(temp == NULL)
-            return 0;
+    if(plain) {
+        *str = s;
+        *len = n;
+        return 1;
+    }
 
-        slices2 = temp;
-        slices2->max_count = new_max_count;
-        *slices = slices2;
+    // Decoded strings are never longer
+    char *buf = json_alloc(json, n);
+    if(buf == NULL)
+        return 0;
+
+    long k = 0;
+    for(long i = 0; i < n; ) {
+
+        if(s[i] != '\\') {
+            buf[k++] = s[i++];
+            continue;
+        }
+
+        char c = s[i+1];
+        i += 2;
+        switch(c) {
+            case 'b': buf[k++] = '\b'; break;
+            case 'f': buf[k++] = '\f'; break;
+            case 'n': buf[k++] = '\n'; break;
+            case 'r': buf[k++] = '\r'; break;
+            case 't': buf[k++] = '\t'; break;
+            case 'u':
+            {
+                unsigned long code = strtoul((char[]) { s[i], s[i+1], s[i+2], s[i+3], '\0' }, NULL, 16);
+                i += 4;
+
+                // Surrogate pairs are joined, lone surrogates
+                // become U+FFFD.
+                if(code >= 0xD800 && code <= 0xDBFF && i + 6 <= n && s[i] == '\\' && s[i+1] == 'u') {
+                    unsigned long low = strtoul((char[]) { s[i+2], s[i+3], s[i+4], s[i+5], '\0' }, NULL, 16);
+                    if(low >= 0xDC00 && low <= 0xDFFF) {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        i += 6;
+                    }
+                }
+                if(code >= 0xD800 && code <= 0xDFFF)
+                    code = 0xFFFD;
+
+                if(code < 0x80)
+                    buf[k++] = code;
+                else if(code < 0x800) {
+                    buf[k++] = 0xC0 | (code >> 6);
+                    buf[k++] = 0x80 | (code & 0x3F);
+                } else if(code < 0x10000) {
+                    buf[k++] = 0xE0 | (code >> 12);
+                    buf[k++] = 0x80 | ((code >> 6) & 0x3F);
+                    buf[k++] = 0x80 | (code & 0x3F);
+                } else {
+                    buf[k++] = 0xF0 | (code >> 18);
+                    buf[k++] = 0x80 | ((code >> 12) & 0x3F);
+                    buf[k++] = 0x80 | ((code >> 6) & 0x3F);
+                    buf[k++] = 0x80 | (code & 0x3F);
+                }
+                break;
+            }
+            default: buf[k++] = c; break; // '"', '\' and '/'
+        }
     }
 
-    slices2->list[slices2->count++] = slice;
+    *str = buf;
+    *len = k;
     return 1;
 }
 
-static Slices *slice_up(const char *tmpl, long len, XT_Error *err)
+/* Builds the map of the object at token [tok]. When 
+ * [lazy] is set, the values of its fields are left
+ * to be decoded later (see [XT_Json.root]).
+ */
+static bool json_object(XT_Json *json, int tok, MapValue *map, bool lazy);
+
+/* Decodes the value at token [tok] into [out]. Returns
+ * false if out of memory.
+ */
+static bool json_value(XT_Json *json, int tok, Value *out)
 {
-    #define SKIP_SPACES()                \
-        while(i < len && (tmpl[i] == ' ' \
-            || tmpl[i] == '\t'           \
-            || tmpl[i] == '\n'))         \
-            i += 1;
+    const char *s = json->src + json->tokens[tok].off;
+    switch(s[0]) {
 
-    #define SKIP_UNTIL_2(X, Y)    \
-        while(i < len             \
-            && (i+1 > len         \
-            || tmpl[i] != (X)     \
-            || tmpl[i+1] != (Y))) \
-            i += 1;
+        case '"':
+        {
+            const char *str;
+            int len;
+            if(!json_string(json, tok, &str, &len))
+                return 0;
+            *out = (Value) { VK_STRING, len, .as_str = str };
+            return 1;
+        }
 
-    Slices *slices = malloc(sizeof(Slices) + 8 * sizeof(Slice));
-    if(slices == NULL) {
-        report(err, 0, "Out of memory");
-        goto failed;
-    }
-    slices->count = 0;
-    slices->max_count = 8;
+        case '{':
+        {
+            MapValue *map = json_alloc(json, sizeof(MapValue));
+            if(map == NULL || !json_object(json, tok, map, false))
+                return 0;
+            *out = (Value) { VK_MAP, .as_map = map };
+            return 1;
+        }
 
-    SliceKind context[MAX_DEPTH];
-    bool     has_else[MAX_DEPTH];
-    int depth = 0, i = 0;
-    while(1) {
+        case '[':
+        {
+            int count = 0;
+            for(int item = tok + 1; !json_is_close(json, item); item = json_skip(json, item))
+                count += 1;
 
-        // Slice the raw text before the next {{ .. }}, {% .. %} or,
-        // end of the string, then append it to the slice list.
-        Slice text;
-        text.kind = SK_TEXT;
-        text.off = i;
-        while(i < len && (i+1 > len 
-                      || tmpl[i] != '{' 
-                      ||   (tmpl[i+1] != '%' 
-                         && tmpl[i+1] != '{')))
-            i += 1;
-        text.len = i - text.off;
-        
-        if(text.len > 0)
-            if(!append_slice(&slices, text)) {
-                report(err, i, "Out of memory");
-                goto failed;
+            if(count == 0) {
+                *out = array_new();
+                return 1;
             }
 
-        // Did the source end?
-        if(i == len)
-            break;
+            ArrayValue *array = json_alloc(json, sizeof(ArrayValue) + count * sizeof(Value));
+            if(array == NULL)
+                return 0;
+            *array = (ArrayValue) { .refs = 0, .count = count, .capacity = count, .type = AT_VALUE };
+            array->items = (Value*) (array + 1);
 
-        // Now handle either the {{ .. }} or {% .. %}
+            bool ints = true, floats = true;
+            int k = 0;
+            for(int item = tok + 1; !json_is_close(json, item); item = json_skip(json, item)) {
+                if(!json_value(json, item, &array->items[k]))
+                    return 0;
+                ints   = ints   && array->items[k].kind == VK_INT;
+                floats = floats && array->items[k].kind == VK_FLOAT;
+                k += 1;
+            }
 
-        assert(tmpl[i] == '{' && (tmpl[i+1] == '%' || tmpl[i+1] == '{'));
-        i += 2; // Skip the "{%" or "{{"
+            // Arrays of only integers or only floats are packed
+            // in place. Element k is stored at byte 8k, which is
+            // before item k (at byte 16k), so no item is 
+            // overwritten before it's read.
+            if(ints) {
+                array->type = AT_INT;
+                for(k = 0; k < count; k += 1)
+                    array->ints[k] = array->items[k].as_int;
+            } else if(floats) {
+                array->type = AT_FLOAT;
+                for(k = 0; k < count; k += 1)
+                    array->floats[k] = array->items[k].as_float;
+            }
 
-        Slice slice;
-        if(tmpl[i-1] == '%') {
+            *out = (Value) { VK_ARRAY, .as_array = array };
+            return 1;
+        }
 
-            assert(tmpl[i-2] == '{' && tmpl[i-1] == '%');
-            long block_off = i-2; // Useful for error reporting. This is the
-                                  // offset of the first '{' of the {% .. %}
-                                  // block.
+        case 't': *out = (Value) { VK_INT, .as_int = 1 }; return 1;
+        case 'f': *out = (Value) { VK_INT, .as_int = 0 }; return 1;
+        case 'n': *out = (Value) { VK_INT, .as_int = 0 }; return 1;
+    }
 
-            // Now skip any spaces between the '%' and
-            // the first keyword. If there is no keyword,
-            // report the error.
+    // Numbers are followed by a delimiter, so they're 
+    // never at the end of the document.
+    long n = 0;
+    bool is_float = false;
+    while(!is_json_delim(s[n])) {
+        if(s[n] == '.' || s[n] == 'e' || s[n] == 'E')
+            is_float = true;
+        n += 1;
+    }
 
-            SKIP_SPACES()
-            
-            if(i == len || (!isalpha(tmpl[i]) && tmpl[i] != '_')) {
-                report(err, block_off, "block {%% .. %%} doesn't start with a keyword");
-                goto failed;
-            }
+    if(!is_float) {
+        bool neg = (s[0] == '-');
+        long long buff = 0;
+        long i = neg;
+        for(; i < n; i += 1) {
+            char u = s[i] - '0';
+            if(buff > (LLONG_MAX - u) / 10)
+                break;
+            buff = buff * 10 + u;
+        }
+        if(i == n) {
+            *out = (Value) { VK_INT, .as_int = neg ? -buff : buff };
+            return 1;
+        }
+        // Integers that don't fit are stored as floats
+    }
 
-            long kword_off = i;
-            do
-                i += 1;
-            while(i < len && (isalpha(tmpl[i]) || tmpl[i] == '_'));
-            long kword_len = i - kword_off;
-            
-            // The keyword is the substring that starts at offset
-            // [kword_off] and has length [kword_len].
-            
-            // Check that:
-            //   - The keyword is valid (if, for, else, endif, ..).
-            //   - If it's an if or for, that the maximum depth of
-            //     nested blocks isn't reached.
-            //   - If it's an endif, it's relative to a previous if.
-            //   - If it's an endfor, it's relativo to a previous for.
-            //   - If it's an else, it's relative to a previous if
-            //     that had no other else associated to it.
+    *out = (Value) { VK_FLOAT, .as_float = strtod(s, NULL) };
+    return 1;
+}
 
-            switch(kword_len) {
-                
-                case 2:
-                if(strncmp(tmpl + kword_off, "if", kword_len))
-                    goto badkword;
-                
-                if(depth == MAX_DEPTH) {
-                    report(err, block_off, "Too many nested {%% if .. %%} and {%% for .. %%} blocks");
-                    goto failed;
-                }
-                has_else[depth] = 0;
-                context[depth++] = SK_IF;
-                slice.kind = SK_IF;
-                break;
+static bool json_object(XT_Json *json, int tok, MapValue *map, bool lazy)
+{
+    int count = 0;
+    for(int key = tok + 1; !json_is_close(json, key); key = json_skip(json, key + 2))
+        count += 1;
 
-                case 3:
-                if(strncmp(tmpl + kword_off, "for", kword_len))
-                    goto badkword;
+    int capacity = 1;
+    while(capacity <= 2 * count)
+        capacity *= 2;
 
-                if(depth == MAX_DEPTH) {
-                    report(err, block_off, "Too many nested {%% if .. %%} and {%% for .. %%} blocks");
-                    goto failed;
-                }
-                has_else[depth] = 0;
-                context[depth++] = SK_FOR;
-                slice.kind = SK_FOR;
-                break;
+    MapEntry *entries = json_alloc(json, capacity * sizeof(MapEntry));
+    if(entries == NULL)
+        return 0;
+    xt_map_view(map, entries, capacity);
 
-                case 4:
-                if(strncmp(tmpl + kword_off, "else", kword_len))
-                    goto badkword;
+    for(int key = tok + 1; !json_is_close(json, key); key = json_skip(json, key + 2)) {
 
-                if(depth == 0 || context[depth-1] != SK_IF) {
-                    report(err, block_off, "{%% else %%} has no matching {%% if .. %%}");
-                    goto failed;
-                }
-                if(has_else[depth-1]) {
-                    report(err, block_off, "Can't have multiple {%% else %%} blocks "
-                                           "relative to only one {%% if .. %%}");
-                    goto failed;
-                }
+        const char *name;
+        int len;
+        if(!json_string(json, key, &name, &len))
+            return 0;
+
+        Value value;
+        if(lazy)
+            value = (Value) { VK_ERROR, .as_int = key + 2 };
+        else if(!json_value(json, key + 2, &value))
+            return 0;
+
+        // Later duplicates replace earlier ones
+        unsigned int hash = hash_key(name, len);
+        MapEntry *entry = map_slot(map, name, len, hash);
+        if(entry->key == NULL) {
+            *entry = (MapEntry) { name, len, hash, value };
+            map->count += 1;
+        } else
+            entry->value = value;
+    }
+    return 1;
+}
+
+/* Indexes the document if it wasn't already. When out
+ * of memory, the document is left to be indexed again
+ * later.
+ */
+static bool json_index(XT_Json *json)
+{
+    if(json->state != 0)
+        return json->state == 1;
 
-                has_else[depth-1] = true;
-                slice.kind = SK_ELSE;
-                break;
+    if(json_scan(json) && json_link(json) && json_object(json, 0, &json->root, true)) {
+        json->state = 1;
+        return 1;
+    }
 
-                case 5:
-                if(strncmp(tmpl + kword_off, "endif", kword_len))
-                    goto badkword;
+    if(!json->error.occurred || !strcmp(json->error.message, "Out of memory")) {
+        memset(&json->error, 0, sizeof(XT_Error));
+        json->token_count = 0;
+        return 0;
+    }
 
-                if(depth == 0 || context[depth-1] != SK_IF) {
-                    report(err, block_off, "{%% endif %%} has no matching {%% if .. %%}");
-                    goto failed;
-                }
-                depth -= 1;
-                slice.kind = SK_ENDIF;
-                break;
+    locate_error(&json->error, json->src, json->len);
+    json->state = -1;
+    return 0;
+}
 
-                case 6:
-                if(strncmp(tmpl + kword_off, "endfor", kword_len))
-                    goto badkword;
+static Value json_resolve(const char *name, long len, void *userp)
+{
+    XT_Json *json = userp;
+    if(!json_index(json))
+        return (Value) { VK_ERROR, .as_str = (json->state < 0) ? "Malformed JSON document" : "Out of memory" };
 
-                if(depth == 0 || context[depth-1] != SK_FOR) {
-                    report(err, block_off, "{%% endfor %%} has no matching {%% for .. %%}");
-                    goto failed;
-                }
-                depth -= 1;
-                slice.kind = SK_ENDFOR;
-                break;
+    MapEntry *entry = map_slot(&json->root, name, len, hash_key(name, len));
+    if(entry->key == NULL)
+        return (Value) { VK_ERROR };
 
-                default:
-            badkword:
-                report(err, kword_off, "Bad {%% .. %%} block keyword");
-                goto failed;
-            }
+    if(entry->value.kind == VK_ERROR) {
+        Value value;
+        if(!json_value(json, entry->value.as_int, &value))
+            return (Value) { VK_ERROR, .as_str = "Out of memory" };
+        entry->value = value;
+    }
+    return entry->value;
+}
 
-            // Now get the slice that goes from the first
-            // byte after the keyword until the byte before
-            // the '%' of the ending "%}" (or the end of
-            // the source).
+/* Wraps the JSON document [src] in a scope with the 
+ * given [parent]. The document isn't copied, so it must
+ * outlive the returned handle. Returns NULL if out of 
+ * memory.
+ */
+XT_Json *xt_json_open(const char *src, long len, Variables *parent)
+{
+    if(src == NULL)
+        src = "";
 
-            slice.off = i;
-            SKIP_UNTIL_2('%', '}')
-            slice.len = i - slice.off;
+    if(len < 0)
+        len = strlen(src);
 
-        } else {
+    XT_Json *json = malloc(sizeof(XT_Json));
+    if(json == NULL)
+        return NULL;
+    memset(json, 0, sizeof(XT_Json));
 
-            assert(tmpl[i-2] == '{' && tmpl[i-1] == '{');
+    json->scope = (Variables) { parent, NULL, json_resolve, json };
+    json->src = src;
+    json->len = len;
+    return json;
+}
 
-            slice.kind = SK_EXPR;
-            slice.off = i;
-            SKIP_UNTIL_2('}', '}')
-            slice.len = i - slice.off;
-        }
+Variables *xt_json_scope(XT_Json *json)
+{
+    return &json->scope;
+}
 
-        if(i < len) {
-            assert((tmpl[i] == '%' || tmpl[i] == '}') && tmpl[i+1] == '}');
-            i += 2; // Skip the "%}" or "}}"
+/* Indexes the document now instead of when the first
+ * variable is looked up. Returns false and fills [err] 
+ * if the document is malformed (or if out of memory).
+ * Renders looking up variables in the scope of a 
+ * malformed document fail.
+ */
+bool xt_json_check(XT_Json *json, XT_Error *err)
+{
+    if(json_index(json)) {
+        if(err)
+            memset(err, 0, sizeof(XT_Error));
+        return 1;
+    }
+    if(err) {
+        if(json->state < 0)
+            *err = json->error;
+        else {
+            memset(err, 0, sizeof(XT_Error));
+            report(err, -1, "Out of memory");
         }
+    }
+    return 0;
+}
 
-        if(!append_slice(&slices, slice)) {
-            report(err, i, "Out of memory");
-            goto failed;
+void xt_json_close(XT_Json *json)
+{
+    if(json) {
+        while(json->chunks) {
+            JsonChunk *next = json->chunks->next;
+            free(json->chunks);
+            json->chunks = next;
         }
+        free(json->tokens);
+        free(json);
     }
+}
 
-    return slices;
+/* Runtime support for the code generated by [xt_emit_c] */
 
-failed:
-    assert(err == NULL || err->occurred == true);
-    free(slices);
-    return NULL;
+bool xt_rt_lookup(Variables *vars, const char *name, long len, Value *out)
+{
+    return find_var(vars, name, len, out, NULL);
 }
 
-bool xt_render_str_to_cb(const char *str, long len, Variables *vars, 
-                         xt_callback callback, void *userp, XT_Error *err)
+bool xt_rt_apply(const char *operat, Value lhs, Value rhs, Value *out, const char **err)
 {
-    if(str == NULL)
-        str = "";
-
-    if(len < 0)
-        len = strlen(str);
+    static const char *const names[] = { 
+        [OID_ADD] = "+",  [OID_SUB] = "-",  [OID_MUL] = "*", [OID_DIV] = "/",
+        [OID_EQL] = "==", [OID_NQL] = "!=", [OID_LSS] = "<", [OID_LEQ] = "<=", 
+        [OID_GRT] = ">",  [OID_GEQ] = ">=",
+    };
+    for(int oid = OID_ADD; oid <= OID_GEQ; oid += 1)
+        if(!strcmp(operat, names[oid])) {
+            *out = apply(oid, lhs, rhs, err);
+            return out->kind != VK_ERROR;
+        }
+    *err = "Bad operator";
+    return 0;
+}
 
-    memset(err, 0, sizeof(XT_Error));
-    Slices *slices = NULL;
-    bool ok = false;
+bool xt_rt_test(Value val)
+{
+    return is_truthy(val);
+}
 
-    slices = slice_up(str, len, err);
-    if(slices == NULL) {
-        assert(err == NULL || err->occurred == true);
-        goto done;
+/* Unlike [array_append], the item isn't moved into 
+ * the array, which gets a reference of its own.
+ */
+bool xt_rt_append(Value *array, Value item, const char **err)
+{
+    if(!array_append(array, value_retain(item), err)) {
+        value_free(&item);
+        return 0;
     }
+    return 1;
+}
 
-    RenderContext ctx = {
-        .err = err,
-        .vars = vars,
-        .str = str,
-        .len = len,
-        .slices = slices,
-        .slice_idx = 0,
-        .userp = userp,
-        .callback = callback,
-    };
+/* The value returned by [xt_rt_field] and [xt_rt_index]
+ * is borrowed from the map.
+ */
+bool xt_rt_field(Value obj, const char *name, long len, unsigned int hash, Value *out, const char **err)
+{
+    return map_lookup(obj, name, len, hash, out, err);
+}
 
-    if(!render(&ctx, SK_END)) {
-        assert(err == NULL || err->occurred == true);
-        goto done;
-    }
+bool xt_rt_index(Value obj, Value key, Value *out, const char **err)
+{
+    return index_value(obj, key, out, err);
+}
 
-    ok = true;
-done:
-    
-    assert((ok && err->occurred == false) || 
-          (!ok && err->occurred == true));
+bool xt_rt_slice(Value obj, Value start, Value stop, Value *out, const char **err)
+{
+    return array_slice(obj, start, stop, out, err);
+}
 
-    if(!ok && err && err->off >= 0) {
-        // Calculate the line and column of the error
-        // given the absolute offset and the string.
-        assert(err->off <= len);
+bool xt_rt_next(Value coll, long idx, Value *item)
+{
+    return coll_next(coll, idx, item);
+}
 
-        long col = 1, 
-             row = 1;
-        long i = 0;
-        while(i < err->off) {
-            col += 1;
-            if(str[i] == '\n') {
-                col = 0;
-                row += 1;
-            }
-            i += 1;
+/* Calls the builtin or the function bound to variable
+ * [name]. Unlike the other helpers, the result is owned
+ * by the caller: the arguments are released by the
+ * generated code, so if the result is one of them, 
+ * it gets a reference of its own.
+ */
+static bool rt_call(FuncValue func, Value *args, int argc, Value *out, const char **err);
+
+bool xt_rt_call(Variables *vars, const char *name, long len, Value *args, int argc, Value *out, const char **err)
+{
+    FuncValue func = find_builtin(name, len);
+    if(func == NULL) {
+        Value found;
+        bool defined = find_var(vars, name, len, &found, NULL);
+        if(defined && found.kind == VK_ERROR) {
+            *err = found.as_str;
+            return 0;
         }
-        err->col = col;
-        err->row = row;
+        if(!defined || found.kind != VK_FUNC) {
+            *err = defined ? "Not a function" : "Undefined function";
+            return 0;
+        }
+        func = found.as_func;
     }
-
-    free(slices);
-    return ok;
+    return rt_call(func, args, argc, out, err);
 }
 
-typedef struct {
-    bool  failed;
-    char *data;
-    long  size;
-    long  used;
-} buff_t;
+/* Same as [xt_rt_call] for a filter, [args] starting 
+ * with the filtered value.
+ */
+bool xt_rt_filter(Variables *vars, const char *name, long len, Value *args, int argc, Value *out, const char **err)
+{
+    FuncValue func = find_filter(name, len);
+    if(func == NULL)
+        return xt_rt_call(vars, name, len, args, argc, out, err);
+    return rt_call(func, args, argc, out, err);
+}
 
-static void callback(const char *str, long len, void *userp)
+bool xt_rt_join(Value *args, int argc, XT_Escape escape, xt_callback callback, void *userp, const char **err)
 {
-    buff_t *buff = userp;
-    if(buff->failed)
-        return;
+    Emitter e;
+    emit_init(&e, callback, userp, escape);
+    bool ok = print_join(&e, args, argc, err);
+    emit_flush(&e);
+    return ok;
+}
 
-    if(buff->used + len > buff->size) {
+bool xt_rt_fmt(Value val, const XT_FmtSpec *spec, XT_Escape escape, xt_callback callback, void *userp, const char **err)
+{
+    Emitter e;
+    emit_init(&e, callback, userp, escape);
+    bool ok = emit_fmt(&e, val, spec, err);
+    emit_flush(&e);
+    return ok;
+}
 
-        long new_size;
-        if(buff->size == 0) 
-            new_size = 1024-1;
-        else
-            new_size = buff->size * 2;
+static bool rt_call(FuncValue func, Value *args, int argc, Value *out, const char **err)
+{
+    Value res;
+    *err = NULL;
+    if(!func(args, argc, &res, err) || res.kind == VK_ERROR) {
+        if(*err == NULL)
+            *err = "Call failed";
+        return 0;
+    }
+    for(int k = 0; k < argc; k += 1)
+        if(same_object(args[k], res)) {
+            res = value_retain(res);
+            break;
+        }
+    *out = res;
+    return 1;
+}
 
-        if(buff->used + len > new_size)
-            new_size = buff->used + len;
+void xt_rt_print(Value val, xt_callback callback, void *userp)
+{
+    value_print(val, callback, userp);
+}
 
-        void *temp = realloc(buff->data, new_size+1);
-        if(temp == NULL) {
-            buff->failed = 1;
-            return;
-        }
+void xt_rt_escape(Value val, XT_Escape escape, xt_callback callback, void *userp)
+{
+    Emitter e;
+    emit_init(&e, callback, userp, escape);
+    emit_value(&e, val);
+    emit_flush(&e);
+}
 
-        buff->data = temp;
-        buff->size = new_size;
-    }
+Value xt_rt_retain(Value val)
+{
+    return value_retain(val);
+}
 
-    memcpy(buff->data + buff->used, str, len);
-    buff->used += len;
+void xt_rt_free(Value *val)
+{
+    value_free(val);
+    *val = (Value) { VK_INT, .as_int = 0 };
 }
 
-char *xt_render_str_to_str(const char *str, long len, 
-                           Variables *vars, long *outlen, 
-                           XT_Error *err)
+void xt_rt_error(XT_Error *err, long off, long row, long col, const char *fmt, ...)
 {
-    buff_t buff;
-    memset(&buff, 0, sizeof(buff_t));
-    
-    if(!xt_render_str_to_cb(str, len, vars, callback, &buff, err)) {
-        assert(err == NULL || err->occurred == true);
-        free(buff.data);
-        return NULL;
+    va_list va;
+    va_start(va, fmt);
+    report_va(err, off, fmt, va);
+    va_end(va);
+
+    if(err) {
+        err->row = row;
+        err->col = col;
     }
+}
 
-    if(buff.failed) {
+/* Turns the buffer filled by [callback] into the null
+ * terminated string returned by the *_to_str functions,
+ * taking ownership of its memory.
+ */
+static char *buff_to_str(buff_t *buff, long *outlen, XT_Error *err)
+{
+    if(buff->failed) {
         report(err, -1, "Out of memory");
-        free(buff.data);
+        free(buff->data);
         return NULL;
     }
 
     char *out_str;
     long  out_len;
 
-    if(buff.used == 0) {
+    if(buff->used == 0) {
         
         out_str = malloc(1);
         if(out_str == NULL) {
@@ -1321,8 +7683,8 @@ char *xt_render_str_to_str(const char *str, long len,
 
     } else {
 
-        out_str = buff.data;
-        out_len = buff.used;
+        out_str = buff->data;
+        out_len = buff->used;
     }
 
     out_str[out_len] = '\0';
@@ -1332,6 +7694,47 @@ char *xt_render_str_to_str(const char *str, long len,
     return out_str;
 }
 
+char *xt_render_to_str(XT_Template *tmpl, Variables *vars, 
+                       long *outlen, XT_Error *err)
+{
+    buff_t buff;
+    memset(&buff, 0, sizeof(buff_t));
+    
+    if(!xt_render_to_cb(tmpl, vars, callback, &buff, err)) {
+        assert(err == NULL || err->occurred == true);
+        free(buff.data);
+        return NULL;
+    }
+
+    return buff_to_str(&buff, outlen, err);
+}
+
+char *xt_segments_to_str(XT_Segments *segs, long *outlen, XT_Error *err)
+{
+    buff_t buff;
+    memset(&buff, 0, sizeof(buff_t));
+    memset(err, 0, sizeof(XT_Error));
+
+    xt_segments_write(segs, callback, &buff);
+    return buff_to_str(&buff, outlen, err);
+}
+
+char *xt_render_str_to_str(const char *str, long len, 
+                           Variables *vars, long *outlen, 
+                           XT_Error *err)
+{
+    buff_t buff;
+    memset(&buff, 0, sizeof(buff_t));
+    
+    if(!xt_render_str_to_cb(str, len, vars, callback, &buff, err)) {
+        assert(err == NULL || err->occurred == true);
+        free(buff.data);
+        return NULL;
+    }
+
+    return buff_to_str(&buff, outlen, err);
+}
+
 static char *load_file(const char *file, long *len, const char **err)
 {
     FILE *fp  = NULL;
@@ -1412,4 +7815,20 @@ char *xt_render_file_to_str(const char *file, Variables *vars,
 
     free(str);
     return res;
+}
+
+XT_Template *xt_compile_file(const char *file, XT_Error *err)
+{
+    long len;
+    const char *errmsg;
+    char *str = load_file(file, &len, &errmsg);
+    if(str == NULL) {
+        report(err, 0, "%s", errmsg);
+        return NULL;
+    }
+
+    XT_Template *tmpl = xt_compile(str, len, err);
+
+    free(str);
+    return tmpl;
 }
\ No newline at end of file
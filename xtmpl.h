@@ -2,6 +2,10 @@
 #define XTMPL_H
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define XT_ERRMSG_MAX 256
 
 typedef struct {
@@ -12,32 +16,140 @@ typedef struct {
 } XT_Error;
 
 typedef struct Value Value;
+typedef struct MapValue MapValue;
+typedef struct ArrayValue ArrayValue;
+typedef struct IterValue IterValue;
 
 typedef enum {
     VK_ERROR,
     VK_INT,
     VK_FLOAT,
     VK_ARRAY,
+    VK_STRING,
+    VK_MAP,
+    VK_FUNC,
+    VK_ITER,
 } ValueKind;
 
-typedef struct {
-    Value *items;
+/* Arrays are passed around by pointer. Arrays built
+ * while rendering are reference counted and never
+ * modified once built. Arrays provided by the host
+ * have [refs] set to 0: they're borrowed, so they're
+ * never copied or freed by the library and must
+ * outlive the render.
+ *
+ * Arrays of only integers or only floats are stored 
+ * packed, as plain [long long] or [double] elements.
+ * The [type] tells which member of the union holds
+ * the elements. Use [xt_array_get] to read an item
+ * regardless of it.
+ *
+ * When [stride] isn't 0, it's the distance in bytes
+ * between two elements, which lets borrowed arrays 
+ * refer to a column of a table in place. See 
+ * [xt_array_view].
+ *
+ * A slice (a[i:j]) is an array that refers to the
+ * items of its [base] array in place and holds a
+ * reference to it. Other arrays have no [base].
+ */
+typedef enum {
+    AT_VALUE,
+    AT_INT,
+    AT_FLOAT,
+} ArrayType;
+
+struct ArrayValue {
+    int    refs;
     int    count, 
         capacity;
-} ArrayValue;
+    ArrayType type;
+    union {
+        Value     *items;
+        long long *ints;
+        double    *floats;
+    };
+    long stride;
+    ArrayValue *base;
+};
 
-typedef bool (*FuncValue)(Value*, int, Value*, const char**);
+/* Host functions are called as [func(args, argc, out, err)]
+ * and return false on failure, optionally setting [*err]
+ * to a static message. The arguments are borrowed for
+ * the duration of the call. The result belongs to the
+ * caller: it's either one of the arguments, a value 
+ * that outlives the render (like the value of a host
+ * variable) or a new iterator with [refs] set to 1.
+ *
+ * Calls are assumed to depend only on their arguments:
+ * a call whose arguments don't change inside a loop 
+ * may be evaluated once per entry of the loop.
+ */
+typedef bool (*FuncValue)(Value *args, int argc, Value *out, const char **err);
 
+/* Strings are views: the bytes of a VK_STRING value
+ * belong to the host or to the template and are never
+ * copied or freed by the library. Their length is
+ * stored next to the kind so that the value stays 
+ * two words long.
+ */
 struct Value {
     ValueKind kind;
+    int    str_len;
     union {
         long long  as_int;
         double     as_float;
-        ArrayValue as_array;
+        ArrayValue *as_array;
         FuncValue  as_func;
+        const char *as_str;
+        MapValue   *as_map;
+        IterValue  *as_iter;
     };
 };
 
+/* Iterators produce the items of a {% for .. %} loop
+ * one at a time. [next] stores the next item in [*item]
+ * and returns true, or returns false when there are
+ * no items left. Items are treated like the values of
+ * host variables.
+ *
+ * Iterators are consumed by the loops over them. The
+ * ones with [refs] set to 0 are borrowed from the host,
+ * the others are released by calling [close] when the
+ * last reference to them is dropped.
+ */
+struct IterValue {
+    int refs;
+    bool (*next) (IterValue *iter, Value *item);
+    void (*close)(IterValue *iter);
+    void *userp;
+};
+
+/* Maps are hash tables from string keys to values,
+ * using open addressing with linear probing. The 
+ * [capacity] of the table is a power of 2 and slots
+ * with a NULL [key] are free. The [hash] of each key
+ * is stored along with it, so lookups only compare
+ * the keys whose hash matches. Like arrays, maps 
+ * with [refs] set to 0 are borrowed from the host.
+ *
+ * The host provides the table and fills it with 
+ * [xt_map_view] and [xt_map_put].
+ */
+typedef struct {
+    const char *key;
+    int     key_len;
+    unsigned int hash;
+    Value     value;
+} MapEntry;
+
+struct MapValue {
+    int       refs;
+    int      count,
+          capacity;
+    MapEntry *entries;
+};
+
 typedef struct Variables Variables;
 typedef struct {
     const char *name;
@@ -45,15 +157,181 @@ typedef struct {
     Value      value;
 } Variable;
 
+/* Returns the value of variable [name], or a value of 
+ * kind VK_ERROR if the scope doesn't define it. Values
+ * are treated like the ones of the [list]. To fail the
+ * render instead, the resolver sets [as_str] of the 
+ * VK_ERROR value to a static error message.
+ */
+typedef Value (*xt_resolver)(const char *name, long len, void *userp);
+
+/* A scope defines the variables in [list], which ends 
+ * with an entry of length 0, and the ones returned by
+ * [resolve]. Either can be NULL. The resolver is only
+ * called when a variable is evaluated and the [list]
+ * doesn't define it, and each name is resolved at most
+ * once per render. Templates memoized by [xt_set_memo]
+ * look up every name they read before rendering.
+ */
 struct Variables {
-    Variables *parent;
-    Variable  *list;
+    Variables  *parent;
+    Variable   *list;
+    xt_resolver resolve;
+    void       *userp;
 };
 
 typedef void (*xt_callback)(const char*, long, void*);
 
+/* The spec of a [value | fmt("..")] filter, parsed from
+ * the format string when the template is compiled. The
+ * format follows Python's:
+ *
+ *   [[fill]align][sign][0][width][,][.precision][type]
+ *
+ * where [align] is one of "<>^", [sign] one of "+- " 
+ * and [type] one of "dfs%". Omitted fields are 0, or
+ * -1 for [width] and [prec].
+ */
+typedef struct {
+    char  fill, align, sign, type;
+    bool  zero, group;
+    short width, prec;
+} XT_FmtSpec;
+
+Value xt_array_get (const ArrayValue *array, long idx);
+Value xt_array_view(ArrayValue *view, const void *data, long count, ArrayType type, long stride);
+Value xt_string    (const char *str, long len);
+Value xt_func      (FuncValue func);
+
+Value xt_map_view(MapValue *map, MapEntry *table, int capacity);
+bool  xt_map_put (MapValue *map, const char *key, long len, Value value);
+bool  xt_map_get (const MapValue *map, const char *key, long len, Value *out);
+
+typedef struct XT_Template XT_Template;
+
+/* How the values printed by {{ .. }} blocks are escaped.
+ * The text of the template is written as it is. Single
+ * blocks can override the mode of the template with the 
+ * [escape], [urlencode] and [safe] filters.
+ */
+typedef enum {
+    XT_ESCAPE_NONE,
+    XT_ESCAPE_HTML, // & < > " ' become entities
+    XT_ESCAPE_URL,  // Bytes other than A-Z a-z 0-9 - . _ ~ become %XX
+} XT_Escape;
+
+/* Flags of xt_compile_flags. With XT_MINIFY, each run of
+ * whitespace in the text of the template is collapsed
+ * into a newline, if the run has one, or a space. With
+ * XT_SEGMENTS, each top-level block is a segment that
+ * [xt_rerender] can render on its own.
+ */
+enum {
+    XT_MINIFY   = 1 << 0,
+    XT_SEGMENTS = 1 << 1,
+};
+
+/* Storage for the output of {% cache key %} blocks. The
+ * key passed to the callbacks identifies the template,
+ * the block and the value of the key expression. [get]
+ * points [data] to the bytes stored for [key] and returns
+ * true, or returns false if there are none. The bytes 
+ * must stay valid until the next call on the cache. 
+ * [put] stores a copy of [len] bytes for [key]. Other
+ * caches can be plugged in by filling the callbacks,
+ * while [xt_cache_create] returns one in memory whose
+ * entries expire after [ttl] seconds (never if 0) and
+ * that evicts the least recently used ones to stay 
+ * within [max_bytes].
+ */
+typedef struct XT_Cache XT_Cache;
+struct XT_Cache {
+    bool (*get)(XT_Cache *cache, const char *key, long keylen, const char **data, long *len);
+    void (*put)(XT_Cache *cache, const char *key, long keylen, const char *data, long len);
+};
+
+XT_Cache *xt_cache_create(long max_bytes, long ttl);
+void      xt_cache_free  (XT_Cache *cache);
+
+XT_Template *xt_compile      (const char *str, long len, XT_Error *err);
+XT_Template *xt_compile_flags(const char *str, long len, int flags, XT_Error *err);
+XT_Template *xt_compile_file (const char *file,          XT_Error *err);
+void         xt_free         (XT_Template *tmpl);
+bool         xt_bind         (XT_Template *tmpl, const char *name, FuncValue func);
+void         xt_set_escape   (XT_Template *tmpl, XT_Escape escape);
+void         xt_set_cache    (XT_Template *tmpl, XT_Cache *cache);
+bool         xt_set_memo     (XT_Template *tmpl, XT_Cache *cache);
+void         xt_invalidate   (XT_Template *tmpl);
+
+bool  xt_render_to_cb (XT_Template *tmpl, Variables *vars, xt_callback callback, void *userp, XT_Error *err);
+char *xt_render_to_str(XT_Template *tmpl, Variables *vars, long *outlen, XT_Error *err);
+
+XT_Template *xt_compile_expr(const char *str, long len, XT_Error *err);
+bool         xt_eval        (XT_Template *expr, Variables *vars, Value *out, XT_Error *err);
+
+/* Results of resolvers shared by several renders and
+ * evaluations, so that each name is resolved at most 
+ * once for all of them. The scopes and the templates
+ * must outlive it.
+ */
+typedef struct XT_Resolved XT_Resolved;
+
+XT_Resolved *xt_resolved_create(void);
+void         xt_resolved_free  (XT_Resolved *resolved);
+bool         xt_render_resolved(XT_Template *tmpl, Variables *vars, XT_Resolved *resolved, xt_callback callback, void *userp, XT_Error *err);
+bool         xt_eval_resolved  (XT_Template *expr, Variables *vars, XT_Resolved *resolved, Value *out, XT_Error *err);
+
+XT_Template *xt_specialize(XT_Template *tmpl, Variables *known, XT_Error *err);
+
+typedef struct XT_Segments XT_Segments;
+
+XT_Segments *xt_render_segments(XT_Template *tmpl, Variables *vars, XT_Error *err);
+bool         xt_rerender       (XT_Segments *segs, Variables *vars, const char **changed, XT_Error *err);
+void         xt_segments_write (XT_Segments *segs, xt_callback callback, void *userp);
+char        *xt_segments_to_str(XT_Segments *segs, long *outlen, XT_Error *err);
+void         xt_segments_free  (XT_Segments *segs);
+
+/* Output made of a list of pieces, which either refer to
+ * bytes owned by someone else (like the text of the 
+ * template) or to copies owned by the rope. Appending
+ * a rope to another with [xt_rope_concat] doesn't copy
+ * bytes. The pieces can be written one at a time or 
+ * gathered into an array for writev, starting from
+ * [xt_rope_first].
+ */
+typedef struct XT_Rope  XT_Rope;
+typedef struct XT_Piece XT_Piece;
+struct XT_Piece {
+    const char *data;
+    long         len;
+    XT_Piece   *next;
+};
+
+XT_Rope  *xt_rope_create     (void);
+void      xt_rope_free       (XT_Rope *rope);
+bool      xt_rope_append     (XT_Rope *rope, const char *data, long len, bool copy);
+void      xt_rope_concat     (XT_Rope *rope, XT_Rope *other);
+long      xt_rope_length     (XT_Rope *rope);
+XT_Piece *xt_rope_first      (XT_Rope *rope);
+void      xt_rope_write      (XT_Rope *rope, xt_callback callback, void *userp);
+bool      xt_render_to_rope  (XT_Template *tmpl, Variables *vars, XT_Rope *rope, XT_Error *err);
+bool      xt_segments_to_rope(XT_Segments *segs, XT_Rope *rope);
+
+typedef struct XT_Json XT_Json;
+
+XT_Json   *xt_json_open (const char *src, long len, Variables *parent);
+Variables *xt_json_scope(XT_Json *json);
+bool       xt_json_check(XT_Json *json, XT_Error *err);
+void       xt_json_close(XT_Json *json);
+
+bool  xt_emit_c(XT_Template *tmpl, const char *name, xt_callback callback, void *userp, XT_Error *err);
+
 bool  xt_render_str_to_cb  (const char *str, long len, Variables *vars, xt_callback callback, void *userp, XT_Error *err);
 bool  xt_render_file_to_cb (const char *file,          Variables *vars, xt_callback callback, void *userp, XT_Error *err);
 char *xt_render_str_to_str (const char *str, long len, Variables *vars, long *outlen, XT_Error *err);
 char *xt_render_file_to_str(const char *file,          Variables *vars, long *outlen, XT_Error *err);
+
+#ifdef __cplusplus
+}
+#endif
 #endif
\ No newline at end of file
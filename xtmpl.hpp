@@ -0,0 +1,709 @@
+#ifndef XTMPL_HPP
+#define XTMPL_HPP
+
+/* C++20 interface to xtmpl where the template source is
+ * a string literal known at compile time:
+ *
+ *   using page = xt::tmpl<"Hello, {{name}}!">;
+ *
+ *   XT_Error err;
+ *   page::render(&vars, [&](std::string_view s) { out += s; }, err);
+ *
+ * The template is sliced and its block structure is
+ * validated by constexpr functions, so a malformed
+ * template is a compile error and the resulting slice
+ * table (with all jump targets resolved) is baked into
+ * the type. The same checks of [slice_up] in xtmpl.c
+ * are done, with the same messages.
+ *
+ * Expressions are compiled by the C library the first
+ * time the template is rendered and evaluated through
+ * [xt_eval_resolved], sharing the resolved names so 
+ * that each one is resolved at most once per render.
+ */
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+#include <utility>
+#include "xtmpl_rt.h" // Along with xtmpl.h, for the xt_rt_* helpers
+
+namespace xt {
+
+/* Owns a [Value] returned by the library. Values can't
+ * be copied, only moved, so each one is freed once.
+ */
+class value {
+public:
+    value() noexcept { v.kind = VK_INT; v.as_int = 0; }
+    explicit value(Value v) noexcept : v(v) {}
+    value(value &&other) noexcept : v(other.release()) {}
+    value(const value&) = delete;
+    value &operator=(const value&) = delete;
+    value &operator=(value &&other) noexcept
+    {
+        if(this != &other) {
+            xt_rt_free(&v);
+            v = other.release();
+        }
+        return *this;
+    }
+    ~value() { xt_rt_free(&v); }
+
+    const Value &get() const noexcept { return v; }
+    const Value *operator->() const noexcept { return &v; }
+
+    Value release() noexcept
+    {
+        Value r = v;
+        v.kind = VK_INT;
+        v.as_int = 0;
+        return r;
+    }
+
+private:
+    Value v;
+};
+
+template<std::size_t N>
+struct fixed_string {
+    char str[N] {};
+
+    constexpr fixed_string(const char (&s)[N])
+    {
+        for(std::size_t i = 0; i < N; i += 1)
+            str[i] = s[i];
+    }
+
+    constexpr std::string_view view() const { return { str, N-1 }; }
+};
+
+enum class slice_kind {
+    text,
+    expr,
+    if_,
+    else_,
+    endif,
+    for_,
+    endfor,
+    set_,
+    cache_,
+    endcache,
+};
+
+/* For [text] and [expr] slices, [off] and [len] refer to
+ * the text or the expression. For [if_] they refer to the
+ * condition, for [for_] to the collection expression,
+ * for [set_] to the assigned expression and for [cache_]
+ * to the key. There's no fragment cache here, so the
+ * body of a {% cache %} block is always rendered.
+ *
+ * [jump] is the slice where execution continues when:
+ *   - if_    : the condition is false (after the else or the endif)
+ *   - else_  : the then-branch is complete (the endif)
+ *   - for_   : the collection is empty (after the endfor)
+ *   - endfor : there are more items (after the for)
+ */
+struct slice {
+    slice_kind kind;
+    std::size_t off = 0, len = 0;
+    std::size_t jump = 0;
+    std::size_t var1_off = 0, var1_len = 0;
+    std::size_t var2_off = 0, var2_len = 0;
+    int depth = 0; // Loop nesting level of for_ and endfor, index of set_
+    int level = 0; // Block nesting level of if_, else_, endif, cache_ and endcache
+};
+
+namespace detail {
+
+constexpr int max_depth = 8;
+
+constexpr bool is_space(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r'; }
+constexpr bool is_alpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+constexpr bool is_digit(char c) { return c >= '0' && c <= '9'; }
+constexpr bool is_name (char c) { return is_alpha(c) || is_digit(c) || c == '_'; }
+
+// Returns the offset of the [x][y] pair ending the block
+// that [i] is in, skipping string literals like the C
+// slicer does.
+constexpr std::size_t skip_block(std::string_view src, std::size_t i, char x, char y)
+{
+    std::size_t len = src.size();
+    while(i < len && (i+1 >= len || src[i] != x || src[i+1] != y)) {
+        if(src[i] == '"' || src[i] == '\'') {
+            char quote = src[i++];
+            while(i < len && src[i] != quote)
+                i += 1;
+            if(i == len)
+                break;
+        }
+        i += 1;
+    }
+    return i;
+}
+
+constexpr bool is_kword(std::string_view s)
+{
+    return s == "in" || s == "if" || s == "for" || s == "else" || s == "endif" || s == "endfor"
+        || s == "set" || s == "and" || s == "or" || s == "not";
+}
+
+/* Same as [parse_for_statement] in xtmpl.c. Offsets are
+ * absolute. Errors are thrown, which makes them compile
+ * errors when evaluated in a constant expression.
+ */
+constexpr void parse_for_statement(std::string_view src, slice &s)
+{
+    std::size_t i = s.off, len = s.off + s.len;
+
+    while(i < len && is_space(src[i]))
+        i += 1;
+    if(i == len)
+        throw "For statement ended unexpectedly";
+
+    if(!is_alpha(src[i]) && src[i] != '_')
+        throw "Missing iteration variable name after [for] keyword";
+
+    s.var1_off = i;
+    do i += 1; while(i < len && is_name(src[i]));
+    s.var1_len = i - s.var1_off;
+
+    if(is_kword(src.substr(s.var1_off, s.var1_len)))
+        throw "Unexpected keyword where an iteration variable name was expected";
+    if(s.var1_len > 31)
+        throw "Variable name is too long (the maximum is 31)";
+
+    while(i < len && is_space(src[i]))
+        i += 1;
+    if(i == len)
+        throw "For statement ended unexpectedly";
+
+    if(src[i] == ',') {
+
+        i += 1;
+        while(i < len && is_space(src[i]))
+            i += 1;
+        if(i == len)
+            throw "For statement ended unexpectedly";
+
+        if(!is_alpha(src[i]) && src[i] != '_')
+            throw "Missing second iteration variable name after ','";
+
+        s.var2_off = i;
+        do i += 1; while(i < len && is_name(src[i]));
+        s.var2_len = i - s.var2_off;
+
+        if(is_kword(src.substr(s.var2_off, s.var2_len)))
+            throw "Unexpected keyword where an iteration variable name was expected";
+        if(s.var2_len > 31)
+            throw "Variable name is too long (the maximum is 31)";
+    }
+
+    while(i < len && is_space(src[i]))
+        i += 1;
+    if(i == len)
+        throw "For statement ended unexpectedly";
+
+    if(!is_alpha(src[i]) && src[i] != '_')
+        throw "Missing [in] keyword after iteration variable name";
+
+    std::size_t kword_off = i;
+    do i += 1; while(i < len && is_name(src[i]));
+    if(src.substr(kword_off, i - kword_off) != "in")
+        throw "Missing [in] keyword after iteration variable name";
+
+    // The collection starts at its first token, where the
+    // C library reports it isn't iterable.
+    while(i < len && is_space(src[i]))
+        i += 1;
+
+    s.len = len - i;
+    s.off = i;
+}
+
+/* Same as [parse_set_statement] in xtmpl.c */
+constexpr void parse_set_statement(std::string_view src, slice &s)
+{
+    std::size_t i = s.off, len = s.off + s.len;
+
+    while(i < len && is_space(src[i]))
+        i += 1;
+    if(i == len)
+        throw "Set statement ended unexpectedly";
+
+    if(!is_alpha(src[i]) && src[i] != '_')
+        throw "Missing variable name after [set] keyword";
+
+    s.var1_off = i;
+    do i += 1; while(i < len && is_name(src[i]));
+    s.var1_len = i - s.var1_off;
+
+    if(is_kword(src.substr(s.var1_off, s.var1_len)))
+        throw "Unexpected keyword where a variable name was expected";
+    if(s.var1_len > 31)
+        throw "Variable name is too long (the maximum is 31)";
+
+    while(i < len && is_space(src[i]))
+        i += 1;
+    if(i == len || src[i] != '=')
+        throw "Missing [=] after variable name";
+    i += 1;
+
+    s.len = len - i;
+    s.off = i;
+}
+
+/* Slices [src] into [out] and returns the number of
+ * slices. When [out] is null, only counts them. Blocks
+ * left open at the end of the source are closed by
+ * appending the missing endif and endfor slices.
+ */
+constexpr std::size_t slice_up(std::string_view src, slice *out)
+{
+    std::size_t count = 0;
+    auto push = [&](slice s) {
+        if(out) out[count] = s;
+        count += 1;
+    };
+
+    struct open_block {
+        slice_kind kind;
+        std::size_t idx;
+        std::size_t else_idx;
+        bool has_else;
+    };
+    open_block open[max_depth] {};
+    int depth = 0;
+    int loops = 0;
+    int sets  = 0;
+
+    auto close = [&](std::size_t end) {
+        open_block &b = open[depth-1];
+        if(out) {
+            if(b.kind == slice_kind::if_) {
+                if(b.has_else) {
+                    out[b.idx].jump = b.else_idx + 1;
+                    out[b.else_idx].jump = end;
+                } else
+                    out[b.idx].jump = end;
+            } else if(b.kind == slice_kind::cache_) {
+                out[b.idx].jump = end + 1;
+            } else {
+                out[b.idx].jump = end + 1;
+                out[end].jump = b.idx + 1;
+                out[end].depth = loops-1;
+            }
+        }
+        if(b.kind == slice_kind::for_)
+            loops -= 1;
+        depth -= 1;
+    };
+
+    // Trim markers ("{%-", "-%}", "{{-", "-}}") drop the
+    // whitespace on their side, like in [slice_up] of
+    // xtmpl.c.
+    auto is_space = [](char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f'; };
+    bool trim = false;
+
+    std::size_t i = 0, len = src.size();
+    while(1) {
+
+        if(trim)
+            while(i < len && is_space(src[i]))
+                i += 1;
+
+        std::size_t text_off = i;
+        while(i < len && (i+1 >= len || src[i] != '{' || (src[i+1] != '%' && src[i+1] != '{')))
+            i += 1;
+        std::size_t text_end = i;
+        if(i+2 < len && src[i+2] == '-')
+            while(text_end > text_off && is_space(src[text_end-1]))
+                text_end -= 1;
+        if(text_end > text_off)
+            push({ slice_kind::text, text_off, text_end - text_off });
+
+        if(i == len)
+            break;
+
+        bool stmt = src[i+1] == '%';
+        i += 2;
+        if(i < len && src[i] == '-')
+            i += 1;
+
+        // Drops the marker at the end of the block [s]
+        auto trim_end = [&](slice &s) {
+            trim = i < len && s.len > 0 && src[i-1] == '-';
+            if(trim)
+                s.len -= 1;
+        };
+
+        slice s { slice_kind::expr };
+        if(stmt) {
+
+            while(i < len && (src[i] == ' ' || src[i] == '\t' || src[i] == '\n'))
+                i += 1;
+
+            if(i == len || (!is_alpha(src[i]) && src[i] != '_'))
+                throw "block {% .. %} doesn't start with a keyword";
+
+            std::size_t kword_off = i;
+            do i += 1; while(i < len && (is_alpha(src[i]) || src[i] == '_'));
+            std::string_view kword = src.substr(kword_off, i - kword_off);
+
+            if(kword == "if" || kword == "for") {
+                if(depth == max_depth)
+                    throw "Too many nested {% if .. %}, {% for .. %} and {% cache .. %} blocks";
+                s.kind = (kword == "if") ? slice_kind::if_ : slice_kind::for_;
+                if(s.kind == slice_kind::for_)
+                    s.depth = loops++;
+                s.level = depth;
+                open[depth++] = { s.kind, count, 0, false };
+            } else if(kword == "else") {
+                if(depth == 0 || open[depth-1].kind != slice_kind::if_)
+                    throw "{% else %} has no matching {% if .. %}";
+                if(open[depth-1].has_else)
+                    throw "Can't have multiple {% else %} blocks relative to only one {% if .. %}";
+                open[depth-1].has_else = true;
+                open[depth-1].else_idx = count;
+                s.kind = slice_kind::else_;
+                s.level = depth-1;
+            } else if(kword == "endif") {
+                if(depth == 0 || open[depth-1].kind != slice_kind::if_)
+                    throw "{% endif %} has no matching {% if .. %}";
+                s.kind = slice_kind::endif;
+                s.level = depth-1;
+            } else if(kword == "endfor") {
+                if(depth == 0 || open[depth-1].kind != slice_kind::for_)
+                    throw "{% endfor %} has no matching {% for .. %}";
+                s.kind = slice_kind::endfor;
+            } else if(kword == "cache") {
+                if(depth == max_depth)
+                    throw "Too many nested {% if .. %}, {% for .. %} and {% cache .. %} blocks";
+                s.kind = slice_kind::cache_;
+                s.level = depth;
+                open[depth++] = { s.kind, count, 0, false };
+            } else if(kword == "endcache") {
+                if(depth == 0 || open[depth-1].kind != slice_kind::cache_)
+                    throw "{% endcache %} has no matching {% cache .. %}";
+                s.kind = slice_kind::endcache;
+                s.level = depth-1;
+            } else if(kword == "set") {
+                s.kind = slice_kind::set_;
+                s.depth = sets++;
+            } else
+                throw "Bad {% .. %} block keyword";
+
+            s.off = i;
+            i = skip_block(src, i, '%', '}');
+            s.len = i - s.off;
+            trim_end(s);
+
+            if(s.kind == slice_kind::for_)
+                parse_for_statement(src, s);
+            if(s.kind == slice_kind::set_)
+                parse_set_statement(src, s);
+
+        } else {
+            s.off = i;
+            i = skip_block(src, i, '}', '}');
+            s.len = i - s.off;
+            trim_end(s);
+        }
+
+        if(i < len)
+            i += 2;
+
+        push(s);
+        if(s.kind == slice_kind::endif || s.kind == slice_kind::endfor || s.kind == slice_kind::endcache)
+            close(count-1);
+    }
+
+    while(depth > 0) {
+        slice_kind kind = open[depth-1].kind;
+        slice s { kind == slice_kind::if_ ? slice_kind::endif : kind == slice_kind::cache_ ? slice_kind::endcache : slice_kind::endfor, len, 0 };
+        s.level = depth-1;
+        push(s);
+        close(count-1);
+    }
+    return count;
+}
+
+template<class Sink>
+void sink_callback(const char *str, long len, void *userp)
+{
+    (*static_cast<Sink*>(userp))(std::string_view(str, len));
+}
+
+inline void locate(XT_Error &err, std::string_view src)
+{
+    long col = 1, row = 1;
+    for(long i = 0; i < err.off && i < (long) src.size(); i += 1) {
+        col += 1;
+        if(src[i] == '\n') {
+            col = 0;
+            row += 1;
+        }
+    }
+    err.col = col;
+    err.row = row;
+}
+
+} // namespace detail
+
+template<fixed_string Src>
+class tmpl {
+public:
+    static constexpr std::string_view source = Src.view();
+    static constexpr std::size_t slice_count = detail::slice_up(Src.view(), nullptr);
+    static constexpr std::array<slice, slice_count> slices = [] {
+        std::array<slice, slice_count> list {};
+        detail::slice_up(Src.view(), list.data());
+        return list;
+    }();
+    static constexpr std::size_t set_count = [] {
+        std::size_t count = 0;
+        for(const slice &s : slices)
+            if(s.kind == slice_kind::set_)
+                count += 1;
+        return count;
+    }();
+
+    /* Renders the template by calling [sink] with a
+     * std::string_view for each chunk of output. Text
+     * chunks point into the template literal.
+     */
+    template<class Sink>
+    static bool render(Variables *vars, Sink &&sink, XT_Error &err)
+    {
+        using S = std::remove_reference_t<Sink>;
+        xt_callback callback = detail::sink_callback<S>;
+
+        struct frame {
+            value coll;
+            long  idx = 0;
+            Variable list[3];
+            Variables scope;
+        };
+        frame frames[detail::max_depth];
+
+        // Each {% set .. %} defines its variable in a scope
+        // of its own, which is dropped by restoring [vars]
+        // at the end of the enclosing block.
+        struct local {
+            value val;
+            Variable list[2];
+            Variables scope;
+        };
+        local locals[set_count ? set_count : 1];
+        Variables *outer[detail::max_depth];
+
+        // Without memory for it, names are resolved once
+        // per slice instead of once per render.
+        struct resolved_memo {
+            XT_Resolved *ptr = xt_resolved_create();
+            ~resolved_memo() { xt_resolved_free(ptr); }
+        } resolved;
+
+        err = XT_Error {};
+
+        XT_Template *const *exprs = expressions(err);
+        if(exprs == nullptr)
+            return false;
+
+        std::size_t i = 0;
+        while(i < slice_count) {
+
+            const slice &s = slices[i];
+            switch(s.kind) {
+
+                case slice_kind::text:
+                sink(source.substr(s.off, s.len));
+                i += 1;
+                break;
+
+                case slice_kind::expr:
+                {
+                    // Rendered like a template of one {{ .. }} 
+                    // block, so that [join] can write its result
+                    if(!xt_render_resolved(exprs[i], vars, resolved.ptr, callback, &sink, &err)) {
+                        if(err.off >= 0)
+                            err.off += s.off;
+                        detail::locate(err, source);
+                        return false;
+                    }
+                    i += 1;
+                    break;
+                }
+
+                case slice_kind::if_:
+                {
+                    outer[s.level] = vars;
+                    value v;
+                    if(!eval(exprs[i], vars, resolved.ptr, s, v, err))
+                        return false;
+                    if(!xt_rt_test(v.get()))
+                        i = s.jump;
+                    else
+                        i += 1;
+                    break;
+                }
+
+                case slice_kind::else_:
+                vars = outer[s.level];
+                i = s.jump;
+                break;
+
+                case slice_kind::endif:
+                vars = outer[s.level];
+                i += 1;
+                break;
+
+                case slice_kind::for_:
+                {
+                    frame &f = frames[s.depth];
+                    if(!eval(exprs[i], vars, resolved.ptr, s, f.coll, err))
+                        return false;
+
+                    if(f.coll->kind != VK_ARRAY && f.coll->kind != VK_ITER) {
+                        fail(err, s.off, "Iteration subject isn't an array or an iterator");
+                        return false;
+                    }
+
+                    Value item;
+                    if(!xt_rt_next(f.coll.get(), 0, &item)) {
+                        f.coll = value();
+                        i = s.jump;
+                        break;
+                    }
+
+                    f.idx = 0;
+                    f.list[0] = { source.data() + s.var1_off, (long) s.var1_len, { VK_INT, 0, { .as_int = 0 } } };
+                    f.list[1] = { source.data() + s.var2_off, (long) s.var2_len, item };
+                    f.list[2] = { nullptr, 0, { VK_INT, 0, { .as_int = 0 } } };
+                    f.scope = { vars, f.list, nullptr, nullptr };
+                    vars = &f.scope;
+                    i += 1;
+                    break;
+                }
+
+                case slice_kind::endfor:
+                {
+                    frame &f = frames[s.depth];
+                    f.idx += 1;
+                    Value item;
+                    if(xt_rt_next(f.coll.get(), f.idx, &item)) {
+                        f.list[0].value.as_int = f.idx;
+                        f.list[1].value = item;
+                        vars = &f.scope;
+                        i = s.jump;
+                    } else {
+                        vars = f.scope.parent;
+                        f.coll = value();
+                        i += 1;
+                    }
+                    break;
+                }
+
+                case slice_kind::cache_:
+                {
+                    // The key is evaluated for its errors only
+                    outer[s.level] = vars;
+                    value v;
+                    if(!eval(exprs[i], vars, resolved.ptr, s, v, err))
+                        return false;
+                    i += 1;
+                    break;
+                }
+
+                case slice_kind::endcache:
+                vars = outer[s.level];
+                i += 1;
+                break;
+
+                case slice_kind::set_:
+                {
+                    local &l = locals[s.depth];
+                    value v;
+                    if(!eval(exprs[i], vars, resolved.ptr, s, v, err))
+                        return false;
+                    l.val = std::move(v);
+                    l.list[0] = { source.data() + s.var1_off, (long) s.var1_len, l.val.get() };
+                    l.list[1] = { nullptr, 0, { VK_INT, 0, { .as_int = 0 } } };
+                    l.scope = { vars, l.list, nullptr, nullptr };
+                    vars = &l.scope;
+                    i += 1;
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    /* Compiles the expressions of the template the first
+     * time it's rendered. The result is indexed by slice.
+     */
+    static XT_Template *const *expressions(XT_Error &err)
+    {
+        struct table {
+            XT_Template *list[slice_count ? slice_count : 1] {};
+            XT_Error err {};
+            bool ok = true;
+
+            table()
+            {
+                for(std::size_t i = 0; ok && i < slice_count; i += 1) {
+                    const slice &s = slices[i];
+                    if(s.kind == slice_kind::expr || s.kind == slice_kind::if_ || 
+                       s.kind == slice_kind::for_ || s.kind == slice_kind::set_ ||
+                       s.kind == slice_kind::cache_) {
+                        list[i] = xt_compile_expr(source.data() + s.off, s.len, &err);
+                        if(list[i] == nullptr) {
+                            ok = false;
+                            if(err.off >= 0)
+                                err.off += s.off;
+                            detail::locate(err, source);
+                        }
+                    }
+                }
+            }
+
+            ~table()
+            {
+                for(XT_Template *expr : list)
+                    xt_free(expr);
+            }
+        };
+        static table t;
+
+        if(!t.ok) {
+            err = t.err;
+            return nullptr;
+        }
+        return t.list;
+    }
+
+    static bool eval(XT_Template *expr, Variables *vars, XT_Resolved *resolved, 
+                     const slice &s, value &out, XT_Error &err)
+    {
+        Value v;
+        if(!xt_eval_resolved(expr, vars, resolved, &v, &err)) {
+            if(err.off >= 0)
+                err.off += s.off;
+            detail::locate(err, source);
+            return false;
+        }
+        out = value(v);
+        return true;
+    }
+
+    static void fail(XT_Error &err, std::size_t off, const char *msg)
+    {
+        xt_rt_error(&err, off, -1, -1, "%s", msg);
+        detail::locate(err, source);
+    }
+};
+
+} // namespace xt
+
+#endif
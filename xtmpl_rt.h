@@ -0,0 +1,37 @@
+#ifndef XTMPL_RT_H
+#define XTMPL_RT_H
+
+/* Runtime support for the code generated by xt_emit_c,
+ * which includes this header. These functions aren't 
+ * part of the interface of the library and may change
+ * along with the generator.
+ */
+
+#include "xtmpl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool  xt_rt_lookup(Variables *vars, const char *name, long len, Value *out);
+bool  xt_rt_apply (const char *operat, Value lhs, Value rhs, Value *out, const char **err);
+bool  xt_rt_test  (Value val);
+bool  xt_rt_append(Value *array, Value item, const char **err);
+bool  xt_rt_field (Value obj, const char *name, long len, unsigned int hash, Value *out, const char **err);
+bool  xt_rt_index (Value obj, Value key, Value *out, const char **err);
+bool  xt_rt_slice (Value obj, Value start, Value stop, Value *out, const char **err);
+bool  xt_rt_next  (Value coll, long idx, Value *item);
+bool  xt_rt_call  (Variables *vars, const char *name, long len, Value *args, int argc, Value *out, const char **err);
+bool  xt_rt_filter(Variables *vars, const char *name, long len, Value *args, int argc, Value *out, const char **err);
+bool  xt_rt_join  (Value *args, int argc, XT_Escape escape, xt_callback callback, void *userp, const char **err);
+bool  xt_rt_fmt   (Value val, const XT_FmtSpec *spec, XT_Escape escape, xt_callback callback, void *userp, const char **err);
+void  xt_rt_print (Value val, xt_callback callback, void *userp);
+void  xt_rt_escape(Value val, XT_Escape escape, xt_callback callback, void *userp);
+Value xt_rt_retain(Value val);
+void  xt_rt_free  (Value *val);
+void  xt_rt_error (XT_Error *err, long off, long row, long col, const char *fmt, ...);
+
+#ifdef __cplusplus
+}
+#endif
+#endif